@@ -1,204 +1,6939 @@
 /*
 C++ Receive UDP raw/syslog messages and store to sqlite3 database
-Database file is rotated each hour
+Database file is rotated each hour (per store interval and size cap)
 Database files is compressed after X days (default 7 days) by xz
 
 (c) Denys Fedoryshchenko, 2023
 SPDX-License-Identifier: LGPL-2.1-only
 */
-#include <queue>
-#include <tuple>
+#include <deque>
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <iterator>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/select.h>
 #include <sqlite3.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/bpf.h>
+#include <linux/if_xdp.h>
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <time.h>
+#include <signal.h>
 #include <pthread.h>
 #include <dirent.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#define MAX_LISTENERS 16
+#define MAX_STORES 16
+#define MAX_SHARDS 16
+#define MAX_UPSTREAMS 16
 
 struct {
     char *dbdir;
-    char *ip;
+    char *listen[MAX_LISTENERS];
+    int nlisten;
+    char *unix_path;
     int port;
     int verbose;
     int compress_age;
+    double ratelimit_rate;
+    double ratelimit_burst;
+    int ratelimit_table;
+    int dedup;
+    int dedup_window;
+    int dedup_delay;
+    char *stats_file;
+    char *storage;
+    int parquet;
+    char *export_file;
+    int compress_messages;
+    int filter;
+    char *filter_file;
+    int templates;
+    int template_workers;
+    char *tail_path;
+    char *rules_file;
+    char *stores[MAX_STORES];
+    int nstores;
+    char *forward[MAX_UPSTREAMS];
+    int nforward;
+    char *forward_backlog;
+    char *forward_file;
+    int forward_hash;
+    int journal;
+    char *upgrade_path;
+    int shards;
+    int numa;
+    char *xdp_ifname;
+    int xdp_queues;
+    char *socket_filter;
+    int rcvbuf_max;
+    int query;
+    char *query_host;
+    char *query_grep;
+    char *query_token;
+    int query_volume;
+    int query_patterns;
+    char *query_from;
+    char *query_to;
 } config;
 
-struct {
-    int sock;
-    sqlite3 *db;
-} fd;
+#define RCVBUF_INITIAL 262144
+#define RCVBUF_MAX (64 * 1024 * 1024)
+// largest --rcvbuf-max, kernel doubles request into int
+#define RCVBUF_LIMIT (1024 * 1024 * 1024)
+#define RCVBUF_SAMPLE 64
+
+// receive buffer of UDP listener, grown while kernel drops datagrams
+struct rxbuf {
+    // effective SO_RCVBUF (kernel doubles requested size)
+    int size;
+    // last SO_RXQ_OVFL counter, drops is its running total
+    uint32_t ovfl;
+    uint64_t drops;
+    uint64_t adjusted_drops;
+    // queued bytes, sampled every RCVBUF_SAMPLE datagrams
+    int reads;
+    int peak;
+    int capped;
+    char label[INET6_ADDRSTRLEN + 16];
+};
+
+struct {
+    int socks[MAX_LISTENERS];
+    int nsocks;
+    int unixsock;
+    rxbuf rx[MAX_LISTENERS];
+} fd;
+
+#define XDP_MAX_QUEUES 16
+#define XDP_FRAMES 4096
+#define XDP_FRAME_SIZE 2048
+
+// mmapped AF_XDP ring, producer/consumer are shared with kernel
+struct xdp_ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *ring;
+    uint32_t size;
+    void *map;
+    size_t maplen;
+};
+
+// address and port redirected by XDP program, address as it lies in packet
+struct xdp_dest {
+    int family;
+    uint8_t addr[16];
+    uint16_t port;
+};
+
+/*
+    * AF_XDP fast path (--xdp), one socket with its own UMEM per NIC queue.
+    * Attached program redirects UDP to listen addresses, everything else (and
+    * queues without socket) goes on to regular listeners
+*/
+struct {
+    int ifindex;
+    int prog;
+    int map;
+    int link;
+    int nqueues;
+    struct {
+        int fd;
+        char *umem;
+        xdp_ring fill;
+        xdp_ring comp;
+        xdp_ring rx;
+        // frames read from rx ring that did not fit into fill ring yet
+        uint64_t spare[XDP_FRAMES];
+        uint32_t nspare;
+    } q[XDP_MAX_QUEUES];
+    uint64_t received;
+    uint64_t malformed;
+} xdp;
+
+#define VERSION "0.1a"
+
+// sender address, IPv4 senders are stored as v4-mapped IPv6 (::ffff:a.b.c.d)
+struct hostaddr {
+    uint8_t a[16];
+};
+
+struct logentry {
+    int ts;
+    hostaddr host;
+    // sender credentials for local (unix socket) messages, -1 for network
+    int pid;
+    int uid;
+    // syslog PRI, facility * 8 + severity, parsed before enqueue
+    int pri;
+    std::string msg;
+    // folded consecutive repeats (dedup), last_ts is time of last repeat
+    int repeat = 1;
+    int last_ts = 0;
+    // set by routing rules: comma separated tags, target store (0 = main)
+    std::string tags;
+    int store = 0;
+    // offset of record in store journal, -1 when not journaled
+    int64_t jofs = -1;
+};
+
+// template assigned by miner, id 0 when message was not mined
+struct msg_template {
+    int cluster;
+    int id;
+    std::string params;
+    // message is exactly template with params substituted, text need not be stored
+    int exact;
+};
+
+/*
+    * Queue has one lane per syslog severity (0 emerg .. 7 debug)
+    * Writer drains lanes in severity order, overload sheds lowest severity first
+*/
+#define NUM_SEVERITIES 8
+#define QUEUE_MAX 100000
+#define BATCH_MAX 1000
+#define DEFAULT_PRI 13  // user.notice, RFC3164 default when PRI is missing
+
+struct msg_queue {
+    std::deque<logentry> lanes[NUM_SEVERITIES];
+    size_t size;
+    uint64_t dropped[NUM_SEVERITIES];
+    pthread_mutex_t lock;
+};
+
+bool dbfile_before(const std::string &a, const std::string &b);
+
+// period order, files of the same period (sidecars) by name
+struct dbfile_order {
+    bool operator()(const std::string &a, const std::string &b) const {
+        if (dbfile_before(a, b))
+            return true;
+        if (dbfile_before(b, a))
+            return false;
+        return a < b;
+    }
+};
+
+/*
+    * Named stores, each with own directory, rotation policy, queue and writer
+    * thread. Store 0 is main store in dbdir, others are added by --store.
+    * Durations are in seconds, 0 disables size cap, retention, compression
+    * or quota.
+    * Store with writer shards is a run of consecutive entries, one per shard;
+    * shard 0 owns disk usage and housekeeping of the directory.
+*/
+struct logstore {
+    const char *name;
+    const char *dir;
+    int interval;
+    off_t max_size;
+    int retention;
+    int compress_age;
+    off_t quota;
+    // evicted files are moved here instead of deleted (same filesystem)
+    const char *archive;
+    int shard;
+    int nshards;
+    // NUMA node of storage device (--numa), -1 when unknown or disabled
+    int node;
+    msg_queue queue;
+
+    // disk usage of period files and sidecars, updated as they change
+    pthread_mutex_t usage_lock;
+    std::map<std::string, off_t, dbfile_order> files;
+    off_t usage;
+    // file being written by each shard
+    std::vector<std::string> current;
+    uint64_t evicted;
+
+    /*
+        * Write-ahead journal (--journal), offsets are logical byte offsets
+        * over all segments. jpending, jend, japplied and jfloor are guarded
+        * by queue.lock; segment fd and list belong to journal thread.
+    */
+    std::string jpending;
+    int64_t jend;
+    int64_t japplied;
+    // replay cursor, records from here on are not queued yet
+    int64_t jfloor;
+    // offsets applied above watermark, recovered at startup for writer
+    std::set<int64_t> jahead;
+    int jfd;
+    off_t jsize;
+    std::vector<int64_t> jsegs;
+    // segments found at startup, messages received while they are replayed
+    std::vector<int64_t> jreplay;
+    std::deque<logentry> held;
+    int replaying;
+    // seconds from process start to first committed batch, 0 until then
+    double first_insert;
+    // writer closed its file after handoff drain
+    volatile int stopped;
+};
+
+struct {
+    logstore list[MAX_STORES * MAX_SHARDS];
+    int n;
+} stores;
+
+struct timespec startup_time;
+
+/*
+    * Binary upgrade (--upgrade-socket): new process takes listening sockets
+    * over control socket, old process drains its queues and exits
+*/
+struct {
+    // control socket accepting new process, -1 while not listening
+    int ctl;
+    // new process: connection to old one until it has drained
+    int peer;
+    // received by new process before old one is drained, sockets are not
+    // read while it is full
+    std::deque<logentry> pending;
+    uint64_t dropped;
+    volatile int draining;
+    volatile int journal_stop;
+    volatile int journal_done;
+} handoff;
+
+// long-only options
+enum {
+    OPT_RATELIMIT = 256,
+    OPT_RATELIMIT_BURST,
+    OPT_RATELIMIT_TABLE,
+    OPT_DEDUP,
+    OPT_DEDUP_WINDOW,
+    OPT_DEDUP_DELAY,
+    OPT_STATS_FILE,
+    OPT_STORAGE,
+    OPT_PARQUET,
+    OPT_EXPORT_PARQUET,
+    OPT_COMPRESS_MESSAGES,
+    OPT_FILTER,
+    OPT_BUILD_FILTER,
+    OPT_TOKEN,
+    OPT_TAIL_SOCKET,
+    OPT_VOLUME,
+    OPT_TEMPLATES,
+    OPT_TEMPLATE_WORKERS,
+    OPT_PATTERNS,
+    OPT_RULES,
+    OPT_STORE,
+    OPT_FORWARD,
+    OPT_FORWARD_BACKLOG,
+    OPT_FORWARD_FILE,
+    OPT_FORWARD_MODE,
+    OPT_JOURNAL,
+    OPT_UPGRADE_SOCKET,
+    OPT_SHARDS,
+    OPT_NUMA,
+    OPT_XDP,
+    OPT_SOCKET_FILTER,
+    OPT_RCVBUF_MAX,
+};
+
+void hour_closed(const char *path);
+void usage_update(const std::string &path);
+
+void init_new_db(sqlite3 *db) {
+    const char *sql = "CREATE TABLE IF NOT EXISTS log (id INTEGER PRIMARY KEY AUTOINCREMENT, timestamp INTEGER, host BLOB, message TEXT, pid INTEGER, uid INTEGER, repeat INTEGER, last_timestamp INTEGER);";
+    char *err_msg = 0;
+    int rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
+    if (rc != SQLITE_OK ) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+    }
+    sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS rollup (minute INTEGER, host BLOB, severity INTEGER, count INTEGER, bytes INTEGER, PRIMARY KEY (minute, host, severity)) WITHOUT ROWID;", 0, 0, NULL);
+    // hour file created by older version, add missing columns (error if exists is expected)
+    sqlite3_exec(db, "ALTER TABLE log ADD COLUMN pid INTEGER;", 0, 0, NULL);
+    sqlite3_exec(db, "ALTER TABLE log ADD COLUMN uid INTEGER;", 0, 0, NULL);
+    sqlite3_exec(db, "ALTER TABLE log ADD COLUMN repeat INTEGER;", 0, 0, NULL);
+    sqlite3_exec(db, "ALTER TABLE log ADD COLUMN last_timestamp INTEGER;", 0, 0, NULL);
+    sqlite3_exec(db, "ALTER TABLE log ADD COLUMN template INTEGER;", 0, 0, NULL);
+    sqlite3_exec(db, "ALTER TABLE log ADD COLUMN params TEXT;", 0, 0, NULL);
+    sqlite3_exec(db, "ALTER TABLE log ADD COLUMN tags TEXT;", 0, 0, NULL);
+}
+
+/*
+    * Convert socket address to 16-byte binary form
+*/
+void sockaddr_to_host(const struct sockaddr_storage *ss, hostaddr *host) {
+    memset(host, 0, sizeof(*host));
+    if (ss->ss_family == AF_INET6) {
+        memcpy(host->a, &((const struct sockaddr_in6 *)ss)->sin6_addr, 16);
+    } else if (ss->ss_family == AF_INET) {
+        host->a[10] = 0xff;
+        host->a[11] = 0xff;
+        memcpy(host->a + 12, &((const struct sockaddr_in *)ss)->sin_addr, 4);
+    }
+}
+
+/*
+    * Format binary address as text, v4-mapped addresses are shown as plain IPv4
+*/
+void host_ntop(const uint8_t *a, char *buf, socklen_t len) {
+    static const uint8_t v4mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    if (memcmp(a, v4mapped, 12) == 0)
+        inet_ntop(AF_INET, a + 12, buf, len);
+    else
+        inet_ntop(AF_INET6, a, buf, len);
+}
+
+/*
+    * Parse text address (IPv4 or IPv6) into 16-byte binary form
+    * Return 0 on success, -1 on error
+*/
+int host_pton(const char *str, hostaddr *host) {
+    struct in_addr in4;
+    memset(host, 0, sizeof(*host));
+    if (inet_pton(AF_INET, str, &in4) == 1) {
+        host->a[10] = 0xff;
+        host->a[11] = 0xff;
+        memcpy(host->a + 12, &in4, 4);
+        return 0;
+    }
+    if (inet_pton(AF_INET6, str, host->a) == 1)
+        return 0;
+    return -1;
+}
+
+// address of IPv4 sender (v4-mapped)
+static inline int host_is_v4(const hostaddr *host) {
+    static const uint8_t v4mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    return memcmp(host->a, v4mapped, 12) == 0;
+}
+
+/*
+    * Parse listen spec: ADDR, ADDR:PORT, [V6ADDR]:PORT, :PORT or V6ADDR
+    * Empty or missing address means dual-stack wildcard
+    * Return 0 on success, -1 on error
+*/
+int parse_listen(const char *spec, int default_port, struct sockaddr_storage *ss, socklen_t *sslen) {
+    char addr[INET6_ADDRSTRLEN + 1] = {0};
+    int port = default_port;
+    const char *colon;
+
+    if (spec[0] == '[') {
+        const char *end = strchr(spec, ']');
+        if (end == NULL || end - spec - 1 > INET6_ADDRSTRLEN)
+            return -1;
+        memcpy(addr, spec + 1, end - spec - 1);
+        if (end[1] == ':')
+            port = atoi(end + 2);
+        else if (end[1] != 0)
+            return -1;
+    } else if ((colon = strchr(spec, ':')) != NULL && strchr(colon + 1, ':') == NULL) {
+        // single colon: ADDR:PORT or :PORT
+        if (colon - spec > INET6_ADDRSTRLEN)
+            return -1;
+        memcpy(addr, spec, colon - spec);
+        port = atoi(colon + 1);
+    } else {
+        // bare IPv4 or IPv6 address
+        if (strlen(spec) > INET6_ADDRSTRLEN)
+            return -1;
+        strcpy(addr, spec);
+    }
+    if (port <= 0 || port > 65535)
+        return -1;
+
+    memset(ss, 0, sizeof(*ss));
+    if (addr[0] == 0) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        sin6->sin6_addr = in6addr_any;
+        *sslen = sizeof(*sin6);
+        return 0;
+    }
+    struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+    if (inet_pton(AF_INET, addr, &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        *sslen = sizeof(*sin);
+        return 0;
+    }
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+    if (inet_pton(AF_INET6, addr, &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        *sslen = sizeof(*sin6);
+        return 0;
+    }
+    return -1;
+}
+
+/*
+    * Parse duration with optional s/m/h/d unit, return seconds or -1
+*/
+long parse_duration(const char *v) {
+    char *end;
+    long n = strtol(v, &end, 10);
+    if (end == v || n < 0)
+        return -1;
+    switch (*end) {
+        case 0: case 's': return n;
+        case 'm': return n * 60;
+        case 'h': return n * 3600;
+        case 'd': return n * 86400;
+    }
+    return -1;
+}
+
+/*
+    * Parse size with optional K/M/G unit, return bytes or -1
+*/
+long long parse_size(const char *v) {
+    char *end;
+    long long n = strtoll(v, &end, 10);
+    if (end == v || n < 0)
+        return -1;
+    switch (*end) {
+        case 0: return n;
+        case 'K': case 'k': return n << 10;
+        case 'M': case 'm': return n << 20;
+        case 'G': case 'g': return n << 30;
+    }
+    return -1;
+}
+
+int store_find(const char *name) {
+    for (int i = 0; i < stores.n; i++)
+        if (strcmp(stores.list[i].name, name) == 0)
+            return i;
+    return -1;
+}
+
+/*
+    * Add store from spec NAME[,dir=PATH][,interval=5m][,max-size=1G]
+    * [,retention=30d][,compress-age=7d][,quota=100G][,archive=PATH][,shards=4];
+    * NAME "main" changes main store.
+    * Interval must divide a day. Errors are fatal
+*/
+void store_add(char *spec) {
+    char *save;
+    char *name = strtok_r(spec, ",", &save);
+    if (name == NULL) {
+        fprintf(stderr, "Empty store spec\n");
+        exit(EXIT_FAILURE);
+    }
+    int idx = store_find(name);
+    if (idx < 0) {
+        if (stores.n == MAX_STORES) {
+            fprintf(stderr, "Too many stores (max %d)\n", MAX_STORES);
+            exit(EXIT_FAILURE);
+        }
+        idx = stores.n++;
+        stores.list[idx].name = name;
+        stores.list[idx].dir = NULL;
+        stores.list[idx].interval = 3600;
+        stores.list[idx].max_size = 0;
+        stores.list[idx].retention = 0;
+        stores.list[idx].compress_age = 0;
+        stores.list[idx].quota = 0;
+        stores.list[idx].archive = NULL;
+        stores.list[idx].nshards = 0;
+    }
+    logstore *ls = &stores.list[idx];
+    char *kv;
+    while ((kv = strtok_r(NULL, ",", &save)) != NULL) {
+        char *v = strchr(kv, '=');
+        long n = 0;
+        if (v == NULL)
+            goto bad;
+        *v++ = 0;
+        if (strcmp(kv, "dir") == 0) {
+            ls->dir = v;
+            continue;
+        }
+        if (strcmp(kv, "archive") == 0) {
+            ls->archive = v;
+            continue;
+        }
+        if (strcmp(kv, "shards") == 0) {
+            ls->nshards = atoi(v);
+            if (ls->nshards < 1 || ls->nshards > MAX_SHARDS)
+                goto bad;
+            continue;
+        }
+        if (strcmp(kv, "max-size") == 0 || strcmp(kv, "quota") == 0) {
+            long long size = parse_size(v);
+            if (size < 0)
+                goto bad;
+            if (kv[0] == 'm')
+                ls->max_size = size;
+            else
+                ls->quota = size;
+            continue;
+        }
+        n = parse_duration(v);
+        if (n < 0)
+            goto bad;
+        if (strcmp(kv, "interval") == 0 && n >= 60 && 86400 % n == 0)
+            ls->interval = n;
+        else if (strcmp(kv, "retention") == 0)
+            ls->retention = n;
+        else if (strcmp(kv, "compress-age") == 0)
+            ls->compress_age = n;
+        else
+            goto bad;
+    }
+    if (ls->dir == NULL && idx > 0) {
+        fprintf(stderr, "Store %s needs dir=\n", ls->name);
+        exit(EXIT_FAILURE);
+    }
+    return;
+bad:
+    fprintf(stderr, "Invalid store option %s for %s\n", kv, ls->name);
+    exit(EXIT_FAILURE);
+}
+
+/*
+    * Expand stores into one entry per writer shard (--shards is default)
+*/
+void stores_shard() {
+    std::vector<logstore> list(stores.list, stores.list + stores.n);
+    stores.n = 0;
+    for (size_t i = 0; i < list.size(); i++) {
+        int k = list[i].nshards > 0 ? list[i].nshards : config.shards > 0 ? config.shards : 1;
+        if (stores.n + k > MAX_STORES * MAX_SHARDS) {
+            fprintf(stderr, "Too many store shards\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int s = 0; s < k; s++) {
+            logstore &ls = stores.list[stores.n++];
+            ls = list[i];
+            ls.shard = s;
+            ls.nshards = k;
+        }
+        stores.list[stores.n - k].current.resize(k);
+    }
+}
+
+/*
+    * Early filter of UDP listeners (--socket-filter EXPR), compiled to classic
+    * BPF and attached to sockets so unwanted datagrams are never copied out of
+    * kernel. EXPR is comma separated terms: severity<=S (or <S), facility=F
+    * and net=CIDR; facilities and nets match any of, kinds must all match.
+    * Datagram without valid PRI counts as DEFAULT_PRI, as in parse_pri()
+*/
+struct {
+    int enabled;
+    // highest kept severity, -1 for any
+    int severity;
+    std::vector<int> facilities;
+    // address and prefix length over 128 bits (IPv4 as v4-mapped)
+    std::vector<std::pair<hostaddr, int> > nets;
+    std::vector<struct sock_filter> prog;
+} sockfilter;
+
+static const char *severity_names[NUM_SEVERITIES] = {
+    "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+};
+static const char *facility_names[24] = {
+    "kern", "user", "mail", "daemon", "auth", "syslog", "lpr", "news", "uucp", "cron", "authpriv", "ftp",
+    "ntp", "security", "console", "solaris-cron", "local0", "local1", "local2", "local3", "local4", "local5",
+    "local6", "local7"
+};
+
+// number or name from table, -1 if neither
+static int filter_value(const char *s, const char **names, int n) {
+    char *end;
+    long v = strtol(s, &end, 10);
+    if (*s != 0 && *end == 0)
+        return v >= 0 && v < n ? v : -1;
+    for (int i = 0; i < n; i++)
+        if (strcmp(s, names[i]) == 0)
+            return i;
+    return -1;
+}
+
+// classic BPF with forward jumps by label, -1 label is next instruction
+struct cbpf_asm {
+    std::vector<struct sock_filter> insns;
+    std::vector<std::pair<size_t, std::pair<int, int> > > fixups;
+    std::map<int, size_t> labels;
+
+    void emit(uint16_t code, uint32_t k) {
+        struct sock_filter f = { code, 0, 0, k };
+        insns.push_back(f);
+    }
+    void jump(uint16_t code, uint32_t k, int jt, int jf) {
+        fixups.push_back(std::make_pair(insns.size(), std::make_pair(jt, jf)));
+        emit(code, k);
+    }
+    void label(int l) {
+        labels[l] = insns.size();
+    }
+    // return -1 when a jump is too long for 8-bit offset (or backwards)
+    int resolve() {
+        for (size_t i = 0; i < fixups.size(); i++) {
+            struct sock_filter &f = insns[fixups[i].first];
+            int jt = fixups[i].second.first, jf = fixups[i].second.second;
+            long ot = jt < 0 ? 0 : (long)labels[jt] - fixups[i].first - 1;
+            long of = jf < 0 ? 0 : (long)labels[jf] - fixups[i].first - 1;
+            if (ot < 0 || of < 0)
+                return -1;
+            if (BPF_OP(f.code) == BPF_JA) {
+                f.k = ot;
+                continue;
+            }
+            if (ot > 255 || of > 255)
+                return -1;
+            f.jt = ot;
+            f.jf = of;
+        }
+        return 0;
+    }
+};
+
+static void sockfilter_compile() {
+    enum { ACCEPT, DROP, NETOK, V6, BADPRI, HAVEPRI, PRI, PRIOK, NEXT };
+    cbpf_asm a;
+    // datagram starts with UDP header, source address is in network header
+    if (!sockfilter.nets.empty()) {
+        a.emit(BPF_LD | BPF_B | BPF_ABS, SKF_NET_OFF);
+        a.emit(BPF_ALU | BPF_RSH | BPF_K, 4);
+        a.jump(BPF_JMP | BPF_JEQ | BPF_K, 4, -1, V6);
+        for (size_t i = 0; i < sockfilter.nets.size(); i++) {
+            const hostaddr &h = sockfilter.nets[i].first;
+            int len = sockfilter.nets[i].second - 96;
+            if (len < 0 || host_is_v4(&h) == 0)
+                continue;
+            uint32_t mask = len == 0 ? 0 : 0xffffffffU << (32 - len);
+            a.emit(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12);
+            a.emit(BPF_ALU | BPF_AND | BPF_K, mask);
+            a.jump(BPF_JMP | BPF_JEQ | BPF_K, (h.a[12] << 24 | h.a[13] << 16 | h.a[14] << 8 | h.a[15]) & mask, NETOK, -1);
+        }
+        a.jump(BPF_JMP | BPF_JA, 0, DROP, -1);
+        a.label(V6);
+        for (size_t i = 0; i < sockfilter.nets.size(); i++) {
+            const hostaddr &h = sockfilter.nets[i].first;
+            int len = sockfilter.nets[i].second;
+            if (host_is_v4(&h))
+                continue;
+            for (int w = 0; w < 4 && len > w * 32; w++) {
+                int bits = len - w * 32 > 32 ? 32 : len - w * 32;
+                uint32_t mask = 0xffffffffU << (32 - bits);
+                const uint8_t *b = h.a + w * 4;
+                a.emit(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 8 + w * 4);
+                a.emit(BPF_ALU | BPF_AND | BPF_K, mask);
+                a.jump(BPF_JMP | BPF_JEQ | BPF_K, (b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3]) & mask, -1, NEXT + i);
+            }
+            a.jump(BPF_JMP | BPF_JA, 0, NETOK, -1);
+            a.label(NEXT + i);
+        }
+        a.jump(BPF_JMP | BPF_JA, 0, DROP, -1);
+        a.label(NETOK);
+    }
+    if (sockfilter.severity >= 0 || !sockfilter.facilities.empty()) {
+        // "<" 1-4 digits ">" at payload offset 8, length checked before each byte
+        a.emit(BPF_LD | BPF_W | BPF_LEN, 0);
+        a.emit(BPF_ST, 1);
+        for (int d = 0; d <= 5; d++) {
+            a.emit(BPF_LD | BPF_MEM, 1);
+            a.jump(BPF_JMP | BPF_JGT | BPF_K, 8 + d, -1, BADPRI);
+            a.emit(BPF_LD | BPF_B | BPF_ABS, 8 + d);
+            if (d == 0) {
+                a.jump(BPF_JMP | BPF_JEQ | BPF_K, '<', -1, BADPRI);
+                continue;
+            }
+            if (d >= 2)
+                a.jump(BPF_JMP | BPF_JEQ | BPF_K, '>', HAVEPRI, -1);
+            if (d == 5)
+                break;
+            a.emit(BPF_ALU | BPF_SUB | BPF_K, '0');
+            a.jump(BPF_JMP | BPF_JGT | BPF_K, 9, BADPRI, -1);
+            if (d > 1) {
+                a.emit(BPF_MISC | BPF_TAX, 0);
+                a.emit(BPF_LD | BPF_MEM, 0);
+                a.emit(BPF_ALU | BPF_MUL | BPF_K, 10);
+                a.emit(BPF_ALU | BPF_ADD | BPF_X, 0);
+            }
+            a.emit(BPF_ST, 0);
+        }
+        a.label(HAVEPRI);
+        a.emit(BPF_LD | BPF_MEM, 0);
+        a.jump(BPF_JMP | BPF_JGT | BPF_K, 191, -1, PRI);
+        a.label(BADPRI);
+        a.emit(BPF_LD | BPF_IMM, DEFAULT_PRI);
+        a.emit(BPF_ST, 0);
+        a.label(PRI);
+        if (sockfilter.severity >= 0) {
+            a.emit(BPF_LD | BPF_MEM, 0);
+            a.emit(BPF_ALU | BPF_AND | BPF_K, 7);
+            a.jump(BPF_JMP | BPF_JGT | BPF_K, sockfilter.severity, DROP, -1);
+        }
+        if (!sockfilter.facilities.empty()) {
+            a.emit(BPF_LD | BPF_MEM, 0);
+            a.emit(BPF_ALU | BPF_RSH | BPF_K, 3);
+            for (size_t i = 0; i < sockfilter.facilities.size(); i++)
+                a.jump(BPF_JMP | BPF_JEQ | BPF_K, sockfilter.facilities[i], PRIOK, -1);
+            a.jump(BPF_JMP | BPF_JA, 0, DROP, -1);
+            a.label(PRIOK);
+        }
+    }
+    a.label(ACCEPT);
+    a.emit(BPF_RET | BPF_K, 0xffffffff);
+    a.label(DROP);
+    a.emit(BPF_RET | BPF_K, 0);
+    if (a.resolve() < 0) {
+        fprintf(stderr, "Socket filter too large\n");
+        exit(EXIT_FAILURE);
+    }
+    sockfilter.prog = a.insns;
+}
+
+/*
+    * Parse --socket-filter expression, exit on error
+*/
+void sockfilter_parse(const char *expr) {
+    std::string spec = expr;
+    sockfilter.severity = -1;
+    size_t pos = 0;
+    while (pos <= spec.size()) {
+        size_t end = spec.find(',', pos);
+        if (end == std::string::npos)
+            end = spec.size();
+        std::string term = spec.substr(pos, end - pos);
+        pos = end + 1;
+        if (term.empty())
+            continue;
+        int ok = 0;
+        if (term.compare(0, 10, "severity<=") == 0) {
+            sockfilter.severity = filter_value(term.c_str() + 10, severity_names, NUM_SEVERITIES);
+            ok = sockfilter.severity >= 0;
+        } else if (term.compare(0, 9, "severity<") == 0) {
+            sockfilter.severity = filter_value(term.c_str() + 9, severity_names, NUM_SEVERITIES) - 1;
+            ok = sockfilter.severity >= 0;
+        } else if (term.compare(0, 9, "facility=") == 0) {
+            int f = filter_value(term.c_str() + 9, facility_names, 24);
+            sockfilter.facilities.push_back(f);
+            ok = f >= 0;
+        } else if (term.compare(0, 4, "net=") == 0) {
+            std::string addr = term.substr(4);
+            size_t slash = addr.find('/');
+            hostaddr h;
+            int len = -1;
+            if (slash != std::string::npos) {
+                len = atoi(addr.c_str() + slash + 1);
+                addr.erase(slash);
+            }
+            if (host_pton(addr.c_str(), &h) == 0) {
+                int max = host_is_v4(&h) ? 32 : 128;
+                if (len < 0)
+                    len = max;
+                ok = len <= max;
+                sockfilter.nets.push_back(std::make_pair(h, len + 128 - max));
+            }
+        }
+        if (!ok) {
+            fprintf(stderr, "Invalid socket filter term %s\n", term.c_str());
+            exit(EXIT_FAILURE);
+        }
+    }
+    sockfilter_compile();
+    sockfilter.enabled = 1;
+    if (config.verbose)
+        printf("Socket filter: %zu instructions\n", sockfilter.prog.size());
+}
+
+// replaces filter of socket taken over from previous process too
+void sockfilter_attach(int sock) {
+    struct sock_fprog fprog;
+    fprog.len = sockfilter.prog.size();
+    fprog.filter = sockfilter.prog.data();
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+        perror("setsockopt SO_ATTACH_FILTER");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+    * Adaptive receive buffers: UDP listeners start at RCVBUF_INITIAL and report
+    * kernel drops with each datagram (SO_RXQ_OVFL). Buffer is doubled, up to
+    * --rcvbuf-max, when drops happened while queue was at least half full or
+    * queue came close to full; drops at low occupancy are socket filter drops
+*/
+static void rxbuf_set(int sock, rxbuf *rb, int bytes) {
+    // SO_RCVBUFFORCE ignores net.core.rmem_max, needs CAP_NET_ADMIN
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes)) < 0 &&
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)) < 0)
+        perror("setsockopt SO_RCVBUF"); // soft-failure
+    socklen_t len = sizeof(rb->size);
+    if (getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rb->size, &len) < 0)
+        rb->size = 0;
+}
+
+/*
+    * Set up buffer of new or taken over listener, taken over one keeps size
+*/
+void rxbuf_init(int sock, rxbuf *rb, int set) {
+    memset(rb, 0, sizeof(*rb));
+    int optval = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &optval, sizeof(optval)) < 0)
+        perror("setsockopt SO_RXQ_OVFL"); // soft-failure, drops are not counted
+    if (set) {
+        rxbuf_set(sock, rb, RCVBUF_INITIAL);
+    } else {
+        socklen_t len = sizeof(rb->size);
+        getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rb->size, &len);
+    }
+    // drops before this process (taken over socket) are not counted
+    uint32_t mem[SK_MEMINFO_VARS];
+    socklen_t memlen = sizeof(mem);
+    if (getsockopt(sock, SOL_SOCKET, SO_MEMINFO, mem, &memlen) == 0)
+        rb->ovfl = mem[SK_MEMINFO_DROPS];
+    struct sockaddr_storage ss;
+    socklen_t sslen = sizeof(ss);
+    char addr[INET6_ADDRSTRLEN];
+    if (getsockname(sock, (struct sockaddr *)&ss, &sslen) < 0)
+        snprintf(rb->label, sizeof(rb->label), "fd%d", sock);
+    else if (ss.ss_family == AF_INET6)
+        snprintf(rb->label, sizeof(rb->label), "[%s]:%d",
+                 inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&ss)->sin6_addr, addr, sizeof(addr)),
+                 ntohs(((struct sockaddr_in6 *)&ss)->sin6_port));
+    else
+        snprintf(rb->label, sizeof(rb->label), "%s:%d",
+                 inet_ntop(AF_INET, &((struct sockaddr_in *)&ss)->sin_addr, addr, sizeof(addr)),
+                 ntohs(((struct sockaddr_in *)&ss)->sin_port));
+}
+
+/*
+    * Drop counter of received datagram, queue occupancy now and then
+*/
+void rxbuf_account(int sock, rxbuf *rb, struct msghdr *mh) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(mh); cmsg != NULL; cmsg = CMSG_NXTHDR(mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+            uint32_t ovfl;
+            memcpy(&ovfl, CMSG_DATA(cmsg), sizeof(ovfl));
+            rb->drops += (uint32_t)(ovfl - rb->ovfl);
+            rb->ovfl = ovfl;
+        }
+    }
+    if (++rb->reads < RCVBUF_SAMPLE)
+        return;
+    rb->reads = 0;
+    uint32_t mem[SK_MEMINFO_VARS];
+    socklen_t len = sizeof(mem);
+    if (getsockopt(sock, SOL_SOCKET, SO_MEMINFO, mem, &len) == 0 && (int)mem[SK_MEMINFO_RMEM_ALLOC] > rb->peak)
+        rb->peak = mem[SK_MEMINFO_RMEM_ALLOC];
+}
+
+// once a second, grow buffer of socket that is overflowing
+void rxbuf_adjust(int sock, rxbuf *rb) {
+    int dropped = rb->drops > rb->adjusted_drops;
+    int full = rb->peak >= rb->size / 2;
+    if (!rb->capped && rb->size > 0 && rb->size < config.rcvbuf_max &&
+        ((dropped && full) || rb->peak >= rb->size / 4 * 3)) {
+        int old = rb->size;
+        // request is doubled by kernel, so asking for current size doubles it
+        rxbuf_set(sock, rb, old < config.rcvbuf_max / 2 ? old : config.rcvbuf_max / 2);
+        if (rb->size <= old) {
+            rb->capped = 1;
+            printf("Receive buffer of %s stays at %d bytes (net.core.rmem_max)\n", rb->label, old);
+        } else {
+            printf("Receive buffer of %s grown to %d bytes, %llu drops\n", rb->label, rb->size,
+                   (unsigned long long)rb->drops);
+        }
+    }
+    rb->adjusted_drops = rb->drops;
+    rb->peak = 0;
+}
+
+void rxbuf_sweep() {
+    static time_t last;
+    time_t now = time(NULL);
+    if (now == last)
+        return;
+    last = now;
+    for (int i = 0; i < fd.nsocks; i++)
+        rxbuf_adjust(fd.socks[i], &fd.rx[i]);
+}
+
+/*
+    * Open UDP listener, IPv6 wildcard is bound dual-stack (IPV6_V6ONLY off)
+    * Return socket, or -1 if address family is not supported
+*/
+int open_listener(const struct sockaddr_storage *ss, socklen_t sslen) {
+    int sock;
+
+    sock = socket(ss->ss_family, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        if (errno == EAFNOSUPPORT)
+            return -1;
+        perror("opening datagram socket");
+        exit(EXIT_FAILURE);
+    }
+
+    if (ss->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)ss;
+        int v6only = IN6_IS_ADDR_UNSPECIFIED(&sin6->sin6_addr) ? 0 : 1;
+        if (setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0) {
+            perror("setsockopt IPV6_V6ONLY"); // soft-failure
+        }
+    }
+
+    if (bind(sock, (const struct sockaddr *)ss, sslen) < 0) {
+        perror("binding datagram socket");
+        exit(EXIT_FAILURE);
+    }
+
+    if (sockfilter.enabled)
+        sockfilter_attach(sock);
+
+    return sock;
+}
+
+/*
+    * Open all configured listeners, default is dual-stack wildcard on config.port
+*/
+void open_listeners() {
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    char addr[INET6_ADDRSTRLEN];
+
+    if (config.nlisten == 0) {
+        parse_listen("", config.port, &ss, &sslen);
+        int sock = open_listener(&ss, sslen);
+        if (sock < 0) {
+            // kernel without IPv6, fall back to IPv4 wildcard
+            parse_listen("0.0.0.0", config.port, &ss, &sslen);
+            sock = open_listener(&ss, sslen);
+        }
+        if (sock < 0) {
+            fprintf(stderr, "No usable address family\n");
+            exit(EXIT_FAILURE);
+        }
+        fd.socks[fd.nsocks++] = sock;
+        if (config.verbose)
+            printf("Listening on port %d\n", config.port);
+        return;
+    }
+
+    for (int i = 0; i < config.nlisten; i++) {
+        if (parse_listen(config.listen[i], config.port, &ss, &sslen) < 0) {
+            fprintf(stderr, "Invalid listen address %s\n", config.listen[i]);
+            exit(EXIT_FAILURE);
+        }
+        int sock = open_listener(&ss, sslen);
+        if (sock < 0) {
+            fprintf(stderr, "Address family not supported for %s\n", config.listen[i]);
+            exit(EXIT_FAILURE);
+        }
+        fd.socks[fd.nsocks++] = sock;
+        if (config.verbose) {
+            if (ss.ss_family == AF_INET6)
+                inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&ss)->sin6_addr, addr, sizeof(addr));
+            else
+                inet_ntop(AF_INET, &((struct sockaddr_in *)&ss)->sin_addr, addr, sizeof(addr));
+            printf("Listening on %s port %d\n", addr,
+                   ntohs(((struct sockaddr_in *)&ss)->sin_port));
+        }
+    }
+}
+
+/*
+    * Open local unix datagram socket (e.g. /dev/log) with SO_PASSCRED
+*/
+int open_unix_listener(const char *path) {
+    int sock;
+    struct sockaddr_un name;
+
+    if (strlen(path) >= sizeof(name.sun_path)) {
+        fprintf(stderr, "Unix socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        perror("opening unix datagram socket");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&name, 0, sizeof(name));
+    name.sun_family = AF_UNIX;
+    strcpy(name.sun_path, path);
+    // remove stale socket left by previous run, not one another daemon
+    // (e.g. syslog on /dev/log) is still reading
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Unix socket path %s exists and is not a socket\n", path);
+            exit(EXIT_FAILURE);
+        }
+        int probe = socket(AF_UNIX, SOCK_DGRAM, 0);
+        if (probe >= 0 && connect(probe, (struct sockaddr *)&name, sizeof(name)) == 0) {
+            fprintf(stderr, "Unix socket %s is in use by another process, stop it first\n", path);
+            exit(EXIT_FAILURE);
+        }
+        if (probe >= 0)
+            close(probe);
+        unlink(path);
+    }
+    if (bind(sock, (struct sockaddr *)&name, sizeof(name)) < 0) {
+        perror("binding unix datagram socket");
+        exit(EXIT_FAILURE);
+    }
+    // any local process must be able to log
+    chmod(path, 0666);
+
+    int optval = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_PASSCRED, &optval, sizeof(optval)) < 0) {
+        perror("setsockopt SO_PASSCRED"); // soft-failure, pid/uid will be unknown
+    }
+    optval = 262144;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &optval, sizeof(optval)) < 0) {
+        perror("setsockopt"); // soft-failure
+    }
+
+    if (config.verbose)
+        printf("Listening on unix socket %s\n", path);
+    return sock;
+}
+
+/*
+    * NUMA placement (--numa): writers run on node of their storage device,
+    * receiver follows node of CPU that handles its packets (SO_INCOMING_CPU).
+    * Memory is preferred from same node, so queue entries allocated by
+    * receiver and sqlite cache of writer stay node local
+*/
+struct {
+    // CPUs of each node
+    std::vector<cpu_set_t> cpus;
+    // CPUs process may run on, for threads without node
+    cpu_set_t allowed;
+    // node receiver is bound to, -1 until first packet
+    int receiver;
+    int incoming_cpu;
+    time_t checked;
+} numa;
+
+// read first line of sysfs attribute, return 0 on success
+static int sysfs_read(const char *path, char *buf, size_t len) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    int ok = fgets(buf, len, f) != NULL;
+    fclose(f);
+    if (!ok)
+        return -1;
+    buf[strcspn(buf, "\n")] = 0;
+    return 0;
+}
+
+// cpulist format "0-3,8-11"
+static void parse_cpulist(const char *s, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*s) {
+        char *end;
+        long a = strtol(s, &end, 10), b = a;
+        if (end == s)
+            break;
+        if (*end == '-')
+            b = strtol(end + 1, &end, 10);
+        for (long c = a; c <= b && c < CPU_SETSIZE; c++)
+            CPU_SET(c, set);
+        s = *end == ',' ? end + 1 : end;
+    }
+}
+
+void numa_init() {
+    char path[64], buf[1024];
+    numa.receiver = -1;
+    numa.incoming_cpu = -1;
+    sched_getaffinity(0, sizeof(numa.allowed), &numa.allowed);
+    for (int n = 0;; n++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+        if (sysfs_read(path, buf, sizeof(buf)) < 0)
+            break;
+        cpu_set_t set;
+        parse_cpulist(buf, &set);
+        numa.cpus.push_back(set);
+        printf("NUMA node %d: cpus %s\n", n, buf);
+    }
+    // kernel without NUMA, everything is one node
+    if (numa.cpus.empty()) {
+        numa.cpus.push_back(numa.allowed);
+        printf("NUMA not available, %d cpus as node 0\n", CPU_COUNT(&numa.allowed));
+    }
+}
+
+/*
+    * Node of block device holding dir, numa_node is found on the bus device
+    * above partition and disk. Return -1 if unknown (virtual, tmpfs, ...)
+*/
+int numa_dev_node(const char *dir) {
+    struct stat st;
+    if (stat(dir, &st) < 0)
+        return -1;
+    char path[64], buf[32];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(st.st_dev), minor(st.st_dev));
+    char *real = realpath(path, NULL);
+    if (real == NULL)
+        return -1;
+    std::string dev = real;
+    free(real);
+    int node = -1;
+    while (dev.size() > strlen("/sys/devices")) {
+        if (sysfs_read((dev + "/numa_node").c_str(), buf, sizeof(buf)) == 0) {
+            node = atoi(buf);
+            break;
+        }
+        dev.erase(dev.rfind('/'));
+    }
+    return node < (int)numa.cpus.size() ? node : -1;
+}
+
+// run calling thread on CPUs of node, prefer its memory for new allocations;
+// without node, undo placement inherited from creating thread (threads
+// started after receiver has moved, e.g. on handoff or upstream reload)
+void numa_bind(int node) {
+    if (numa.cpus.empty())
+        return;
+    if (node < 0 || node >= (int)numa.cpus.size()) {
+        if (sched_setaffinity(0, sizeof(cpu_set_t), &numa.allowed) < 0)
+            perror("sched_setaffinity");
+        if (syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0) < 0)
+            perror("set_mempolicy"); // soft-failure, e.g. kernel without NUMA
+        return;
+    }
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &numa.cpus[node]) < 0)
+        perror("sched_setaffinity");
+    unsigned long mask[4] = {0};
+    if (node < (int)sizeof(mask) * 8) {
+        mask[node / (8 * sizeof(long))] |= 1UL << (node % (8 * sizeof(long)));
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8 + 1) < 0)
+            perror("set_mempolicy"); // soft-failure, e.g. kernel without NUMA
+    }
+}
+
+/*
+    * Move receiver to node of CPU that processed last packet of sock,
+    * checked at most once a second
+*/
+void numa_receiver(int sock) {
+    time_t now = time(NULL);
+    if (now == numa.checked)
+        return;
+    numa.checked = now;
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0 || cpu < 0)
+        return;
+    numa.incoming_cpu = cpu;
+    for (int n = 0; n < (int)numa.cpus.size(); n++) {
+        if (!CPU_ISSET(cpu, &numa.cpus[n]))
+            continue;
+        if (n != numa.receiver) {
+            numa_bind(n);
+            numa.receiver = n;
+            printf("Receiver on node %d, packets handled by cpu %d\n", n, cpu);
+        }
+        break;
+    }
+}
+
+/*
+    * Insert message into db
+    * Return 0 on success, 1 on error
+*/
+int insert_db(sqlite3 *db, sqlite3_stmt *stmt, const logentry *entry, const std::string *zmsg,
+              const msg_template *tmpl) {
+    int rc;
+    sqlite3_reset(stmt);
+    sqlite3_bind_int(stmt, 1, entry->ts);
+    // local messages have no address, they are identified by pid/uid
+    if (entry->pid < 0) {
+        sqlite3_bind_blob(stmt, 2, entry->host.a, sizeof(entry->host.a), SQLITE_STATIC);
+        sqlite3_bind_null(stmt, 4);
+        sqlite3_bind_null(stmt, 5);
+    } else {
+        sqlite3_bind_null(stmt, 2);
+        sqlite3_bind_int(stmt, 4, entry->pid);
+        sqlite3_bind_int(stmt, 5, entry->uid);
+    }
+    // compressed message is stored as blob, decoded on read by msg_text()
+    if (tmpl != NULL && tmpl->exact)
+        sqlite3_bind_null(stmt, 3);
+    else if (zmsg != NULL)
+        sqlite3_bind_blob(stmt, 3, zmsg->data(), zmsg->size(), SQLITE_STATIC);
+    else
+        sqlite3_bind_text(stmt, 3, entry->msg.c_str(), entry->msg.size(), SQLITE_STATIC);
+    // single messages leave repeat columns NULL
+    if (entry->repeat > 1) {
+        sqlite3_bind_int(stmt, 6, entry->repeat);
+        sqlite3_bind_int(stmt, 7, entry->last_ts);
+    } else {
+        sqlite3_bind_null(stmt, 6);
+        sqlite3_bind_null(stmt, 7);
+    }
+    if (tmpl != NULL && tmpl->id > 0) {
+        sqlite3_bind_int(stmt, 8, tmpl->id);
+        sqlite3_bind_text(stmt, 9, tmpl->params.c_str(), tmpl->params.size(), SQLITE_STATIC);
+    } else {
+        sqlite3_bind_null(stmt, 8);
+        sqlite3_bind_null(stmt, 9);
+    }
+    if (!entry->tags.empty())
+        sqlite3_bind_text(stmt, 10, entry->tags.c_str(), entry->tags.size(), SQLITE_STATIC);
+    else
+        sqlite3_bind_null(stmt, 10);
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    return 0;
+}
+
+/*
+    * Journal position committed together with a batch
+    * Every record below applied is in database (or was shed), records at or
+    * above it that are in database are listed in ahead: lanes are drained
+    * by severity, so higher severity records overtake older ones.
+*/
+struct journal_mark {
+    int64_t applied;
+    int64_t tail;
+    const std::set<int64_t> *ahead;
+};
+
+/*
+    * Move up to max messages from queue to batch, highest severity first
+    * With journal, mark gets watermark of what is left: oldest queued record,
+    * replay cursor or journal end. Lanes are in journal order each.
+*/
+void dequeue_batch(logstore *ls, std::vector<logentry> &batch, size_t max, journal_mark *mark) {
+    msg_queue &queue = ls->queue;
+    pthread_mutex_lock(&queue.lock);
+    for (int sev = 0; sev < NUM_SEVERITIES && batch.size() < max; sev++) {
+        std::deque<logentry> &lane = queue.lanes[sev];
+        while (!lane.empty() && batch.size() < max) {
+            batch.push_back(std::move(lane.front()));
+            lane.pop_front();
+            queue.size--;
+        }
+    }
+    if (mark != NULL) {
+        mark->applied = std::min(ls->jend, ls->jfloor);
+        for (int sev = 0; sev < NUM_SEVERITIES; sev++)
+            if (!queue.lanes[sev].empty() && queue.lanes[sev].front().jofs >= 0)
+                mark->applied = std::min(mark->applied, queue.lanes[sev].front().jofs);
+        mark->tail = ls->jend;
+    }
+    pthread_mutex_unlock(&queue.lock);
+}
+
+/*
+    * Storage backend, one instance is owned by writer thread
+    * open() gets path of period file (without suffix), failures are fatal as before
+*/
+class storage {
+public:
+    virtual ~storage() {}
+    virtual const char *suffix() = 0;
+    virtual void open(const char *path) = 0;
+    // mark is journal position to commit atomically with batch, or NULL
+    // Return 0 on success, -1 if nothing was stored (batch can be written again)
+    virtual int write(std::vector<logentry> &batch, const journal_mark *mark) = 0;
+    // called when writer is idle, backend may flush buffered data
+    virtual void idle() {}
+    virtual void close() = 0;
+};
+
+/*
+    * Per-row message compression with zstd dictionary
+    * Dictionary is trained from first ZDICT_SAMPLE_BYTES of traffic, then
+    * retrained at each rotation from samples of previous hour. Every hourly file
+    * stores dictionaries it uses in zstd_dict table, keyed by zstd dictionary id.
+*/
+#define ZDICT_SIZE (16 * 1024)
+#define ZDICT_SAMPLE_BYTES (2 * 1024 * 1024)
+#define ZSTD_LEVEL 3
+
+#ifdef HAVE_ZSTD
+struct zstd_compressor {
+    std::string samples;
+    std::vector<size_t> sample_sizes;
+    std::string dict;
+    ZSTD_CDict *cdict = NULL;
+    ZSTD_CCtx *cctx = NULL;
+    std::string out;
+
+    ~zstd_compressor() {
+        ZSTD_freeCDict(cdict);
+        ZSTD_freeCCtx(cctx);
+    }
+
+    void sample(const std::string &msg) {
+        if (samples.size() >= ZDICT_SAMPLE_BYTES)
+            return;
+        samples.append(msg);
+        sample_sizes.push_back(msg.size());
+    }
+
+    /*
+        * Train new dictionary from collected samples
+        * Return 1 if dictionary changed
+    */
+    int train() {
+        // zdict needs plenty of samples, keep current dictionary until then
+        if (sample_sizes.size() < 1000)
+            return 0;
+        std::string buf(ZDICT_SIZE, 0);
+        size_t len = ZDICT_trainFromBuffer(&buf[0], buf.size(), samples.data(),
+                                           sample_sizes.data(), sample_sizes.size());
+        samples.clear();
+        sample_sizes.clear();
+        if (ZDICT_isError(len)) {
+            if (config.verbose)
+                printf("zstd dictionary training failed: %s\n", ZDICT_getErrorName(len));
+            return 0;
+        }
+        buf.resize(len);
+        ZSTD_CDict *c = ZSTD_createCDict(buf.data(), buf.size(), ZSTD_LEVEL);
+        if (c == NULL)
+            return 0;
+        ZSTD_freeCDict(cdict);
+        cdict = c;
+        dict = buf;
+        if (cctx == NULL)
+            cctx = ZSTD_createCCtx();
+        if (config.verbose)
+            printf("zstd dictionary %u trained, %zu bytes\n", ZSTD_getDictID_fromDict(dict.data(), dict.size()), dict.size());
+        return 1;
+    }
+
+    /*
+        * Compress message, return NULL if there is no dictionary yet or it does not pay off
+    */
+    const std::string *compress(const std::string &msg) {
+        if (cdict == NULL)
+            return NULL;
+        out.resize(ZSTD_compressBound(msg.size()));
+        size_t len = ZSTD_compress_usingCDict(cctx, &out[0], out.size(), msg.data(), msg.size(), cdict);
+        if (ZSTD_isError(len) || len >= msg.size())
+            return NULL;
+        out.resize(len);
+        return &out;
+    }
+};
+#endif
+
+/*
+    * Per-minute volume rollup by host and severity, maintained by writer and
+    * upserted into rollup table in the same transaction as batch itself.
+    * Local (unix socket) messages are counted under all-zero host.
+*/
+struct rollup_key {
+    int minute;
+    hostaddr host;
+    int severity;
+
+    bool operator<(const rollup_key &o) const {
+        if (minute != o.minute)
+            return minute < o.minute;
+        if (severity != o.severity)
+            return severity < o.severity;
+        return memcmp(host.a, o.host.a, sizeof(host.a)) < 0;
+    }
+};
+
+struct rollup_value {
+    int64_t count;
+    int64_t bytes;
+};
+
+void rollup_add(std::map<rollup_key, rollup_value> &rollup, const logentry &e) {
+    rollup_key k;
+    k.minute = e.ts - e.ts % 60;
+    if (e.pid >= 0)
+        memset(&k.host, 0, sizeof(k.host));
+    else
+        k.host = e.host;
+    k.severity = e.pri & 7;
+    rollup_value &v = rollup[k];
+    // folded repeats count as the messages they represent
+    v.count += e.repeat;
+    v.bytes += (int64_t)e.msg.size() * e.repeat;
+}
+
+/*
+    * Online template mining (Drain)
+    *
+    * Message is split on whitespace, tokens with digits are parameters from
+    * the start. Parse tree: token count, then first DRAIN_DEPTH - 2 tokens,
+    * leaf holds clusters of that shape. Message joins most similar cluster
+    * (share of equal literal tokens >= DRAIN_SIM), differing positions become "<*>",
+    * otherwise it starts new cluster. Every change of cluster template gets
+    * new template id, so params stored with a row always match the template
+    * text it references. Tree is shared by miner pool under rwlock, most
+    * messages only need read lock.
+*/
+#define DRAIN_DEPTH 4
+#define DRAIN_SIM 0.4
+#define DRAIN_MAX_CHILDREN 100
+#define DRAIN_MAX_CLUSTERS 50000
+#define DRAIN_MAX_PATTERNS 200000
+#define DRAIN_MAX_NODES 100000
+#define DRAIN_MAX_TOKENS 128
+#define DRAIN_WILDCARD "<*>"
+
+struct drain_node {
+    std::unordered_map<std::string, drain_node *> children;
+    std::vector<int> clusters;
+};
+
+struct drain_cluster {
+    int tid;
+    std::vector<std::string> tokens;
+};
+
+struct {
+    drain_node root;
+    std::vector<drain_cluster> clusters;
+    // template text by template id - 1
+    std::vector<std::string> patterns;
+    size_t nodes;
+    pthread_rwlock_t lock;
+} drain;
+
+static inline int drain_param(const std::string &tok) {
+    if (tok == DRAIN_WILDCARD)
+        return 1;
+    for (size_t i = 0; i < tok.size(); i++)
+        if (isdigit((unsigned char)tok[i]))
+            return 1;
+    return 0;
+}
+
+void drain_tokenize(const std::string &msg, std::vector<std::string> &tokens) {
+    tokens.clear();
+    size_t i = 0;
+    while (i < msg.size()) {
+        while (i < msg.size() && isspace((unsigned char)msg[i]))
+            i++;
+        size_t start = i;
+        while (i < msg.size() && !isspace((unsigned char)msg[i]))
+            i++;
+        if (i > start)
+            tokens.push_back(msg.substr(start, i - start));
+    }
+}
+
+/*
+    * Walk parse tree to leaf for tokens, create missing nodes if create is set
+    * (full node sends new tokens to "<*>" child). Return NULL if no leaf yet,
+    * or tree has DRAIN_MAX_NODES nodes
+*/
+drain_node *drain_leaf(const std::vector<std::string> &tokens, int create) {
+    drain_node *node = &drain.root;
+    size_t depth = std::min(tokens.size(), (size_t)DRAIN_DEPTH - 2);
+    for (size_t level = 0; level <= depth; level++) {
+        // first level is token count, never merged
+        std::string key = level == 0 ? std::to_string(tokens.size())
+                        : drain_param(tokens[level - 1]) ? DRAIN_WILDCARD : tokens[level - 1];
+        auto it = node->children.find(key);
+        if (it == node->children.end()) {
+            int full = node->children.size() >= DRAIN_MAX_CHILDREN || drain.nodes >= DRAIN_MAX_NODES;
+            if (level > 0 && (!create || full)) {
+                key = DRAIN_WILDCARD;
+                it = node->children.find(key);
+            }
+            if (it == node->children.end()) {
+                if (!create || drain.nodes >= DRAIN_MAX_NODES)
+                    return NULL;
+                it = node->children.insert(std::make_pair(key, new drain_node())).first;
+                drain.nodes++;
+            }
+        }
+        node = it->second;
+    }
+    return node;
+}
+
+/*
+    * Most similar cluster in leaf, -1 if none reaches DRAIN_SIM
+*/
+int drain_match(const drain_node *leaf, const std::vector<std::string> &tokens) {
+    int best = -1;
+    double best_sim = -1;
+    size_t best_params = 0;
+    for (size_t i = 0; i < leaf->clusters.size(); i++) {
+        const drain_cluster &c = drain.clusters[leaf->clusters[i]];
+        size_t same = 0, params = 0;
+        for (size_t j = 0; j < tokens.size(); j++) {
+            if (c.tokens[j] == DRAIN_WILDCARD)
+                params++;
+            else if (c.tokens[j] == tokens[j])
+                same++;
+        }
+        // wildcard positions match anything, similarity is over literal positions
+        double sim = params == tokens.size() ? 1.0 : (double)same / (tokens.size() - params);
+        if (sim > best_sim || (sim == best_sim && params > best_params)) {
+            best = leaf->clusters[i];
+            best_sim = sim;
+            best_params = params;
+        }
+    }
+    return best_sim >= DRAIN_SIM ? best : -1;
+}
+
+static int drain_covers(const drain_cluster &c, const std::vector<std::string> &tokens) {
+    for (size_t j = 0; j < tokens.size(); j++)
+        if (c.tokens[j] != DRAIN_WILDCARD && (c.tokens[j] != tokens[j] || drain_param(tokens[j])))
+            return 0;
+    return 1;
+}
+
+static int drain_new_template(drain_cluster &c) {
+    std::string pattern;
+    for (size_t j = 0; j < c.tokens.size(); j++) {
+        if (j > 0)
+            pattern += ' ';
+        pattern += c.tokens[j];
+    }
+    drain.patterns.push_back(pattern);
+    c.tid = drain.patterns.size();
+    return c.tid;
+}
+
+/*
+    * Assign template to message, out.id is 0 if message is not mined
+*/
+void drain_mine(const std::string &msg, msg_template &out) {
+    std::vector<std::string> tokens;
+    out.cluster = 0;
+    out.id = 0;
+    out.params.clear();
+    out.exact = 0;
+    drain_tokenize(msg, tokens);
+    if (tokens.empty() || tokens.size() > DRAIN_MAX_TOKENS)
+        return;
+
+    int ci = -1;
+    pthread_rwlock_rdlock(&drain.lock);
+    drain_node *leaf = drain_leaf(tokens, 0);
+    if (leaf != NULL) {
+        ci = drain_match(leaf, tokens);
+        if (ci >= 0 && !drain_covers(drain.clusters[ci], tokens))
+            ci = -1;
+    }
+    if (ci < 0) {
+        // template has to be created or generalized
+        pthread_rwlock_unlock(&drain.lock);
+        pthread_rwlock_wrlock(&drain.lock);
+        leaf = drain_leaf(tokens, 1);
+        // template ids are referenced by stored rows, at the limits messages are left unmined
+        if (leaf == NULL || drain.patterns.size() >= DRAIN_MAX_PATTERNS) {
+            pthread_rwlock_unlock(&drain.lock);
+            return;
+        }
+        ci = drain_match(leaf, tokens);
+        if (ci < 0) {
+            if (drain.clusters.size() >= DRAIN_MAX_CLUSTERS) {
+                pthread_rwlock_unlock(&drain.lock);
+                return;
+            }
+            drain_cluster c;
+            for (size_t j = 0; j < tokens.size(); j++)
+                c.tokens.push_back(drain_param(tokens[j]) ? DRAIN_WILDCARD : tokens[j]);
+            drain_new_template(c);
+            ci = drain.clusters.size();
+            drain.clusters.push_back(c);
+            leaf->clusters.push_back(ci);
+        } else if (!drain_covers(drain.clusters[ci], tokens)) {
+            drain_cluster &c = drain.clusters[ci];
+            for (size_t j = 0; j < tokens.size(); j++)
+                if (c.tokens[j] != tokens[j] || drain_param(tokens[j]))
+                    c.tokens[j] = DRAIN_WILDCARD;
+            drain_new_template(c);
+        }
+    }
+    const drain_cluster &c = drain.clusters[ci];
+    out.cluster = ci + 1;
+    out.id = c.tid;
+    for (size_t j = 0; j < tokens.size(); j++) {
+        if (c.tokens[j] != DRAIN_WILDCARD)
+            continue;
+        if (!out.params.empty())
+            out.params += ' ';
+        out.params += tokens[j];
+    }
+    pthread_rwlock_unlock(&drain.lock);
+
+    // text is rebuilt single spaced, other whitespace has to be stored
+    std::string rebuilt;
+    for (size_t j = 0; j < tokens.size(); j++) {
+        if (j > 0)
+            rebuilt += ' ';
+        rebuilt += tokens[j];
+    }
+    out.exact = rebuilt == msg;
+}
+
+std::string drain_pattern(int tid) {
+    pthread_rwlock_rdlock(&drain.lock);
+    std::string pattern = drain.patterns[tid - 1];
+    pthread_rwlock_unlock(&drain.lock);
+    return pattern;
+}
+
+/*
+    * Miner pool: writer hands each dequeued batch to template_workers threads
+    * and waits until all rows are mined
+*/
+struct {
+    int nthreads;
+    // one batch at a time, writers of several stores share the pool
+    pthread_mutex_t busy;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned generation;
+    int running;
+    size_t next;
+    const std::vector<logentry> *batch;
+    std::vector<msg_template> *out;
+} miner_pool;
+
+void miner_run() {
+    size_t i;
+    while ((i = __sync_fetch_and_add(&miner_pool.next, 1)) < miner_pool.batch->size())
+        drain_mine((*miner_pool.batch)[i].msg, (*miner_pool.out)[i]);
+}
+
+void *miner_thread(void *arg) {
+    (void)arg;
+    numa_bind(-1);
+    unsigned seen = 0;
+    while (1) {
+        pthread_mutex_lock(&miner_pool.lock);
+        while (miner_pool.generation == seen)
+            pthread_cond_wait(&miner_pool.start, &miner_pool.lock);
+        seen = miner_pool.generation;
+        pthread_mutex_unlock(&miner_pool.lock);
+        miner_run();
+        pthread_mutex_lock(&miner_pool.lock);
+        if (--miner_pool.running == 0)
+            pthread_cond_signal(&miner_pool.done);
+        pthread_mutex_unlock(&miner_pool.lock);
+    }
+    return NULL;
+}
+
+void miner_start() {
+    pthread_rwlock_init(&drain.lock, NULL);
+    pthread_mutex_init(&miner_pool.busy, NULL);
+    pthread_mutex_init(&miner_pool.lock, NULL);
+    pthread_cond_init(&miner_pool.start, NULL);
+    pthread_cond_init(&miner_pool.done, NULL);
+    miner_pool.nthreads = config.template_workers;
+    for (int i = 0; i < miner_pool.nthreads; i++) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, miner_thread, NULL);
+        pthread_detach(tid);
+    }
+}
+
+void mine_batch(const std::vector<logentry> &batch, std::vector<msg_template> &out) {
+    out.resize(batch.size());
+    pthread_mutex_lock(&miner_pool.busy);
+    miner_pool.batch = &batch;
+    miner_pool.out = &out;
+    miner_pool.next = 0;
+    if (miner_pool.nthreads == 0) {
+        miner_run();
+        pthread_mutex_unlock(&miner_pool.busy);
+        return;
+    }
+    pthread_mutex_lock(&miner_pool.lock);
+    miner_pool.running = miner_pool.nthreads;
+    miner_pool.generation++;
+    pthread_cond_broadcast(&miner_pool.start);
+    while (miner_pool.running > 0)
+        pthread_cond_wait(&miner_pool.done, &miner_pool.lock);
+    pthread_mutex_unlock(&miner_pool.lock);
+    pthread_mutex_unlock(&miner_pool.busy);
+}
+
+/*
+    * File being written is in WAL mode. WAL is checkpointed when writer is
+    * idle and at latest every WAL_CHECKPOINT_PAGES, so after unclean stop
+    * reopening the file recovers at most that much WAL. Closed files are
+    * switched back to rollback journal, so they are single files again.
+*/
+#define WAL_CHECKPOINT_PAGES 4096
+#define WAL_SIZE_LIMIT (64 * 1024 * 1024)
+
+// file was not closed: WAL or hot rollback journal is left next to it
+int db_interrupted(const char *path) {
+    struct stat sb;
+    std::string p = path;
+    return stat((p + "-wal").c_str(), &sb) == 0 || stat((p + "-journal").c_str(), &sb) == 0;
+}
+
+/*
+    * SQLite backend: one table per hourly file, batch per transaction
+*/
+class sqlite_storage : public storage {
+public:
+    sqlite_storage() : db(NULL), insert_stmt(NULL), rollup_stmt(NULL), template_stmt(NULL), journal_stmt(NULL),
+        journal_new(0), wal_pages(0) {
+#ifdef HAVE_ZSTD
+        dict_pending = 0;
+#endif
+    }
+
+    const char *suffix() { return ".sqlite3"; }
+
+    void open(const char *path) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        // left open by unclean stop, recovered by first statement
+        int interrupted = db_interrupted(path);
+        if (sqlite3_open(path, &db) != SQLITE_OK) {
+            fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
+            sqlite3_close(db);
+            exit(EXIT_FAILURE);
+        }
+        sqlite3_exec(db, "PRAGMA journal_mode=WAL;", 0, 0, NULL);
+        char sql_limit[64];
+        snprintf(sql_limit, sizeof(sql_limit), "PRAGMA journal_size_limit=%d;", WAL_SIZE_LIMIT);
+        sqlite3_exec(db, sql_limit, 0, 0, NULL);
+        sqlite3_wal_hook(db, wal_hook, this);
+        init_new_db(db);
+        if (interrupted) {
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            printf("Recovered interrupted %s in %.3fs\n", path,
+                   (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+        }
+        // statement is reused for all inserts into this file
+        const char *sql = "INSERT INTO log (timestamp, host, message, pid, uid, repeat, last_timestamp, template, params, tags) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
+        if (sqlite3_prepare_v2(db, sql, -1, &insert_stmt, NULL) != SQLITE_OK) {
+            fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+            exit(EXIT_FAILURE);
+        }
+        sql = "INSERT INTO rollup (minute, host, severity, count, bytes) VALUES (?, ?, ?, ?, ?) "
+              "ON CONFLICT (minute, host, severity) DO UPDATE SET count = count + excluded.count, bytes = bytes + excluded.bytes;";
+        if (sqlite3_prepare_v2(db, sql, -1, &rollup_stmt, NULL) != SQLITE_OK) {
+            fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+            exit(EXIT_FAILURE);
+        }
+        if (config.templates)
+            open_templates();
+        if (config.journal)
+            open_journal();
+#ifdef HAVE_ZSTD
+        if (config.compress_messages) {
+            sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS zstd_dict (id INTEGER PRIMARY KEY, dict BLOB);", 0, 0, NULL);
+            // new hour, dictionary from recent traffic
+            if (zc.train() || !zc.dict.empty())
+                store_dict();
+        }
+#endif
+    }
+
+    int write(std::vector<logentry> &batch, const journal_mark *mark) {
+        if (config.templates)
+            mine_batch(batch, mined);
+        if (sqlite3_exec(db, "BEGIN;", 0, 0, NULL) != SQLITE_OK) {
+            fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+            return -1;
+        }
+        // state describing file content, restored if transaction is rolled back
+        std::unordered_map<int, int> saved_tids = file_tids, saved_clusters = file_clusters;
+        int saved_tid = next_tid, saved_cluster = next_cluster, saved_new = journal_new;
+        int failed = 0;
+#ifdef HAVE_ZSTD
+        if (dict_pending) {
+            store_dict();
+            dict_pending = 0;
+        }
+#endif
+        for (size_t i = 0; i < batch.size(); i++) {
+            const std::string *zmsg = NULL;
+            msg_template *tmpl = NULL;
+            if (config.templates) {
+                tmpl = &mined[i];
+                if (tmpl->id > 0)
+                    tmpl->id = file_template(tmpl->cluster, tmpl->id);
+            }
+#ifdef HAVE_ZSTD
+            if (config.compress_messages && (tmpl == NULL || !tmpl->exact)) {
+                zc.sample(batch[i].msg);
+                // first dictionary as soon as there are enough samples
+                if (zc.dict.empty() && zc.samples.size() >= ZDICT_SAMPLE_BYTES && zc.train())
+                    store_dict();
+                zmsg = zc.compress(batch[i].msg);
+            }
+#endif
+            failed |= insert_db(db, insert_stmt, &batch[i], zmsg, tmpl);
+            rollup_add(rollup, batch[i]);
+        }
+        flush_rollup();
+        if (mark != NULL)
+            failed |= store_mark(batch, mark);
+        // rows and watermark are stored together or not at all
+        if (failed || sqlite3_exec(db, "COMMIT;", 0, 0, NULL) != SQLITE_OK) {
+            if (!failed)
+                fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+            file_tids.swap(saved_tids);
+            file_clusters.swap(saved_clusters);
+            next_tid = saved_tid;
+            next_cluster = saved_cluster;
+            journal_new = saved_new;
+            rollup.clear();
+#ifdef HAVE_ZSTD
+            // dictionary may have been stored by this transaction only
+            dict_pending = !zc.dict.empty();
+#endif
+            return -1;
+        }
+        return 0;
+    }
+
+    void idle() {
+        if (wal_pages > 0) {
+            sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE, NULL, NULL);
+            wal_pages = 0;
+        }
+    }
+
+    void close() {
+        if (db == NULL)
+            return;
+        sqlite3_finalize(insert_stmt);
+        sqlite3_finalize(rollup_stmt);
+        sqlite3_finalize(template_stmt);
+        sqlite3_finalize(journal_stmt);
+        insert_stmt = NULL;
+        rollup_stmt = NULL;
+        template_stmt = NULL;
+        journal_stmt = NULL;
+        // fails while a reader has it open, last close checkpoints anyway
+        sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL);
+        sqlite3_exec(db, "PRAGMA journal_mode=DELETE;", 0, 0, NULL);
+        sqlite3_close(db);
+        db = NULL;
+        wal_pages = 0;
+    }
+
+private:
+    // replaces autocheckpoint, big bursts are checkpointed without waiting for idle
+    static int wal_hook(void *arg, sqlite3 *db, const char *, int pages) {
+        sqlite_storage *self = (sqlite_storage *)arg;
+        self->wal_pages = pages;
+        if (pages >= WAL_CHECKPOINT_PAGES) {
+            sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE, NULL, NULL);
+            self->wal_pages = 0;
+        }
+        return SQLITE_OK;
+    }
+
+    /*
+        * Journal position lives in the file it describes, replay starts from
+        * newest file that has journal_state row
+    */
+    void open_journal() {
+        sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS journal_state (id INTEGER PRIMARY KEY, applied INTEGER, tail INTEGER);"
+                         "CREATE TABLE IF NOT EXISTS journal_applied (ofs INTEGER PRIMARY KEY);", 0, 0, NULL);
+        if (sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO journal_applied (ofs) VALUES (?);", -1, &journal_stmt,
+                               NULL) != SQLITE_OK) {
+            fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+            exit(EXIT_FAILURE);
+        }
+        // first batch in new file carries whole ahead set
+        journal_new = 1;
+    }
+
+    // Return 0 on success, 1 on error
+    int store_mark(const std::vector<logentry> &batch, const journal_mark *mark) {
+        char sql[256];
+        int failed = 0;
+        if (journal_new) {
+            failed |= sqlite3_exec(db, "DELETE FROM journal_applied;", 0, 0, NULL) != SQLITE_OK;
+            for (auto it = mark->ahead->begin(); it != mark->ahead->end(); ++it)
+                failed |= store_applied(*it);
+            journal_new = 0;
+        } else {
+            snprintf(sql, sizeof(sql), "DELETE FROM journal_applied WHERE ofs < %lld;", (long long)mark->applied);
+            failed |= sqlite3_exec(db, sql, 0, 0, NULL) != SQLITE_OK;
+            for (size_t i = 0; i < batch.size(); i++)
+                if (batch[i].jofs >= mark->applied)
+                    failed |= store_applied(batch[i].jofs);
+        }
+        snprintf(sql, sizeof(sql), "INSERT OR REPLACE INTO journal_state (id, applied, tail) VALUES (0, %lld, %lld);",
+                 (long long)mark->applied, (long long)mark->tail);
+        if (sqlite3_exec(db, sql, 0, 0, NULL) != SQLITE_OK) {
+            fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+            failed = 1;
+        }
+        return failed;
+    }
+
+    int store_applied(int64_t ofs) {
+        sqlite3_reset(journal_stmt);
+        sqlite3_bind_int64(journal_stmt, 1, ofs);
+        if (sqlite3_step(journal_stmt) != SQLITE_DONE) {
+            fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+            return 1;
+        }
+        return 0;
+    }
+
+    void flush_rollup() {
+        for (auto it = rollup.begin(); it != rollup.end(); ++it) {
+            sqlite3_reset(rollup_stmt);
+            sqlite3_bind_int(rollup_stmt, 1, it->first.minute);
+            sqlite3_bind_blob(rollup_stmt, 2, it->first.host.a, 16, SQLITE_STATIC);
+            sqlite3_bind_int(rollup_stmt, 3, it->first.severity);
+            sqlite3_bind_int64(rollup_stmt, 4, it->second.count);
+            sqlite3_bind_int64(rollup_stmt, 5, it->second.bytes);
+            if (sqlite3_step(rollup_stmt) != SQLITE_DONE)
+                fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+        }
+        rollup.clear();
+    }
+
+    /*
+        * Template ids are local to each file, miner ids are mapped on first use
+        * and continue after ids already in file (restart within the hour)
+    */
+    void open_templates() {
+        sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS templates (id INTEGER PRIMARY KEY, cluster INTEGER, pattern TEXT);", 0, 0, NULL);
+        if (sqlite3_prepare_v2(db, "INSERT INTO templates (id, cluster, pattern) VALUES (?, ?, ?);", -1, &template_stmt, NULL) != SQLITE_OK) {
+            fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+            exit(EXIT_FAILURE);
+        }
+        file_tids.clear();
+        file_clusters.clear();
+        next_tid = next_cluster = 1;
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "SELECT coalesce(max(id), 0) + 1, coalesce(max(cluster), 0) + 1 FROM templates;", -1, &stmt, NULL) == SQLITE_OK) {
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                next_tid = sqlite3_column_int(stmt, 0);
+                next_cluster = sqlite3_column_int(stmt, 1);
+            }
+            sqlite3_finalize(stmt);
+        }
+    }
+
+    int file_template(int cluster, int tid) {
+        auto it = file_tids.find(tid);
+        if (it != file_tids.end())
+            return it->second;
+        int &fcluster = file_clusters[cluster];
+        if (fcluster == 0)
+            fcluster = next_cluster++;
+        int id = next_tid++;
+        file_tids[tid] = id;
+        std::string pattern = drain_pattern(tid);
+        sqlite3_reset(template_stmt);
+        sqlite3_bind_int(template_stmt, 1, id);
+        sqlite3_bind_int(template_stmt, 2, fcluster);
+        sqlite3_bind_text(template_stmt, 3, pattern.c_str(), pattern.size(), SQLITE_TRANSIENT);
+        if (sqlite3_step(template_stmt) != SQLITE_DONE)
+            fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+        return id;
+    }
+
+#ifdef HAVE_ZSTD
+    void store_dict() {
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO zstd_dict (id, dict) VALUES (?, ?);", -1, &stmt, NULL) != SQLITE_OK)
+            return;
+        sqlite3_bind_int64(stmt, 1, ZSTD_getDictID_fromDict(zc.dict.data(), zc.dict.size()));
+        sqlite3_bind_blob(stmt, 2, zc.dict.data(), zc.dict.size(), SQLITE_STATIC);
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+            fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+    }
+
+    zstd_compressor zc;
+    int dict_pending;
+#endif
+    sqlite3 *db;
+    sqlite3_stmt *insert_stmt;
+    sqlite3_stmt *rollup_stmt;
+    std::map<rollup_key, rollup_value> rollup;
+    sqlite3_stmt *template_stmt;
+    std::vector<msg_template> mined;
+    std::unordered_map<int, int> file_tids;
+    std::unordered_map<int, int> file_clusters;
+    int next_tid;
+    int next_cluster;
+    sqlite3_stmt *journal_stmt;
+    int journal_new;
+    int wal_pages;
+};
+
+/*
+    * Native append-only columnar segment format (.seg)
+    *
+    * file:   "LCSEG001" block... [footer]
+    * block:  header (32 bytes, little-endian)
+    *           u32 magic "LCSB", u32 payload length, u32 crc32 of payload,
+    *           u32 rows, i64 min timestamp, i64 max timestamp
+    *         payload, one column after another:
+    *           host dictionary: varint count, count * 16 bytes
+    *           timestamp: zigzag varint delta from previous row (first from min)
+    *           host: varint dictionary index
+    *           pri: 1 byte
+    *           pid, uid: zigzag varint (-1 for network senders)
+    *           repeat: varint, last timestamp: varint delta from timestamp
+    *           message: varint raw length, varint compressed length,
+    *                    deflate of (varint length, bytes) per row
+    * footer: u32 magic "LCSF", u32 blocks, per block
+    *           u64 offset, u32 rows, i64 min timestamp, i64 max timestamp
+    *         u32 footer length (from "LCSF"), "LCSEGEND"
+    *
+    * Rows are buffered and written as one block per SEG_BLOCK_ROWS rows or
+    * SEG_FLUSH_INTERVAL seconds with single sequential write. Footer is
+    * written when hour is closed; without it (crash) readers scan block headers.
+*/
+#define SEG_MAGIC "LCSEG001"
+#define SEG_END_MAGIC "LCSEGEND"
+#define SEG_BLOCK_MAGIC 0x4253434cU  // "LCSB"
+#define SEG_FOOTER_MAGIC 0x4653434cU  // "LCSF"
+#define SEG_BLOCK_HDR 32
+#define SEG_BLOCK_ROWS 8192
+#define SEG_FLUSH_INTERVAL 1
+#define SEG_MAX_BLOCK (256 * 1024 * 1024)
+
+struct seg_index {
+    uint64_t offset;
+    uint32_t rows;
+    int64_t min_ts;
+    int64_t max_ts;
+};
+
+static void put_u32(std::string &out, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        out.push_back((char)(v >> (8 * i)));
+}
+
+static void put_u64(std::string &out, uint64_t v) {
+    for (int i = 0; i < 8; i++)
+        out.push_back((char)(v >> (8 * i)));
+}
+
+static void put_varint(std::string &out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+static inline uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+    return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+/*
+    * Read varint, return -1 on truncated input
+*/
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*p >= end)
+            return -1;
+        uint8_t b = *(*p)++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+/*
+    * Encode rows into block (header + payload)
+*/
+void segment_encode_block(const std::vector<logentry> &rows, std::string &out) {
+    std::string payload, msgs;
+    std::vector<hostaddr> dict;
+    std::vector<uint32_t> hostidx(rows.size());
+    int64_t min_ts = rows[0].ts, max_ts = rows[0].ts;
+
+    for (size_t i = 0; i < rows.size(); i++) {
+        if (rows[i].ts < min_ts)
+            min_ts = rows[i].ts;
+        if (rows[i].ts > max_ts)
+            max_ts = rows[i].ts;
+        // few senders per block, linear search of recent entries is enough
+        size_t j;
+        for (j = dict.size(); j > 0; j--) {
+            if (memcmp(&dict[j - 1], &rows[i].host, sizeof(hostaddr)) == 0)
+                break;
+        }
+        if (j == 0) {
+            dict.push_back(rows[i].host);
+            j = dict.size();
+        }
+        hostidx[i] = j - 1;
+    }
+
+    put_varint(payload, dict.size());
+    for (size_t i = 0; i < dict.size(); i++)
+        payload.append((const char *)dict[i].a, 16);
+    int64_t prev = min_ts;
+    for (size_t i = 0; i < rows.size(); i++) {
+        put_varint(payload, zigzag(rows[i].ts - prev));
+        prev = rows[i].ts;
+    }
+    for (size_t i = 0; i < rows.size(); i++)
+        put_varint(payload, hostidx[i]);
+    for (size_t i = 0; i < rows.size(); i++)
+        payload.push_back((char)rows[i].pri);
+    for (size_t i = 0; i < rows.size(); i++)
+        put_varint(payload, zigzag(rows[i].pid));
+    for (size_t i = 0; i < rows.size(); i++)
+        put_varint(payload, zigzag(rows[i].uid));
+    for (size_t i = 0; i < rows.size(); i++)
+        put_varint(payload, rows[i].repeat);
+    for (size_t i = 0; i < rows.size(); i++)
+        put_varint(payload, rows[i].repeat > 1 ? rows[i].last_ts - rows[i].ts : 0);
+
+    for (size_t i = 0; i < rows.size(); i++) {
+        put_varint(msgs, rows[i].msg.size());
+        msgs.append(rows[i].msg);
+    }
+    uLongf complen = compressBound(msgs.size());
+    std::string comp(complen, 0);
+    if (compress2((Bytef *)&comp[0], &complen, (const Bytef *)msgs.data(), msgs.size(), 1) != Z_OK) {
+        fprintf(stderr, "segment: compress failed\n");
+        exit(EXIT_FAILURE);
+    }
+    put_varint(payload, msgs.size());
+    put_varint(payload, complen);
+    payload.append(comp.data(), complen);
+
+    put_u32(out, SEG_BLOCK_MAGIC);
+    put_u32(out, payload.size());
+    put_u32(out, crc32(0, (const Bytef *)payload.data(), payload.size()));
+    put_u32(out, rows.size());
+    put_u64(out, min_ts);
+    put_u64(out, max_ts);
+    out.append(payload);
+}
+
+/*
+    * Decode block payload into rows
+    * Return 0 on success, -1 on corrupted block
+*/
+int segment_decode_block(const uint8_t *p, size_t len, uint32_t nrows, int64_t min_ts,
+                         std::vector<logentry> &rows) {
+    const uint8_t *end = p + len;
+    uint64_t v, ndict;
+    std::vector<hostaddr> dict;
+
+    rows.clear();
+    rows.resize(nrows);
+    if (get_varint(&p, end, &ndict) < 0 || ndict > (uint64_t)(end - p) / 16)
+        return -1;
+    dict.resize(ndict);
+    for (uint64_t i = 0; i < ndict; i++, p += 16)
+        memcpy(dict[i].a, p, 16);
+    int64_t prev = min_ts;
+    for (uint32_t i = 0; i < nrows; i++) {
+        if (get_varint(&p, end, &v) < 0)
+            return -1;
+        prev += unzigzag(v);
+        rows[i].ts = prev;
+    }
+    for (uint32_t i = 0; i < nrows; i++) {
+        if (get_varint(&p, end, &v) < 0 || v >= ndict)
+            return -1;
+        rows[i].host = dict[v];
+    }
+    if ((size_t)(end - p) < nrows)
+        return -1;
+    for (uint32_t i = 0; i < nrows; i++)
+        rows[i].pri = *p++;
+    for (uint32_t i = 0; i < nrows; i++) {
+        if (get_varint(&p, end, &v) < 0)
+            return -1;
+        rows[i].pid = unzigzag(v);
+    }
+    for (uint32_t i = 0; i < nrows; i++) {
+        if (get_varint(&p, end, &v) < 0)
+            return -1;
+        rows[i].uid = unzigzag(v);
+    }
+    for (uint32_t i = 0; i < nrows; i++) {
+        if (get_varint(&p, end, &v) < 0)
+            return -1;
+        rows[i].repeat = v;
+    }
+    for (uint32_t i = 0; i < nrows; i++) {
+        if (get_varint(&p, end, &v) < 0)
+            return -1;
+        rows[i].last_ts = rows[i].ts + v;
+    }
+
+    uint64_t rawlen, complen;
+    if (get_varint(&p, end, &rawlen) < 0 || get_varint(&p, end, &complen) < 0 ||
+        complen > (uint64_t)(end - p) || rawlen > SEG_MAX_BLOCK)
+        return -1;
+    std::string raw(rawlen, 0);
+    uLongf destlen = rawlen;
+    if (uncompress((Bytef *)&raw[0], &destlen, p, complen) != Z_OK || destlen != rawlen)
+        return -1;
+    const uint8_t *m = (const uint8_t *)raw.data(), *mend = m + rawlen;
+    for (uint32_t i = 0; i < nrows; i++) {
+        if (get_varint(&m, mend, &v) < 0 || v > (uint64_t)(mend - m))
+            return -1;
+        rows[i].msg.assign((const char *)m, v);
+        m += v;
+    }
+    return 0;
+}
+
+/*
+    * Walk blocks of segment file from start, stop at footer or first bad block
+    * Calls cb for each valid block header, return offset after last valid block
+*/
+template <typename F>
+uint64_t segment_scan(int sfd, F cb) {
+    uint8_t hdr[SEG_BLOCK_HDR];
+    uint64_t off = strlen(SEG_MAGIC);
+    std::string payload;
+    while (pread(sfd, hdr, sizeof(hdr), off) == sizeof(hdr)) {
+        if (get_u32(hdr) != SEG_BLOCK_MAGIC)
+            break;
+        uint32_t len = get_u32(hdr + 4);
+        if (len > SEG_MAX_BLOCK)
+            break;
+        payload.resize(len);
+        if (pread(sfd, &payload[0], len, off + SEG_BLOCK_HDR) != (ssize_t)len)
+            break;
+        if (crc32(0, (const Bytef *)payload.data(), len) != get_u32(hdr + 8))
+            break;
+        seg_index idx;
+        idx.offset = off;
+        idx.rows = get_u32(hdr + 12);
+        idx.min_ts = (int64_t)get_u64(hdr + 16);
+        idx.max_ts = (int64_t)get_u64(hdr + 24);
+        cb(idx, payload);
+        off += SEG_BLOCK_HDR + len;
+    }
+    return off;
+}
+
+class segment_storage : public storage {
+public:
+    segment_storage() : sfd(-1), offset(0), block_start(0) {}
+
+    const char *suffix() { return ".seg"; }
+
+    void open(const char *path) {
+        sfd = ::open(path, O_RDWR | O_CREAT, 0644);
+        if (sfd < 0) {
+            fprintf(stderr, "Can't open segment %s: %s\n", path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        index.clear();
+        char magic[8];
+        if (pread(sfd, magic, sizeof(magic), 0) == sizeof(magic) && memcmp(magic, SEG_MAGIC, 8) == 0) {
+            // reopened within same hour, keep valid blocks, drop footer and torn tail
+            offset = segment_scan(sfd, [this](const seg_index &idx, const std::string &) {
+                index.push_back(idx);
+            });
+        } else {
+            if (pwrite(sfd, SEG_MAGIC, 8, 0) != 8) {
+                fprintf(stderr, "Can't write segment %s: %s\n", path, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            offset = 8;
+        }
+        if (ftruncate(sfd, offset) < 0)
+            perror("ftruncate");
+    }
+
+    // journal is sqlite only, blocks are not written transactionally
+    int write(std::vector<logentry> &batch, const journal_mark *) {
+        if (block.empty())
+            block_start = time(NULL);
+        for (size_t i = 0; i < batch.size(); i++) {
+            block.push_back(std::move(batch[i]));
+            if (block.size() >= SEG_BLOCK_ROWS)
+                flush_block();
+        }
+        if (!block.empty() && time(NULL) - block_start >= SEG_FLUSH_INTERVAL)
+            flush_block();
+        return 0;
+    }
+
+    void idle() {
+        if (!block.empty() && time(NULL) - block_start >= SEG_FLUSH_INTERVAL)
+            flush_block();
+    }
+
+    void close() {
+        if (sfd < 0)
+            return;
+        flush_block();
+        std::string footer;
+        put_u32(footer, SEG_FOOTER_MAGIC);
+        put_u32(footer, index.size());
+        for (size_t i = 0; i < index.size(); i++) {
+            put_u64(footer, index[i].offset);
+            put_u32(footer, index[i].rows);
+            put_u64(footer, index[i].min_ts);
+            put_u64(footer, index[i].max_ts);
+        }
+        put_u32(footer, footer.size());
+        footer.append(SEG_END_MAGIC);
+        if (pwrite(sfd, footer.data(), footer.size(), offset) != (ssize_t)footer.size())
+            perror("segment footer");
+        fsync(sfd);
+        ::close(sfd);
+        sfd = -1;
+    }
+
+private:
+    void flush_block() {
+        if (block.empty())
+            return;
+        std::string out;
+        segment_encode_block(block, out);
+        seg_index idx;
+        idx.offset = offset;
+        idx.rows = block.size();
+        idx.min_ts = (int64_t)get_u64((const uint8_t *)out.data() + 16);
+        idx.max_ts = (int64_t)get_u64((const uint8_t *)out.data() + 24);
+        if (pwrite(sfd, out.data(), out.size(), offset) != (ssize_t)out.size()) {
+            perror("segment write");
+        } else {
+            offset += out.size();
+            index.push_back(idx);
+        }
+        block.clear();
+        block_start = time(NULL);
+    }
+
+    int sfd;
+    uint64_t offset;
+    time_t block_start;
+    std::vector<logentry> block;
+    std::vector<seg_index> index;
+};
+
+storage *storage_create(const char *name) {
+    if (strcmp(name, "sqlite") == 0)
+        return new sqlite_storage();
+    if (strcmp(name, "segment") == 0)
+        return new segment_storage();
+    return NULL;
+}
+
+/*
+    * Period file rotation of one store
+    * Period starts at multiple of interval from local midnight, file is named
+    * after its start: YYYYMMDDHH, or YYYYMMDDHHMM for sub-hour intervals.
+    * When file grows over max_size, writing continues in STAMP-1, STAMP-2, ...
+    * Shard N of a sharded store writes STAMP[-SEQ].N files.
+*/
+struct rotation {
+    time_t period;
+    int seq;
+    char path[1024];
+};
+
+time_t period_start(time_t now, int interval, struct tm *tm) {
+    localtime_r(&now, tm);
+    time_t start = now - (tm->tm_hour * 3600 + tm->tm_min * 60 + tm->tm_sec) % interval;
+    localtime_r(&start, tm);
+    return start;
+}
+
+/*
+    * Check if dbfile needs to be updated (new period, or size cap reached
+    * when check_size is set). If yes, close current db and open new one
+*/
+void dbtimecheck(logstore *ls, storage *st, rotation *rot, int check_size) {
+    struct tm tm;
+    time_t period = period_start(time(NULL), ls->interval, &tm);
+    if (period == rot->period) {
+        struct stat sb;
+        if (!check_size || ls->max_size == 0 || stat(rot->path, &sb) < 0 || sb.st_size < ls->max_size)
+            return;
+        rot->seq++;
+    } else {
+        rot->period = period;
+        rot->seq = 0;
+    }
+    std::string closed = rot->path;
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), ls->interval % 3600 == 0 ? "%Y%m%d%H" : "%Y%m%d%H%M", &tm);
+    char shard[16] = "";
+    if (ls->nshards > 1)
+        snprintf(shard, sizeof(shard), ".%d", ls->shard);
+    if (rot->seq > 0)
+        snprintf(rot->path, sizeof(rot->path), "%s/%s-%d%s%s", ls->dir, stamp, rot->seq, shard, st->suffix());
+    else
+        snprintf(rot->path, sizeof(rot->path), "%s/%s%s%s", ls->dir, stamp, shard, st->suffix());
+    if (config.verbose) {
+        printf("%s dbfile: %s\n", ls->name, rot->path);
+    }
+    st->close();
+    if (!closed.empty()) {
+        usage_update(closed);
+        hour_closed(closed.c_str());
+    }
+    if (ls->quota > 0) {
+        logstore *owner = ls - ls->shard;
+        pthread_mutex_lock(&owner->usage_lock);
+        owner->current[ls->shard] = strrchr(rot->path, '/') + 1;
+        pthread_mutex_unlock(&owner->usage_lock);
+    }
+    st->open(rot->path);
+}
+
+/*
+    * Parse period file name STAMP[-SEQ][.SHARD]SUFFIX, STAMP is YYYYMMDDHH or
+    * YYYYMMDDHHMM
+    * Return STAMP length (0 if not period file), start time of period in *start
+*/
+size_t dbfile_stamp(const char *name, time_t *start) {
+    size_t len = strspn(name, "0123456789");
+    if (len != 10 && len != 12)
+        return 0;
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    char buf[13];
+    memcpy(buf, name, len);
+    buf[len] = 0;
+    if (strptime(buf, len == 10 ? "%Y%m%d%H" : "%Y%m%d%H%M", &tm) == NULL)
+        return 0;
+    tm.tm_isdst = -1;
+    if (start != NULL)
+        *start = mktime(&tm);
+    return len;
+}
+
+static inline int ends_with(const std::string &s, const char *suffix) {
+    size_t len = strlen(suffix);
+    return s.size() >= len && s.compare(s.size() - len, len, suffix) == 0;
+}
+
+/*
+    * Disk quota accounting
+    * Usage is scanned once at startup, then kept up to date by whoever
+    * changes files: writer after each batch and rotation, hour worker for
+    * sidecars, housekeeping for compression and removal.
+*/
+void usage_set(logstore *ls, const std::string &name, off_t size) {
+    if (ls->quota == 0)
+        return;
+    pthread_mutex_lock(&ls->usage_lock);
+    auto it = ls->files.find(name);
+    if (it != ls->files.end()) {
+        ls->usage -= it->second;
+        if (size < 0)
+            ls->files.erase(it);
+        else
+            it->second = size;
+    } else if (size >= 0) {
+        ls->files[name] = size;
+    }
+    if (size > 0)
+        ls->usage += size;
+    pthread_mutex_unlock(&ls->usage_lock);
+}
+
+/*
+    * Update usage of file by path (size from stat, removed if missing)
+*/
+void usage_update(const std::string &path) {
+    size_t slash = path.rfind('/');
+    if (slash == std::string::npos)
+        return;
+    std::string dir = path.substr(0, slash), name = path.substr(slash + 1);
+    for (int i = 0; i < stores.n; i++) {
+        if (stores.list[i].quota == 0 || stores.list[i].shard > 0 || dir != stores.list[i].dir)
+            continue;
+        struct stat sb;
+        usage_set(&stores.list[i], name, stat(path.c_str(), &sb) < 0 ? -1 : sb.st_size);
+    }
+}
+
+static inline int usage_ignored(const char *name) {
+    // sqlite journal belongs to open file, tmp files are being written
+    return ends_with(name, "-journal") || ends_with(name, "-wal") || ends_with(name, "-shm") ||
+           ends_with(name, ".tmp");
+}
+
+void usage_scan(logstore *ls) {
+    DIR *dir = opendir(ls->dir);
+    struct dirent *ent;
+    if (dir == NULL) {
+        perror("opendir");
+        return;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        if (dbfile_stamp(ent->d_name, NULL) == 0 || usage_ignored(ent->d_name))
+            continue;
+        struct stat sb;
+        if (stat((std::string(ls->dir) + "/" + ent->d_name).c_str(), &sb) == 0)
+            usage_set(ls, ent->d_name, sb.st_size);
+    }
+    closedir(dir);
+    if (config.verbose)
+        printf("Store %s uses %lld of %lld bytes quota\n", ls->name, (long long)ls->usage, (long long)ls->quota);
+}
+
+/*
+    * Evict oldest files until store is under quota. File being written is
+    * never evicted, when only it is left quota stays exceeded.
+*/
+void usage_enforce(logstore *ls) {
+    static int warned;
+    while (1) {
+        pthread_mutex_lock(&ls->usage_lock);
+        if (ls->usage <= ls->quota || ls->files.empty()) {
+            pthread_mutex_unlock(&ls->usage_lock);
+            return;
+        }
+        std::string name = ls->files.begin()->first;
+        int current = std::find(ls->current.begin(), ls->current.end(), name) != ls->current.end();
+        pthread_mutex_unlock(&ls->usage_lock);
+        if (current) {
+            if (!warned++)
+                fprintf(stderr, "Store %s over quota with only current file left\n", ls->name);
+            return;
+        }
+        std::string path = std::string(ls->dir) + "/" + name;
+        if (ls->archive != NULL) {
+            std::string dest = std::string(ls->archive) + "/" + name;
+            if (rename(path.c_str(), dest.c_str()) < 0) {
+                fprintf(stderr, "Can't archive %s to %s: %s\n", path.c_str(), dest.c_str(), strerror(errno));
+                return;
+            }
+        } else if (unlink(path.c_str()) < 0 && errno != ENOENT) {
+            fprintf(stderr, "Can't remove %s: %s\n", path.c_str(), strerror(errno));
+            return;
+        }
+        if (config.verbose)
+            printf("Quota of store %s: evicted %s\n", ls->name, name.c_str());
+        usage_set(ls, name, -1);
+        __sync_fetch_and_add(&ls->evicted, 1);
+    }
+}
+
+/*
+    * Store housekeeping: delete period files (with sidecars) older than
+    * retention, xz compress period files older than compress_age.
+    * Only files of finished periods are touched.
+*/
+#define CLEANUP_INTERVAL 60
+
+/*
+    * Recover and checkpoint closed period file left open by unclean stop,
+    * before it is compressed or exported
+*/
+void finish_interrupted(const std::string &path) {
+    sqlite3 *db;
+    if (sqlite3_open(path.c_str(), &db) != SQLITE_OK) {
+        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+    sqlite3_busy_timeout(db, 1000);
+    sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL);
+    if (sqlite3_exec(db, "PRAGMA journal_mode=DELETE;", 0, 0, NULL) != SQLITE_OK)
+        fprintf(stderr, "Can't finish %s: %s\n", path.c_str(), sqlite3_errmsg(db));
+    else
+        printf("Finished interrupted %s\n", path.c_str());
+    sqlite3_close(db);
+}
+
+void cleanup(logstore *ls) {
+    DIR *dir = opendir(ls->dir);
+    struct dirent *ent;
+    if (dir == NULL) {
+        perror("opendir");
+        return;
+    }
+    time_t now = time(NULL);
+    while ((ent = readdir(dir)) != NULL) {
+        time_t start;
+        if (dbfile_stamp(ent->d_name, &start) == 0)
+            continue;
+        time_t end = start + ls->interval;
+        if (end > now)
+            continue;
+        std::string path = std::string(ls->dir) + "/" + ent->d_name;
+        if (ends_with(ent->d_name, ".sqlite3") && db_interrupted(path.c_str()))
+            finish_interrupted(path);
+        if (ls->retention > 0 && now - end > ls->retention) {
+            if (config.verbose)
+                printf("Removing %s\n", path.c_str());
+            if (unlink(path.c_str()) < 0)
+                perror("unlink");
+            usage_set(ls, ent->d_name, -1);
+            continue;
+        }
+        if (ls->compress_age > 0 && now - end > ls->compress_age &&
+            (ends_with(ent->d_name, ".sqlite3") || ends_with(ent->d_name, ".seg"))) {
+            char cmd[2048];
+            printf("Compressing %s\n", path.c_str());
+            snprintf(cmd, sizeof(cmd), "xz -1 '%s'", path.c_str());
+            if (system(cmd) != 0)
+                fprintf(stderr, "Compression of %s failed\n", path.c_str());
+            usage_update(path);
+            usage_update(path + ".xz");
+        }
+    }
+    closedir(dir);
+}
+
+void *cleanup_thread(void *arg) {
+    (void)arg;
+    numa_bind(-1);
+    for (int i = 0; i < stores.n; i++)
+        if (stores.list[i].quota > 0 && stores.list[i].shard == 0)
+            usage_scan(&stores.list[i]);
+    // quota is checked every second, directories are scanned less often
+    for (int tick = 0; ; tick++) {
+        for (int i = 0; i < stores.n; i++) {
+            if (stores.list[i].shard > 0)
+                continue;
+            if (tick % CLEANUP_INTERVAL == 0)
+                cleanup(&stores.list[i]);
+            if (stores.list[i].quota > 0)
+                usage_enforce(&stores.list[i]);
+        }
+        sleep(1);
+    }
+    return NULL;
+}
+
+/*
+    * Write-ahead journal of one store (--journal)
+    * Messages are appended to journal[-SHARD]-OFFSET.wal segments in store
+    * directory before they are queued (open dedup runs and messages held
+    * during handoff are not journaled yet); journal thread writes and fdatasyncs
+    * appended records every JOURNAL_COMMIT_US (group commit). Writer commits
+    * watermark with each batch, so at startup records not yet in database
+    * are replayed exactly once. Segments below watermark are deleted.
+    *
+    * record: u32 payload length, u32 crc32 of payload, payload:
+    *         varint ts, pid + 1, uid + 1, pri, repeat, last_ts,
+    *         host[16], varint tags length, tags, varint msg length, msg
+*/
+#define JOURNAL_SEGMENT (64LL * 1024 * 1024)
+#define JOURNAL_COMMIT_US 10000
+#define JOURNAL_HDR 8
+
+uint64_t journal_replayed;
+
+void journal_encode(const logentry &e, std::string &out) {
+    std::string payload;
+    put_varint(payload, (uint32_t)e.ts);
+    put_varint(payload, (uint64_t)(e.pid + 1));
+    put_varint(payload, (uint64_t)(e.uid + 1));
+    put_varint(payload, e.pri);
+    put_varint(payload, e.repeat);
+    put_varint(payload, (uint32_t)e.last_ts);
+    payload.append((const char *)e.host.a, 16);
+    put_varint(payload, e.tags.size());
+    payload += e.tags;
+    put_varint(payload, e.msg.size());
+    payload += e.msg;
+    put_u32(out, payload.size());
+    put_u32(out, crc32(0, (const Bytef *)payload.data(), payload.size()));
+    out += payload;
+}
+
+int journal_decode(const uint8_t *p, size_t len, logentry &e) {
+    const uint8_t *end = p + len;
+    uint64_t v[6], n;
+    for (int i = 0; i < 6; i++)
+        if (get_varint(&p, end, &v[i]) < 0)
+            return -1;
+    e.ts = (int)v[0];
+    e.pid = (int)v[1] - 1;
+    e.uid = (int)v[2] - 1;
+    e.pri = (int)v[3];
+    e.repeat = (int)v[4];
+    e.last_ts = (int)v[5];
+    if (end - p < 16)
+        return -1;
+    memcpy(e.host.a, p, 16);
+    p += 16;
+    if (get_varint(&p, end, &n) < 0 || n > (uint64_t)(end - p))
+        return -1;
+    e.tags.assign((const char *)p, n);
+    p += n;
+    if (get_varint(&p, end, &n) < 0 || n > (uint64_t)(end - p))
+        return -1;
+    e.msg.assign((const char *)p, n);
+    return 0;
+}
+
+static std::string journal_path(logstore *ls, int64_t start) {
+    char name[64];
+    if (ls->nshards > 1)
+        snprintf(name, sizeof(name), "/journal-%d-%016llx.wal", ls->shard, (long long)start);
+    else
+        snprintf(name, sizeof(name), "/journal-%016llx.wal", (long long)start);
+    return std::string(ls->dir) + name;
+}
+
+// return 1 if name is journal segment of this shard, -1 if it was written
+// with another shard count; start offset in *start, its shard (-1 unsharded)
+// in *shard
+static int journal_segment(logstore *ls, const char *name, int64_t *start, int *shard) {
+    if (!ends_with(name, ".wal"))
+        return 0;
+    unsigned long long ofs;
+    int len = 0;
+    if (sscanf(name, "journal-%d-%16llx.wal%n", shard, &ofs, &len) == 2 && name[len] == 0) {
+        if (*shard < 0)
+            return 0;
+    } else if (sscanf(name, "journal-%16llx.wal%n", &ofs, &len) == 1 && name[len] == 0) {
+        *shard = -1;
+    } else {
+        return 0;
+    }
+    *start = ofs;
+    if (ls->nshards > 1 ? *shard < 0 || *shard >= ls->nshards : *shard >= 0)
+        return -1;
+    return *shard == (ls->nshards > 1 ? ls->shard : -1);
+}
+
+// shard number of period file name, -1 for file of unsharded store
+static int dbfile_shard(const std::string &name) {
+    size_t end = name.rfind('.');
+    size_t dot = end == std::string::npos ? end : name.rfind('.', end - 1);
+    if (dot == std::string::npos || dot < dbfile_stamp(name.c_str(), NULL) || !isdigit((unsigned char)name[dot + 1]))
+        return -1;
+    return atoi(name.c_str() + dot + 1);
+}
+
+/*
+    * Watermark committed in newest period file of shard (-1 unsharded) that
+    * has one, records applied ahead of it into *ahead if given
+    * Return 1 if found, 0 if not
+*/
+static int journal_watermark(logstore *ls, int shard, int64_t *applied, int64_t *tail, std::set<int64_t> *ahead) {
+    std::vector<std::string> files;
+    DIR *dir = opendir(ls->dir);
+    struct dirent *ent;
+    if (dir == NULL) {
+        perror("opendir");
+        exit(EXIT_FAILURE);
+    }
+    while ((ent = readdir(dir)) != NULL)
+        if (dbfile_stamp(ent->d_name, NULL) != 0 && ends_with(ent->d_name, ".sqlite3") &&
+            dbfile_shard(ent->d_name) == shard)
+            files.push_back(ent->d_name);
+    closedir(dir);
+    std::sort(files.begin(), files.end(), dbfile_before);
+    for (size_t i = files.size(); i-- > 0;) {
+        std::string path = std::string(ls->dir) + "/" + files[i];
+        sqlite3 *db;
+        sqlite3_stmt *stmt;
+        // read-write, file left open by crash is recovered before reading
+        if (sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+            sqlite3_close(db);
+            continue;
+        }
+        int found = 0;
+        if (sqlite3_prepare_v2(db, "SELECT applied, tail FROM journal_state;", -1, &stmt, NULL) == SQLITE_OK) {
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                *applied = sqlite3_column_int64(stmt, 0);
+                *tail = sqlite3_column_int64(stmt, 1);
+                found = 1;
+            }
+            sqlite3_finalize(stmt);
+        }
+        if (found && ahead != NULL &&
+            sqlite3_prepare_v2(db, "SELECT ofs FROM journal_applied;", -1, &stmt, NULL) == SQLITE_OK) {
+            while (sqlite3_step(stmt) == SQLITE_ROW)
+                ahead->insert(sqlite3_column_int64(stmt, 0));
+            sqlite3_finalize(stmt);
+        }
+        sqlite3_close(db);
+        if (found) {
+            if (config.verbose)
+                printf("Store %s: journal applied up to %lld in %s\n", ls->name, (long long)*applied,
+                       files[i].c_str());
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+    * Load watermark of this shard, list segments to replay. Writer is not
+    * started yet, its first batch starts from here. Segments left by other
+    * --shards are removed once applied, otherwise startup is refused: their
+    * offsets and watermark belong to period files of other layout
+*/
+void journal_recover(logstore *ls) {
+    ls->jend = ls->japplied = ls->jfloor = 0;
+    ls->jfd = -1;
+    journal_watermark(ls, ls->nshards > 1 ? ls->shard : -1, &ls->japplied, &ls->jend, &ls->jahead);
+    ls->jfloor = ls->japplied;
+
+    // existing segments, new records go past their end so receiving can
+    // start before replay has validated them
+    std::map<int, std::vector<std::string> > other;
+    std::map<int, int64_t> other_end;
+    DIR *dir = opendir(ls->dir);
+    struct dirent *ent;
+    if (dir == NULL) {
+        perror("opendir");
+        exit(EXIT_FAILURE);
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        int64_t start;
+        int shard;
+        int found = journal_segment(ls, ent->d_name, &start, &shard);
+        if (found > 0)
+            ls->jreplay.push_back(start);
+        // shards of one store share directory, first one handles leftovers
+        if (found < 0 && ls->shard == 0) {
+            std::string path = std::string(ls->dir) + "/" + ent->d_name;
+            struct stat sb;
+            if (stat(path.c_str(), &sb) == 0)
+                other_end[shard] = std::max(other_end[shard], start + (int64_t)sb.st_size);
+            other[shard].push_back(path);
+        }
+    }
+    closedir(dir);
+    for (auto it = other.begin(); it != other.end(); it++) {
+        int64_t applied = 0, tail = 0;
+        journal_watermark(ls, it->first, &applied, &tail, NULL);
+        if (applied < other_end[it->first]) {
+            fprintf(stderr, "Store %s: journal %s has records not yet stored, written with another --shards; "
+                            "start with previous shard count to replay it\n", ls->name, it->second[0].c_str());
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < it->second.size(); i++)
+            unlink(it->second[i].c_str());
+        printf("Store %s: removed %zu applied journal segments of previous --shards\n", ls->name,
+               it->second.size());
+    }
+    std::sort(ls->jreplay.begin(), ls->jreplay.end());
+    if (!ls->jreplay.empty()) {
+        struct stat sb;
+        if (stat(journal_path(ls, ls->jreplay.back()).c_str(), &sb) == 0)
+            ls->jend = std::max(ls->jend, ls->jreplay.back() + (int64_t)sb.st_size);
+    }
+    ls->jsegs = ls->jreplay;
+    ls->replaying = 1;
+}
+
+/*
+    * Queue records from watermark on, skipping those applied ahead of it
+    * Runs in its own thread while messages are received: those are journaled
+    * and held until replay is done, so lanes stay in journal order. Torn tail
+    * of last commit is truncated.
+*/
+void *journal_replay(void *arg) {
+    logstore *ls = (logstore *)arg;
+    numa_bind(-1);
+    const std::vector<int64_t> &segs = ls->jreplay;
+    // writer cannot move watermark before first record is queued
+    int64_t applied = ls->japplied;
+    uint64_t replayed = 0;
+    std::string data;
+    for (size_t i = 0; i < segs.size(); i++) {
+        std::string path = journal_path(ls, segs[i]);
+        // whole segment is below watermark
+        if (i + 1 < segs.size() && segs[i + 1] <= applied)
+            continue;
+        int jfd = open(path.c_str(), O_RDONLY);
+        struct stat sb;
+        if (jfd < 0 || fstat(jfd, &sb) < 0) {
+            perror("open journal");
+            exit(EXIT_FAILURE);
+        }
+        posix_fadvise(jfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        data.resize(sb.st_size);
+        size_t got = 0;
+        while (got < data.size()) {
+            ssize_t n = read(jfd, &data[got], data.size() - got);
+            if (n <= 0)
+                break;
+            got += n;
+        }
+        close(jfd);
+        data.resize(got);
+
+        const uint8_t *p = (const uint8_t *)data.data();
+        size_t pos = 0;
+        while (pos + JOURNAL_HDR <= data.size()) {
+            uint32_t len = get_u32(p + pos);
+            if (len > data.size() - pos - JOURNAL_HDR ||
+                crc32(0, (const Bytef *)p + pos + JOURNAL_HDR, len) != get_u32(p + pos + 4))
+                break;
+            const uint8_t *rec = p + pos + JOURNAL_HDR;
+            int64_t ofs = segs[i] + pos;
+            pos += JOURNAL_HDR + len;
+            if (ofs < applied || ls->jahead.count(ofs))
+                continue;
+            logentry e;
+            if (journal_decode(rec, len, e) < 0)
+                continue;
+            e.store = ls - stores.list;
+            e.jofs = ofs;
+            msg_queue &queue = ls->queue;
+            pthread_mutex_lock(&queue.lock);
+            while (queue.size >= QUEUE_MAX) {
+                pthread_mutex_unlock(&queue.lock);
+                usleep(1000);
+                pthread_mutex_lock(&queue.lock);
+            }
+            queue.lanes[e.pri & 7].push_back(std::move(e));
+            queue.size++;
+            ls->jfloor = segs[i] + pos;
+            pthread_mutex_unlock(&queue.lock);
+            replayed++;
+        }
+        if (pos < data.size()) {
+            // nothing is appended to old segments, rest of this one is lost
+            fprintf(stderr, "Store %s: journal %s truncated at %zu\n", ls->name, path.c_str(), pos);
+            if (truncate(path.c_str(), pos) < 0)
+                perror("truncate journal");
+        }
+    }
+    // messages received meanwhile follow replayed ones
+    pthread_mutex_lock(&ls->queue.lock);
+    while (!ls->held.empty()) {
+        logentry &e = ls->held.front();
+        ls->queue.lanes[e.pri & 7].push_back(std::move(e));
+        ls->queue.size++;
+        ls->held.pop_front();
+    }
+    ls->replaying = 0;
+    ls->jfloor = INT64_MAX;
+    journal_replayed += replayed;
+    pthread_mutex_unlock(&ls->queue.lock);
+    printf("Store %s: replayed %llu journal records\n", ls->name, (unsigned long long)replayed);
+    return NULL;
+}
+
+/*
+    * Group commit of records appended since last round, then drop segments
+    * that are entirely applied
+*/
+void journal_flush(logstore *ls) {
+    std::string data;
+    pthread_mutex_lock(&ls->queue.lock);
+    data.swap(ls->jpending);
+    int64_t end = ls->jend;
+    int64_t applied = ls->japplied;
+    pthread_mutex_unlock(&ls->queue.lock);
+    if (!data.empty()) {
+        int64_t start = end - data.size();
+        if (ls->jfd >= 0 && ls->jsize >= JOURNAL_SEGMENT) {
+            close(ls->jfd);
+            ls->jfd = -1;
+        }
+        if (ls->jfd < 0) {
+            std::string path = journal_path(ls, start);
+            ls->jfd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (ls->jfd < 0) {
+                fprintf(stderr, "Can't open journal %s: %s\n", path.c_str(), strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            ls->jsegs.push_back(start);
+            ls->jsize = 0;
+        }
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = write(ls->jfd, data.data() + done, data.size() - done);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("write journal");
+                break;
+            }
+            done += n;
+        }
+        if (fdatasync(ls->jfd) < 0)
+            perror("fdatasync journal");
+        ls->jsize += data.size();
+    }
+    while (ls->jsegs.size() > 1 && ls->jsegs[1] <= applied) {
+        if (unlink(journal_path(ls, ls->jsegs[0]).c_str()) < 0)
+            perror("unlink journal");
+        ls->jsegs.erase(ls->jsegs.begin());
+    }
+}
+
+void *journal_thread(void *arg) {
+    (void)arg;
+    numa_bind(-1);
+    while (!handoff.journal_stop) {
+        for (int i = 0; i < stores.n; i++)
+            journal_flush(&stores.list[i]);
+        usleep(JOURNAL_COMMIT_US);
+    }
+    // handoff, writers are stopped: last records, then new process owns segments
+    for (int i = 0; i < stores.n; i++) {
+        journal_flush(&stores.list[i]);
+        if (stores.list[i].jfd >= 0)
+            close(stores.list[i].jfd);
+    }
+    handoff.journal_done = 1;
+    return NULL;
+}
+
+int store_drained(logstore *ls) {
+    pthread_mutex_lock(&ls->queue.lock);
+    int drained = ls->queue.size == 0 && ls->held.empty() && !ls->replaying;
+    pthread_mutex_unlock(&ls->queue.lock);
+    return drained;
+}
+
+/*
+    * Writer of one store, stores commit independently
+*/
+/*
+    * Take next batch of writer from queue. With journal, mark gets watermark
+    * and ahead (set mark points to) is updated as it is once batch is committed
+    * Return number of records taken
+*/
+size_t writer_take(logstore *ls, std::vector<logentry> &batch, size_t max, journal_mark *mark, std::set<int64_t> &ahead) {
+    batch.clear();
+    dequeue_batch(ls, batch, max, mark);
+    if (mark != NULL) {
+        ahead.erase(ahead.begin(), ahead.lower_bound(mark->applied));
+        for (size_t i = 0; i < batch.size(); i++)
+            if (batch[i].jofs >= mark->applied)
+                ahead.insert(batch[i].jofs);
+    }
+    return batch.size();
+}
+
+// batch with mark is committed, journal below watermark can be dropped
+void writer_applied(logstore *ls, const journal_mark *mark) {
+    pthread_mutex_lock(&ls->queue.lock);
+    ls->japplied = mark->applied;
+    pthread_mutex_unlock(&ls->queue.lock);
+}
+
+void *db_thread(void *arg) {
+    logstore *ls = (logstore *)arg;
+    if (ls->nshards > 1)
+        printf("db_thread() started for store %s shard %d\n", ls->name, ls->shard);
+    else
+        printf("db_thread() started for store %s\n", ls->name);
+    // before anything is allocated, so sqlite cache is node local
+    numa_bind(ls->node);
+    rotation rot;
+    memset(&rot, 0, sizeof(rot));
+    storage *st = storage_create(config.storage);
+    std::vector<logentry> batch;
+    batch.reserve(BATCH_MAX);
+    int written = 0;
+    // journal records in database above watermark
+    std::set<int64_t> ahead = ls->jahead;
+    journal_mark mark;
+    mark.ahead = &ahead;
+    // batch (and its mark) not stored yet, written again until it is
+    int pending = 0;
+    while (1) {
+        // handoff: file is left to new process once queue is empty; batch
+        // still pending is above watermark, new process replays it
+        if (handoff.draining && store_drained(ls))
+            break;
+        // check if dbfile needs to be updated, size only after writes
+        dbtimecheck(ls, st, &rot, written);
+        // take batch from queue
+        if (!pending && writer_take(ls, batch, BATCH_MAX, config.journal ? &mark : NULL, ahead) == 0) {
+            written = 0;
+            st->idle();
+            usleep(1000);
+            continue;
+        }
+        // insert into db, watermark moves only once batch is committed
+        pending = st->write(batch, config.journal ? &mark : NULL) < 0;
+        if (pending) {
+            usleep(100000);
+            continue;
+        }
+        written = 1;
+        if (ls->first_insert == 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            ls->first_insert = (now.tv_sec - startup_time.tv_sec) + (now.tv_nsec - startup_time.tv_nsec) / 1e9;
+            printf("Store %s: first insert %.3fs after startup\n", ls->name, ls->first_insert);
+        }
+        if (config.journal)
+            writer_applied(ls, &mark);
+        if (ls->quota > 0)
+            usage_update(rot.path);
+    }
+    // period is not over, file is not handed to hour worker
+    st->close();
+    delete st;
+    if (config.verbose)
+        printf("db_thread() stopped for store %s shard %d\n", ls->name, ls->shard);
+    ls->stopped = 1;
+    return NULL;
+}
+
+/*
+    * SQL function host_ntop(host): format binary host column as text
+    * Rows written before binary storage keep their text value
+*/
+void sql_host_ntop(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    (void)argc;
+    char buf[INET6_ADDRSTRLEN];
+    if (sqlite3_value_type(argv[0]) == SQLITE_BLOB && sqlite3_value_bytes(argv[0]) == 16) {
+        host_ntop((const uint8_t *)sqlite3_value_blob(argv[0]), buf, sizeof(buf));
+        sqlite3_result_text(ctx, buf, -1, SQLITE_TRANSIENT);
+    } else {
+        sqlite3_result_value(ctx, argv[0]);
+    }
+}
+
+/*
+    * SQL function msg_text(message [, template, params]): message as text, zstd
+    * compressed rows are decompressed with dictionary from zstd_dict table of
+    * the same file, rows stored as template only are rebuilt from templates
+    * table and params
+*/
+#ifdef HAVE_ZSTD
+struct zstd_decompressor {
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    std::unordered_map<unsigned, ZSTD_DDict *> ddicts;
+    std::string out;
+
+    ~zstd_decompressor() {
+        for (auto it = ddicts.begin(); it != ddicts.end(); ++it)
+            ZSTD_freeDDict(it->second);
+        ZSTD_freeDCtx(dctx);
+    }
+
+    ZSTD_DDict *get(sqlite3 *db, unsigned id) {
+        auto it = ddicts.find(id);
+        if (it != ddicts.end())
+            return it->second;
+        ZSTD_DDict *dd = NULL;
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "SELECT dict FROM zstd_dict WHERE id = ?;", -1, &stmt, NULL) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, id);
+            if (sqlite3_step(stmt) == SQLITE_ROW)
+                dd = ZSTD_createDDict(sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0));
+            sqlite3_finalize(stmt);
+        }
+        ddicts[id] = dd;
+        return dd;
+    }
+};
+#endif
+
+struct msg_reader {
+#ifdef HAVE_ZSTD
+    zstd_decompressor zd;
+#endif
+    std::unordered_map<int, std::string> patterns;
+    std::string out;
+
+    const std::string *pattern(sqlite3 *db, int id) {
+        auto it = patterns.find(id);
+        if (it != patterns.end())
+            return &it->second;
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "SELECT pattern FROM templates WHERE id = ?;", -1, &stmt, NULL) != SQLITE_OK)
+            return NULL;
+        sqlite3_bind_int(stmt, 1, id);
+        const std::string *p = NULL;
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+            p = &(patterns[id] = (const char *)sqlite3_column_text(stmt, 0));
+        sqlite3_finalize(stmt);
+        return p;
+    }
+};
+
+void msg_reader_free(void *p) {
+    delete (msg_reader *)p;
+}
+
+/*
+    * Substitute space separated params for "<*>" tokens of pattern
+    * Return 0 on success, -1 if params do not fit
+*/
+int render_template(const std::string &pattern, const char *params, std::string &out) {
+    out.clear();
+    size_t i = 0;
+    while (1) {
+        size_t end = pattern.find(' ', i);
+        if (end == std::string::npos)
+            end = pattern.size();
+        if (i > 0)
+            out += ' ';
+        if (pattern.compare(i, end - i, DRAIN_WILDCARD) == 0) {
+            if (*params == 0)
+                return -1;
+            const char *sp = strchr(params, ' ');
+            size_t len = sp != NULL ? (size_t)(sp - params) : strlen(params);
+            out.append(params, len);
+            params += sp != NULL ? len + 1 : len;
+        } else {
+            out.append(pattern, i, end - i);
+        }
+        if (end == pattern.size())
+            break;
+        i = end + 1;
+    }
+    return *params == 0 ? 0 : -1;
+}
+
+void sql_msg_text(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    msg_reader *mr = (msg_reader *)sqlite3_user_data(ctx);
+    if (argc == 3 && sqlite3_value_type(argv[0]) == SQLITE_NULL && sqlite3_value_type(argv[1]) != SQLITE_NULL) {
+        const std::string *p = mr->pattern(sqlite3_context_db_handle(ctx), sqlite3_value_int(argv[1]));
+        const char *params = (const char *)sqlite3_value_text(argv[2]);
+        if (p == NULL || render_template(*p, params != NULL ? params : "", mr->out) < 0) {
+            sqlite3_result_error(ctx, "msg_text: template not found", -1);
+            return;
+        }
+        sqlite3_result_text(ctx, mr->out.data(), mr->out.size(), SQLITE_TRANSIENT);
+        return;
+    }
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+#ifdef HAVE_ZSTD
+    zstd_decompressor *zd = &mr->zd;
+    const void *src = sqlite3_value_blob(argv[0]);
+    size_t srclen = sqlite3_value_bytes(argv[0]);
+    unsigned long long rawlen = ZSTD_getFrameContentSize(src, srclen);
+    if (rawlen == ZSTD_CONTENTSIZE_ERROR || rawlen == ZSTD_CONTENTSIZE_UNKNOWN || rawlen > 65536) {
+        sqlite3_result_error(ctx, "msg_text: not a zstd message", -1);
+        return;
+    }
+    ZSTD_DDict *dd = zd->get(sqlite3_context_db_handle(ctx), ZSTD_getDictID_fromFrame(src, srclen));
+    if (dd == NULL) {
+        sqlite3_result_error(ctx, "msg_text: dictionary not found", -1);
+        return;
+    }
+    zd->out.resize(rawlen);
+    size_t len = ZSTD_decompress_usingDDict(zd->dctx, &zd->out[0], rawlen, src, srclen, dd);
+    if (ZSTD_isError(len)) {
+        sqlite3_result_error(ctx, ZSTD_getErrorName(len), -1);
+        return;
+    }
+    sqlite3_result_text(ctx, zd->out.data(), len, SQLITE_TRANSIENT);
+#else
+    sqlite3_result_error(ctx, "msg_text: built without zstd support", -1);
+#endif
+}
+
+/*
+    * Register read side SQL functions on connection
+*/
+void register_sql_functions(sqlite3 *db) {
+    sqlite3_create_function(db, "host_ntop", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, sql_host_ntop, NULL, NULL);
+    sqlite3_create_function_v2(db, "msg_text", -1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, new msg_reader(),
+                               sql_msg_text, NULL, NULL, msg_reader_free);
+}
+
+/*
+    * Message text expression for log table, files written before template
+    * mining have no template columns
+*/
+const char *msg_expr(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "SELECT template, params FROM log LIMIT 0;", -1, &stmt, NULL) != SQLITE_OK)
+        return "msg_text(message)";
+    sqlite3_finalize(stmt);
+    return "msg_text(message, template, params)";
+}
+
+/*
+    * Message tokens for filters: runs of alphanumerics and "_-.",
+    * shorter than FILTER_MIN_TOKEN are not indexed
+*/
+#define FILTER_MIN_TOKEN 3
+
+static inline int token_char(unsigned char c) {
+    return isalnum(c) || c == '_' || c == '-' || c == '.';
+}
+
+template <typename F>
+void for_each_token(const char *p, size_t len, F cb) {
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && !token_char(p[i]))
+            i++;
+        size_t start = i;
+        while (i < len && token_char(p[i]))
+            i++;
+        if (i - start >= FILTER_MIN_TOKEN)
+            cb(p + start, i - start);
+    }
+}
+
+/*
+    * Check that token occurs in message as a whole token
+*/
+int msg_has_token(const std::string &msg, const char *token) {
+    size_t tlen = strlen(token);
+    size_t pos = 0;
+    while ((pos = msg.find(token, pos)) != std::string::npos) {
+        if ((pos == 0 || !token_char(msg[pos - 1])) &&
+            (pos + tlen == msg.size() || !token_char(msg[pos + tlen])))
+            return 1;
+        pos++;
+    }
+    return 0;
+}
+
+/*
+    * Tokens certainly present whole in any message containing needle:
+    * those bounded by non-token characters inside needle itself
+*/
+void grep_tokens(const char *needle, std::vector<std::string> &tokens) {
+    size_t len = strlen(needle);
+    for_each_token(needle, len, [&](const char *t, size_t tlen) {
+        if (t > needle && t + tlen < needle + len)
+            tokens.push_back(std::string(t, tlen));
+    });
+}
+
+/*
+    * Period file order: by start (hourly and sub-hour stamps mixed), then
+    * size rotation sequence
+*/
+bool dbfile_before(const std::string &a, const std::string &b) {
+    size_t la = dbfile_stamp(a.c_str(), NULL), lb = dbfile_stamp(b.c_str(), NULL);
+    std::string sa = a.substr(0, la) + std::string(12 - la, '0');
+    std::string sb = b.substr(0, lb) + std::string(12 - lb, '0');
+    if (sa != sb)
+        return sa < sb;
+    int qa = a[la] == '-' ? atoi(a.c_str() + la + 1) : 0;
+    int qb = b[lb] == '-' ? atoi(b.c_str() + lb + 1) : 0;
+    return qa < qb;
+}
+
+/*
+    * List period files in dbdir (any storage backend), sorted by time
+    * from/to are optional YYYYMMDDHH bounds, inclusive
+*/
+std::vector<std::string> list_dbfiles(const char *from, const char *to) {
+    std::vector<std::string> files;
+    DIR *dir = opendir(config.dbdir);
+    struct dirent *ent;
+    if (dir == NULL) {
+        perror("opendir");
+        return files;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        // file pattern is STAMP[-N].sqlite3 or STAMP[-N].seg
+        if (dbfile_stamp(ent->d_name, NULL) == 0)
+            continue;
+        if (!ends_with(ent->d_name, ".sqlite3") && !ends_with(ent->d_name, ".seg"))
+            continue;
+        if (from != NULL && strncmp(ent->d_name, from, 10) < 0)
+            continue;
+        if (to != NULL && strncmp(ent->d_name, to, 10) > 0)
+            continue;
+        files.push_back(ent->d_name);
+    }
+    closedir(dir);
+    std::sort(files.begin(), files.end(), dbfile_before);
+    return files;
+}
+
+void print_row(time_t ts, const char *host, const char *msg, int repeat, time_t last_ts) {
+    char tbuf[32];
+    strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", localtime(&ts));
+    printf("%s %s %s\n", tbuf, host, msg);
+    if (repeat > 1) {
+        strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", localtime(&last_ts));
+        printf("%*s last message repeated %d times, last at %s\n", 19, "", repeat, tbuf);
+    }
+}
+
+/*
+    * Cursor over matching rows of one file, shards of a period are merged
+    * by timestamp
+*/
+struct query_cursor {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    std::string path;
+    int rc;
+};
+
+// open file and step to first matching row, rc is SQLITE_DONE when there is none
+void query_open(query_cursor &c, const hostaddr *host) {
+    c.stmt = NULL;
+    c.rc = SQLITE_DONE;
+    if (sqlite3_open_v2(c.path.c_str(), &c.db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Can't open database %s: %s\n", c.path.c_str(), sqlite3_errmsg(c.db));
+        return;
+    }
+    register_sql_functions(c.db);
+
+    std::string msg = msg_expr(c.db);
+    std::string sql = "SELECT timestamp, coalesce(host_ntop(host), 'local[' || pid || ']'), " + msg + ", repeat, last_timestamp FROM log WHERE 1";
+    if (config.query_host != NULL)
+        sql += " AND (host = ?1 OR host = ?2)";
+    if (config.query_grep != NULL)
+        sql += " AND instr(" + msg + ", ?3) > 0";
+    if (config.query_token != NULL)
+        sql += " AND instr(" + msg + ", ?4) > 0";
+    sql += " ORDER BY id;";
+    if (sqlite3_prepare_v2(c.db, sql.c_str(), -1, &c.stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error in %s: %s\n", c.path.c_str(), sqlite3_errmsg(c.db));
+        return;
+    }
+    if (config.query_host != NULL) {
+        // match both binary rows and legacy text rows
+        sqlite3_bind_blob(c.stmt, 1, host->a, sizeof(host->a), SQLITE_STATIC);
+        sqlite3_bind_text(c.stmt, 2, config.query_host, -1, SQLITE_STATIC);
+    }
+    if (config.query_grep != NULL)
+        sqlite3_bind_text(c.stmt, 3, config.query_grep, -1, SQLITE_STATIC);
+    if (config.query_token != NULL)
+        sqlite3_bind_text(c.stmt, 4, config.query_token, -1, SQLITE_STATIC);
+    c.rc = sqlite3_step(c.stmt);
+}
+
+void query_sqlite(const std::vector<std::string> &paths, const hostaddr *host) {
+    std::vector<query_cursor> cur(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) {
+        cur[i].path = paths[i];
+        query_open(cur[i], host);
+    }
+    while (1) {
+        // oldest row of all shards, ties keep shard order
+        query_cursor *c = NULL;
+        for (size_t i = 0; i < cur.size(); i++)
+            if (cur[i].rc == SQLITE_ROW &&
+                (c == NULL || sqlite3_column_int64(cur[i].stmt, 0) < sqlite3_column_int64(c->stmt, 0)))
+                c = &cur[i];
+        if (c == NULL)
+            break;
+        if (config.query_token == NULL ||
+            msg_has_token(std::string((const char *)sqlite3_column_text(c->stmt, 2)), config.query_token))
+            print_row(sqlite3_column_int64(c->stmt, 0), (const char *)sqlite3_column_text(c->stmt, 1),
+                      (const char *)sqlite3_column_text(c->stmt, 2), sqlite3_column_int(c->stmt, 3),
+                      sqlite3_column_int64(c->stmt, 4));
+        c->rc = sqlite3_step(c->stmt);
+    }
+    for (size_t i = 0; i < cur.size(); i++) {
+        if (cur[i].stmt != NULL && cur[i].rc != SQLITE_DONE)
+            fprintf(stderr, "SQL error in %s: %s\n", cur[i].path.c_str(), sqlite3_errmsg(cur[i].db));
+        sqlite3_finalize(cur[i].stmt);
+        sqlite3_close(cur[i].db);
+    }
+}
+
+/*
+    * Split sorted file list into periods, shards of one period are grouped
+    * in shard order so their rows can be merged. Other files stand alone
+*/
+std::vector<std::vector<std::string> > dbfile_groups(const std::vector<std::string> &files) {
+    std::vector<std::vector<std::string> > groups;
+    for (size_t i = 0; i < files.size(); i++) {
+        int shard = ends_with(files[i], ".sqlite3") ? dbfile_shard(files[i]) : -1;
+        if (shard >= 0 && !groups.empty() && dbfile_shard(groups.back()[0]) >= 0 &&
+            ends_with(groups.back()[0], ".sqlite3") &&
+            !dbfile_before(groups.back()[0], files[i]) && !dbfile_before(files[i], groups.back()[0])) {
+            std::vector<std::string> &g = groups.back();
+            size_t at = g.size();
+            while (at > 0 && dbfile_shard(g[at - 1]) > shard)
+                at--;
+            g.insert(g.begin() + at, files[i]);
+            continue;
+        }
+        groups.push_back(std::vector<std::string>(1, files[i]));
+    }
+    return groups;
+}
+
+/*
+    * Volume query: print per-minute rollup rows instead of messages
+*/
+struct volume_row {
+    int64_t minute;
+    std::string key;
+    int severity;
+    std::string host;
+    int64_t count;
+    int64_t bytes;
+    bool operator<(const volume_row &o) const {
+        if (minute != o.minute)
+            return minute < o.minute;
+        if (key != o.key)
+            return key < o.key;
+        return severity < o.severity;
+    }
+};
+
+void query_volume(const std::vector<std::string> &paths, const hostaddr *host) {
+    std::string sql = "SELECT minute, CASE WHEN host = zeroblob(16) THEN 'local' ELSE host_ntop(host) END, severity, count, bytes, host FROM rollup";
+    if (config.query_host != NULL)
+        sql += " WHERE host = ?1";
+    sql += " ORDER BY minute, host, severity;";
+
+    // shards of one period hold disjoint hosts, rows are merged into one order
+    std::vector<volume_row> rows;
+    for (size_t i = 0; i < paths.size(); i++) {
+        const std::string &path = paths[i];
+        sqlite3 *db;
+        sqlite3_stmt *stmt;
+        if (sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+            fprintf(stderr, "Can't open database %s: %s\n", path.c_str(), sqlite3_errmsg(db));
+            sqlite3_close(db);
+            continue;
+        }
+        register_sql_functions(db);
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+            // hour files written before rollups existed
+            if (config.verbose)
+                fprintf(stderr, "No rollup in %s: %s\n", path.c_str(), sqlite3_errmsg(db));
+            sqlite3_close(db);
+            continue;
+        }
+        if (config.query_host != NULL)
+            sqlite3_bind_blob(stmt, 1, host->a, sizeof(host->a), SQLITE_STATIC);
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            volume_row r;
+            r.minute = sqlite3_column_int64(stmt, 0);
+            r.host = (const char *)sqlite3_column_text(stmt, 1);
+            r.severity = sqlite3_column_int(stmt, 2);
+            r.count = sqlite3_column_int64(stmt, 3);
+            r.bytes = sqlite3_column_int64(stmt, 4);
+            r.key.assign((const char *)sqlite3_column_blob(stmt, 5), sqlite3_column_bytes(stmt, 5));
+            rows.push_back(r);
+        }
+        if (rc != SQLITE_DONE)
+            fprintf(stderr, "SQL error in %s: %s\n", path.c_str(), sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        sqlite3_close(db);
+    }
+    if (paths.size() > 1)
+        std::sort(rows.begin(), rows.end());
+    for (size_t i = 0; i < rows.size(); i++) {
+        char tbuf[32];
+        time_t ts = rows[i].minute;
+        strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M", localtime(&ts));
+        printf("%s %s %d %lld %lld\n", tbuf, rows[i].host.c_str(), rows[i].severity,
+               (long long)rows[i].count, (long long)rows[i].bytes);
+    }
+}
+
+/*
+    * Pattern query: add message counts per template cluster of one file,
+    * cluster is reported with its latest (most general) template
+*/
+void query_patterns(const std::string &path, std::unordered_map<std::string, int64_t> &counts) {
+    const char *sql = "SELECT (SELECT pattern FROM templates WHERE cluster = t.cluster ORDER BY id DESC LIMIT 1), "
+                      "sum(coalesce(l.repeat, 1)) FROM log l JOIN templates t ON l.template = t.id GROUP BY t.cluster;";
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    if (sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Can't open database %s: %s\n", path.c_str(), sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        // hour files written without --templates
+        if (config.verbose)
+            fprintf(stderr, "No templates in %s: %s\n", path.c_str(), sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+        counts[(const char *)sqlite3_column_text(stmt, 0)] += sqlite3_column_int64(stmt, 1);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+}
+
+void query_segment(const std::string &path, const hostaddr *host) {
+    int sfd = open(path.c_str(), O_RDONLY);
+    if (sfd < 0) {
+        fprintf(stderr, "Can't open segment %s: %s\n", path.c_str(), strerror(errno));
+        return;
+    }
+    std::vector<logentry> rows;
+    segment_scan(sfd, [&](const seg_index &idx, const std::string &payload) {
+        if (segment_decode_block((const uint8_t *)payload.data(), payload.size(), idx.rows,
+                                 idx.min_ts, rows) < 0) {
+            fprintf(stderr, "Corrupted block at %llu in %s\n", (unsigned long long)idx.offset, path.c_str());
+            return;
+        }
+        for (size_t i = 0; i < rows.size(); i++) {
+            const logentry &e = rows[i];
+            if (config.query_host != NULL && (e.pid >= 0 || memcmp(&e.host, host, sizeof(*host)) != 0))
+                continue;
+            if (config.query_grep != NULL && e.msg.find(config.query_grep) == std::string::npos)
+                continue;
+            if (config.query_token != NULL && !msg_has_token(e.msg, config.query_token))
+                continue;
+            char hbuf[INET6_ADDRSTRLEN + 16];
+            if (e.pid >= 0)
+                snprintf(hbuf, sizeof(hbuf), "local[%d]", e.pid);
+            else
+                host_ntop(e.host.a, hbuf, sizeof(hbuf));
+            print_row(e.ts, hbuf, e.msg.c_str(), e.repeat, e.last_ts);
+        }
+    });
+    close(sfd);
+}
+
+/*
+    * Live tail subscriptions
+    *
+    * Receiver publishes accepted messages into broadcast ring of TAIL_RING
+    * slots (only while someone is subscribed). Tail thread serves clients on
+    * unix stream socket, each with own cursor into ring. A client that falls
+    * more than TAIL_RING behind loses position and is told how much was lost;
+    * neither receiver nor writer ever waits for a client.
+    *
+    * Protocol: client sends one line of space separated filters
+    *   host=ADDR severity=N (N or more severe) grep=SUBSTRING (rest of line)
+    * and then receives matching messages, one per line, as printed by -q.
+*/
+#define TAIL_RING 65536
+#define TAIL_MAX_CLIENTS 64
+#define TAIL_OUTBUF_MAX (1024 * 1024)
+
+struct tail_client {
+    int sock;
+    int subscribed;
+    std::string inbuf;
+    std::string outbuf;
+    int has_host;
+    hostaddr host;
+    int max_sev;
+    std::string grep;
+    uint64_t cursor;
+};
+
+struct {
+    logentry *slots;
+    uint64_t head;              // sequence of next published message
+    pthread_mutex_t lock;
+    volatile int subscribers;
+    volatile int waiting;       // tail thread sleeps, publisher wakes it via eventfd
+    int wakefd;
+    int listensock;
+} tail;
+
+void tail_publish(const logentry &entry) {
+    if (tail.subscribers == 0)
+        return;
+    pthread_mutex_lock(&tail.lock);
+    logentry &slot = tail.slots[tail.head % TAIL_RING];
+    // assign keeps string capacity of slot, no allocation in steady state
+    slot.ts = entry.ts;
+    slot.host = entry.host;
+    slot.pid = entry.pid;
+    slot.pri = entry.pri;
+    slot.repeat = entry.repeat;
+    slot.msg.assign(entry.msg);
+    tail.head++;
+    pthread_mutex_unlock(&tail.lock);
+    if (__sync_lock_test_and_set(&tail.waiting, 0)) {
+        uint64_t one = 1;
+        if (::write(tail.wakefd, &one, sizeof(one)) < 0) {
+            // counter overflow only, thread is awake anyway
+        }
+    }
+}
+
+static void tail_parse_filters(tail_client &c, const std::string &line) {
+    size_t pos = 0;
+    c.has_host = 0;
+    c.max_sev = NUM_SEVERITIES - 1;
+    while (pos < line.size()) {
+        size_t end = line.find(' ', pos);
+        if (end == std::string::npos)
+            end = line.size();
+        std::string kv = line.substr(pos, end - pos);
+        if (kv.compare(0, 5, "host=") == 0) {
+            c.has_host = host_pton(kv.c_str() + 5, &c.host) == 0;
+        } else if (kv.compare(0, 9, "severity=") == 0) {
+            c.max_sev = atoi(kv.c_str() + 9);
+        } else if (kv.compare(0, 5, "grep=") == 0) {
+            // substring may contain spaces, takes rest of line
+            c.grep = line.substr(pos + 5);
+            break;
+        }
+        pos = end + 1;
+    }
+}
+
+static int tail_match(const tail_client &c, const logentry &e) {
+    if ((e.pri & 7) > c.max_sev)
+        return 0;
+    if (c.has_host && (e.pid >= 0 || memcmp(&e.host, &c.host, sizeof(c.host)) != 0))
+        return 0;
+    if (!c.grep.empty() && e.msg.find(c.grep) == std::string::npos)
+        return 0;
+    return 1;
+}
+
+static void tail_format(const logentry &e, std::string &out) {
+    char tbuf[32], hbuf[INET6_ADDRSTRLEN + 16];
+    time_t ts = e.ts;
+    strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", localtime(&ts));
+    if (e.pid >= 0)
+        snprintf(hbuf, sizeof(hbuf), "local[%d]", e.pid);
+    else
+        host_ntop(e.host.a, hbuf, sizeof(hbuf));
+    size_t len = e.msg.size();
+    while (len > 0 && (e.msg[len - 1] == '\n' || e.msg[len - 1] == '\r'))
+        len--;
+    out.append(tbuf).append(" ").append(hbuf).append(" ").append(e.msg, 0, len).append("\n");
+}
+
+/*
+    * Copy matching messages from ring to client buffer, stop when buffer is full
+*/
+static void tail_fill(tail_client &c) {
+    logentry e;
+    while (c.outbuf.size() < TAIL_OUTBUF_MAX) {
+        pthread_mutex_lock(&tail.lock);
+        if (c.cursor == tail.head) {
+            pthread_mutex_unlock(&tail.lock);
+            break;
+        }
+        if (tail.head - c.cursor > TAIL_RING) {
+            uint64_t lost = tail.head - TAIL_RING - c.cursor;
+            c.cursor = tail.head - TAIL_RING;
+            pthread_mutex_unlock(&tail.lock);
+            char note[64];
+            snprintf(note, sizeof(note), "-- lost %llu messages --\n", (unsigned long long)lost);
+            c.outbuf.append(note);
+            continue;
+        }
+        e = tail.slots[c.cursor % TAIL_RING];
+        c.cursor++;
+        pthread_mutex_unlock(&tail.lock);
+        if (tail_match(c, e))
+            tail_format(e, c.outbuf);
+    }
+}
+
+void *tail_thread(void *arg) {
+    (void)arg;
+    numa_bind(-1);
+    std::vector<tail_client> clients;
+    std::vector<struct pollfd> pfds;
+    while (1) {
+        pfds.clear();
+        struct pollfd p;
+        p.fd = tail.listensock;
+        p.events = POLLIN;
+        pfds.push_back(p);
+        p.fd = tail.wakefd;
+        pfds.push_back(p);
+        int pending = 0;
+        for (size_t i = 0; i < clients.size(); i++) {
+            p.fd = clients[i].sock;
+            p.events = POLLIN | (clients[i].outbuf.empty() ? 0 : POLLOUT);
+            pfds.push_back(p);
+            if (clients[i].subscribed && clients[i].outbuf.size() < TAIL_OUTBUF_MAX)
+                pending |= clients[i].cursor != tail.head;
+        }
+        tail.waiting = 1;
+        if (poll(pfds.data(), pfds.size(), pending ? 0 : 1000) < 0 && errno != EINTR) {
+            perror("poll");
+            sleep(1);
+        }
+        tail.waiting = 0;
+        if (pfds[1].revents & POLLIN) {
+            uint64_t n;
+            if (read(tail.wakefd, &n, sizeof(n)) < 0) {
+                // nothing to do, spurious wakeup
+            }
+        }
+        if (pfds[0].revents & POLLIN) {
+            int sock = accept4(tail.listensock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (sock >= 0 && clients.size() >= TAIL_MAX_CLIENTS) {
+                ::close(sock);
+            } else if (sock >= 0) {
+                tail_client c;
+                c.sock = sock;
+                c.subscribed = 0;
+                clients.push_back(c);
+            }
+        }
+        for (size_t i = 0; i < clients.size(); i++) {
+            tail_client &c = clients[i];
+            short rev = pfds[i + 2].revents;
+            int closed = (rev & (POLLERR | POLLHUP)) != 0;
+            if (rev & POLLIN) {
+                char buf[1024];
+                ssize_t n = read(c.sock, buf, sizeof(buf));
+                if (n <= 0) {
+                    closed = 1;
+                } else if (!c.subscribed) {
+                    c.inbuf.append(buf, n);
+                    size_t nl = c.inbuf.find('\n');
+                    if (nl != std::string::npos) {
+                        tail_parse_filters(c, c.inbuf.substr(0, nl));
+                        c.inbuf.clear();
+                        pthread_mutex_lock(&tail.lock);
+                        c.cursor = tail.head;
+                        pthread_mutex_unlock(&tail.lock);
+                        c.subscribed = 1;
+                        __sync_fetch_and_add(&tail.subscribers, 1);
+                    } else if (c.inbuf.size() > 4096) {
+                        closed = 1;
+                    }
+                }
+            }
+            if (!closed && c.subscribed)
+                tail_fill(c);
+            if (!closed && !c.outbuf.empty()) {
+                ssize_t n = send(c.sock, c.outbuf.data(), c.outbuf.size(), MSG_NOSIGNAL);
+                if (n > 0)
+                    c.outbuf.erase(0, n);
+                else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                    closed = 1;
+            }
+            if (closed) {
+                if (c.subscribed)
+                    __sync_fetch_and_sub(&tail.subscribers, 1);
+                ::close(c.sock);
+                clients[i] = std::move(clients.back());
+                clients.pop_back();
+                // keep pollfd array aligned with clients
+                pfds[i + 2] = pfds[clients.size() + 2];
+                i--;
+            }
+        }
+    }
+    return NULL;
+}
+
+void tail_start(const char *path) {
+    struct sockaddr_un name;
+    pthread_t tid;
+
+    if (strlen(path) >= sizeof(name.sun_path)) {
+        fprintf(stderr, "Unix socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    tail.listensock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (tail.listensock < 0) {
+        perror("opening tail socket");
+        exit(EXIT_FAILURE);
+    }
+    memset(&name, 0, sizeof(name));
+    name.sun_family = AF_UNIX;
+    strcpy(name.sun_path, path);
+    unlink(path);
+    if (bind(tail.listensock, (struct sockaddr *)&name, sizeof(name)) < 0 || listen(tail.listensock, 16) < 0) {
+        perror("binding tail socket");
+        exit(EXIT_FAILURE);
+    }
+    tail.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (tail.wakefd < 0) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+    tail.slots = new logentry[TAIL_RING];
+    pthread_mutex_init(&tail.lock, NULL);
+    pthread_create(&tid, NULL, tail_thread, NULL);
+    if (config.verbose)
+        printf("Tail socket %s\n", path);
+}
+
+/*
+    * Parse syslog PRI ("<N>", N <= 191), return DEFAULT_PRI if absent
+*/
+static inline int parse_pri(const std::string &msg) {
+    int pri = 0;
+    size_t i;
+    if (msg.size() < 3 || msg[0] != '<')
+        return DEFAULT_PRI;
+    for (i = 1; i < 5 && i < msg.size() && msg[i] >= '0' && msg[i] <= '9'; i++)
+        pri = pri * 10 + (msg[i] - '0');
+    if (i == 1 || i >= msg.size() || msg[i] != '>' || pri > 191)
+        return DEFAULT_PRI;
+    return pri;
+}
+
+/*
+    * Relay to upstream collectors
+    *
+    * Every accepted message is copied to each upstream's bounded queue, the
+    * receiver never waits on network or disk (full queue drops). A sender
+    * thread per upstream ships batches: UDP with sendmmsg() on connected
+    * socket, TCP as pipelined octet-counted frames (RFC 6587 "LEN MSG").
+    * While upstream is down, queued messages are spilled to disk backlog
+    * (same framing) in forward backlog dir, replayed in order once it is
+    * back. Delivery is at least once, backlog survives restart.
+    *
+    * In hash mode each message goes to one upstream only, picked by source
+    * address on consistent-hash ring (RING_VNODES points per upstream), so
+    * every upstream gets stable subset of hosts. Upstreams listed in
+    * --forward-file are re-read on SIGHUP: only hosts of added or removed
+    * upstream move, removed upstream drains its queue and backlog first.
+*/
+#define RELAY_QUEUE_MAX 100000
+#define RELAY_BATCH 64
+#define RELAY_RETRY 5
+#define RELAY_BACKLOG_MAX (1024LL * 1024 * 1024)
+#define RELAY_CONNECT_TIMEOUT 2000
+#define RELAY_SEND_TIMEOUT 10 // seconds
+#define RING_VNODES 128
+
+struct upstream {
+    std::string spec;
+    // slot in use, cleared by sender when retired upstream is drained;
+    // both flags change under lock
+    volatile int active;
+    volatile int retired;
+    int tcp;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int sock;
+    time_t retry_at;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    std::deque<std::string> queue;
+
+    // backlog file, frames between read and write offsets are pending
+    std::string backlog_path;
+    int backlog_fd;
+    off_t backlog_read;
+    off_t backlog_write;
+
+    uint64_t sent;
+    uint64_t dropped;
+};
+
+struct {
+    upstream list[MAX_UPSTREAMS];
+    // slots used so far
+    int n;
+    // consistent-hash ring, (point, slot) sorted by point
+    std::vector<std::pair<uint64_t, int> > ring;
+} relay;
+
+volatile sig_atomic_t relay_reload_pending;
+
+/*
+    * Parse upstream spec udp://HOST:PORT or tcp://HOST:PORT ([V6ADDR]:PORT)
+    * Return 0 on success, -1 on error
+*/
+int upstream_parse(const char *spec, upstream *u) {
+    const char *p;
+    if (strncmp(spec, "udp://", 6) == 0)
+        u->tcp = 0;
+    else if (strncmp(spec, "tcp://", 6) == 0)
+        u->tcp = 1;
+    else
+        return -1;
+    p = spec + 6;
+    std::string host, port;
+    if (*p == '[') {
+        const char *end = strchr(p, ']');
+        if (end == NULL || end[1] != ':')
+            return -1;
+        host.assign(p + 1, end - p - 1);
+        port = end + 2;
+    } else {
+        const char *colon = strrchr(p, ':');
+        if (colon == NULL)
+            return -1;
+        host.assign(p, colon - p);
+        port = colon + 1;
+    }
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = u->tcp ? SOCK_STREAM : SOCK_DGRAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+        return -1;
+    memcpy(&u->addr, res->ai_addr, res->ai_addrlen);
+    u->addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+/*
+    * Connect socket to upstream, TCP connect is bounded by RELAY_CONNECT_TIMEOUT
+    * Return 0 on success, -1 on error
+*/
+int upstream_connect(upstream *u) {
+    int sock = socket(u->addr.ss_family, u->tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (sock < 0)
+        return -1;
+    if (u->tcp) {
+        int flags = fcntl(sock, F_GETFL);
+        fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+        if (connect(sock, (struct sockaddr *)&u->addr, u->addrlen) < 0 && errno != EINPROGRESS) {
+            close(sock);
+            return -1;
+        }
+        struct pollfd pfd = {sock, POLLOUT, 0};
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        if (poll(&pfd, 1, RELAY_CONNECT_TIMEOUT) != 1 ||
+            getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0 || err != 0) {
+            close(sock);
+            return -1;
+        }
+        fcntl(sock, F_SETFL, flags);
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        // stalled peer fails send() instead of blocking sender forever
+        struct timeval tv = { RELAY_SEND_TIMEOUT, 0 };
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    } else if (connect(sock, (struct sockaddr *)&u->addr, u->addrlen) < 0) {
+        close(sock);
+        return -1;
+    }
+    u->sock = sock;
+    if (config.verbose)
+        printf("Connected to upstream %s\n", u->spec.c_str());
+    return 0;
+}
+
+void upstream_down(upstream *u) {
+    if (u->sock >= 0) {
+        close(u->sock);
+        u->sock = -1;
+        fprintf(stderr, "Upstream %s is down, spilling to backlog\n", u->spec.c_str());
+    }
+    u->retry_at = time(NULL) + RELAY_RETRY;
+}
+
+/*
+    * Send frames to upstream, each element is one message
+    * Return 0 on success, -1 if upstream failed (nothing is considered sent)
+*/
+int upstream_send(upstream *u, const std::vector<std::string> &msgs) {
+    if (!u->tcp) {
+        struct mmsghdr mm[RELAY_BATCH];
+        struct iovec iov[RELAY_BATCH];
+        size_t done = 0;
+        while (done < msgs.size()) {
+            size_t n = std::min(msgs.size() - done, (size_t)RELAY_BATCH);
+            for (size_t i = 0; i < n; i++) {
+                iov[i].iov_base = (void *)msgs[done + i].data();
+                iov[i].iov_len = msgs[done + i].size();
+                memset(&mm[i], 0, sizeof(mm[i]));
+                mm[i].msg_hdr.msg_iov = &iov[i];
+                mm[i].msg_hdr.msg_iovlen = 1;
+            }
+            int rc = sendmmsg(u->sock, mm, n, 0);
+            // ECONNREFUSED: ICMP unreachable reported on connected socket
+            if (rc < 0 && errno == EINTR)
+                continue;
+            if (rc < 0)
+                return -1;
+            done += rc;
+        }
+        return 0;
+    }
+    std::string buf;
+    for (size_t i = 0; i < msgs.size(); i++) {
+        buf += std::to_string(msgs[i].size());
+        buf += ' ';
+        buf += msgs[i];
+    }
+    size_t off = 0;
+    while (off < buf.size()) {
+        ssize_t rc = send(u->sock, buf.data() + off, buf.size() - off, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        off += rc;
+    }
+    return 0;
+}
+
+/*
+    * Append messages to backlog file as octet-counted frames
+*/
+void backlog_append(upstream *u, const std::vector<std::string> &msgs) {
+    std::string buf;
+    for (size_t i = 0; i < msgs.size(); i++) {
+        buf += std::to_string(msgs[i].size());
+        buf += ' ';
+        buf += msgs[i];
+    }
+    if (u->backlog_write + (off_t)buf.size() > RELAY_BACKLOG_MAX) {
+        u->dropped += msgs.size();
+        return;
+    }
+    ssize_t rc = pwrite(u->backlog_fd, buf.data(), buf.size(), u->backlog_write);
+    if (rc != (ssize_t)buf.size()) {
+        perror("backlog write");
+        u->dropped += msgs.size();
+        return;
+    }
+    u->backlog_write += rc;
+}
+
+/*
+    * Parse frame "LEN MSG" at pos, empty message ("0 ") is valid
+    * Return 1 if whole frame is in buf, 0 if it is cut off by end of buf,
+    * -1 if header is invalid
+*/
+static int backlog_frame(const char *buf, off_t len, off_t pos, off_t *start, long *n) {
+    off_t i = pos;
+    while (i < len && i - pos < 6 && isdigit((unsigned char)buf[i]))
+        i++;
+    if (i == len)
+        return 0;
+    if (i == pos || buf[i] != ' ')
+        return -1;
+    *n = strtol(buf + pos, NULL, 10);
+    if (*n > 65536)
+        return -1;
+    *start = i + 1;
+    return *start + *n <= len ? 1 : 0;
+}
+
+/*
+    * Read up to RELAY_BATCH whole frames from backlog at read offset. Bytes
+    * that do not parse are skipped up to next frame that does (followed by
+    * another frame or end of data), cut off frame at end of file (interrupted
+    * write) is skipped too
+    * Return bytes the frames and skipped bytes take in file, 0 if empty
+*/
+off_t backlog_read(upstream *u, std::vector<std::string> &msgs) {
+    char buf[65536 + 16];
+    ssize_t len = pread(u->backlog_fd, buf, sizeof(buf), u->backlog_read);
+    if (len <= 0)
+        return 0;
+    int at_end = u->backlog_read + len >= u->backlog_write;
+    off_t pos = 0, skipped = 0;
+    while (msgs.size() < RELAY_BATCH && pos < len) {
+        off_t start, next;
+        long n, nn;
+        int rc = backlog_frame(buf, len, pos, &start, &n);
+        // after corruption, frame is trusted only if next one parses as well
+        if (rc > 0 && skipped > 0 && start + n < len &&
+            backlog_frame(buf, len, start + n, &next, &nn) < 0) {
+            rc = -1;
+        } else if (rc > 0) {
+            msgs.push_back(std::string(buf + start, n));
+            pos = start + n;
+            continue;
+        }
+        if (rc == 0 && !at_end)
+            break;
+        // torn last frame, unless length is garbage met while resyncing
+        if (rc == 0 && skipped == 0) {
+            skipped += len - pos;
+            pos = len;
+            break;
+        }
+        pos++;
+        skipped++;
+    }
+    if (skipped > 0)
+        fprintf(stderr, "Skipped %lld corrupted bytes of backlog %s\n", (long long)skipped, u->backlog_path.c_str());
+    return pos;
+}
+
+void *upstream_thread(void *arg) {
+    upstream *u = (upstream *)arg;
+    // started by receiver on reload, not where receiver happens to run
+    numa_bind(-1);
+    std::vector<std::string> batch;
+    while (1) {
+        // handoff: queued messages go to backlog, new process sends them
+        if (handoff.draining) {
+            pthread_mutex_lock(&u->lock);
+            batch.assign(std::make_move_iterator(u->queue.begin()), std::make_move_iterator(u->queue.end()));
+            u->queue.clear();
+            pthread_mutex_unlock(&u->lock);
+            if (!batch.empty())
+                backlog_append(u, batch);
+            // drop part already sent, new process reads backlog from start
+            if (u->backlog_read > 0) {
+                std::string rest(u->backlog_write - u->backlog_read, 0);
+                if (pread(u->backlog_fd, &rest[0], rest.size(), u->backlog_read) == (ssize_t)rest.size() &&
+                    pwrite(u->backlog_fd, rest.data(), rest.size(), 0) == (ssize_t)rest.size() &&
+                    ftruncate(u->backlog_fd, rest.size()) == 0)
+                    u->backlog_read = 0;
+                else
+                    perror("backlog compact");
+            }
+            if (u->sock >= 0)
+                close(u->sock);
+            close(u->backlog_fd);
+            pthread_mutex_lock(&u->lock);
+            u->active = 0;
+            pthread_mutex_unlock(&u->lock);
+            return NULL;
+        }
+        // checked and left under lock, relay_configure() may take upstream back
+        pthread_mutex_lock(&u->lock);
+        if (u->retired && u->queue.empty() && u->backlog_read == u->backlog_write) {
+            if (config.verbose)
+                printf("Upstream %s retired\n", u->spec.c_str());
+            if (u->sock >= 0)
+                close(u->sock);
+            close(u->backlog_fd);
+            unlink(u->backlog_path.c_str());
+            u->active = 0;
+            pthread_mutex_unlock(&u->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&u->lock);
+        if (u->sock < 0 && time(NULL) >= u->retry_at && upstream_connect(u) < 0)
+            upstream_down(u);
+
+        batch.clear();
+        pthread_mutex_lock(&u->lock);
+        if (u->queue.empty() && (u->sock < 0 || u->backlog_read == u->backlog_write)) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            pthread_cond_timedwait(&u->cond, &u->lock, &ts);
+        }
+        while (!u->queue.empty() && batch.size() < RELAY_BATCH) {
+            batch.push_back(std::move(u->queue.front()));
+            u->queue.pop_front();
+        }
+        pthread_mutex_unlock(&u->lock);
+
+        // keep order: while backlog is pending, new messages go behind it
+        if (u->sock < 0 || u->backlog_read < u->backlog_write) {
+            if (!batch.empty())
+                backlog_append(u, batch);
+            if (u->sock < 0)
+                continue;
+            batch.clear();
+            off_t len = backlog_read(u, batch);
+            if (batch.empty()) {
+                // only corrupted bytes were read
+                u->backlog_read += len;
+                continue;
+            }
+            if (upstream_send(u, batch) < 0) {
+                upstream_down(u);
+                continue;
+            }
+            u->sent += batch.size();
+            u->backlog_read += len;
+            if (u->backlog_read == u->backlog_write) {
+                if (ftruncate(u->backlog_fd, 0) < 0)
+                    perror("backlog truncate");
+                u->backlog_read = u->backlog_write = 0;
+            }
+            continue;
+        }
+        if (batch.empty())
+            continue;
+        if (upstream_send(u, batch) < 0) {
+            upstream_down(u);
+            backlog_append(u, batch);
+            continue;
+        }
+        u->sent += batch.size();
+    }
+}
+
+/*
+    * Take free slot for upstream and start its sender
+    * Return 0 on success, -1 on error
+*/
+int upstream_add(const std::string &spec) {
+    int slot;
+    for (slot = 0; slot < MAX_UPSTREAMS; slot++)
+        if (!relay.list[slot].active)
+            break;
+    if (slot == MAX_UPSTREAMS) {
+        fprintf(stderr, "Too many upstreams (max %d)\n", MAX_UPSTREAMS);
+        return -1;
+    }
+    upstream *u = &relay.list[slot];
+    if (upstream_parse(spec.c_str(), u) < 0) {
+        fprintf(stderr, "Invalid upstream %s\n", spec.c_str());
+        return -1;
+    }
+    u->spec = spec;
+    u->retired = 0;
+    u->sock = -1;
+    u->retry_at = 0;
+    u->sent = u->dropped = 0;
+    u->queue.clear();
+    pthread_mutex_init(&u->lock, NULL);
+    pthread_cond_init(&u->cond, NULL);
+    // backlog is named after upstream, so it follows it across reconfiguration
+    std::string name = spec;
+    for (size_t i = 0; i < name.size(); i++)
+        if (!isalnum((unsigned char)name[i]) && name[i] != '.' && name[i] != '-')
+            name[i] = '_';
+    u->backlog_path = std::string(config.forward_backlog) + "/relay-" + name + ".backlog";
+    u->backlog_fd = open(u->backlog_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (u->backlog_fd < 0) {
+        perror("open backlog");
+        return -1;
+    }
+    // leftover backlog from previous run is replayed first
+    u->backlog_read = 0;
+    u->backlog_write = lseek(u->backlog_fd, 0, SEEK_END);
+    if (u->backlog_write > 0)
+        printf("Upstream %s has %lld bytes backlog\n", spec.c_str(), (long long)u->backlog_write);
+    u->active = 1;
+    if (slot >= relay.n)
+        relay.n = slot + 1;
+    // sender must not take SIGHUP, it is for receiver thread
+    sigset_t hup, old;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, &old);
+    pthread_t tid;
+    pthread_create(&tid, NULL, upstream_thread, u);
+    pthread_detach(tid);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (config.verbose)
+        printf("Upstream %s added\n", spec.c_str());
+    return 0;
+}
+
+static inline uint64_t ring_hash(const void *p, size_t len) {
+    // FNV-1a 64 with final avalanche, points of one upstream spread evenly
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ ((const uint8_t *)p)[i]) * 1099511628211ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+void ring_build() {
+    relay.ring.clear();
+    for (int i = 0; i < relay.n; i++) {
+        upstream *u = &relay.list[i];
+        if (!u->active || u->retired)
+            continue;
+        for (int v = 0; v < RING_VNODES; v++) {
+            std::string point = u->spec + "#" + std::to_string(v);
+            relay.ring.push_back(std::make_pair(ring_hash(point.data(), point.size()), i));
+        }
+    }
+    std::sort(relay.ring.begin(), relay.ring.end());
+}
+
+/*
+    * Upstream specs from --forward and --forward-file
+*/
+std::vector<std::string> relay_specs() {
+    std::vector<std::string> specs(config.forward, config.forward + config.nforward);
+    if (config.forward_file == NULL)
+        return specs;
+    FILE *f = fopen(config.forward_file, "r");
+    if (f == NULL) {
+        perror("fopen forward file");
+        return specs;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\r\n")] = 0;
+        char *p = line + strspn(line, " \t");
+        if (*p == 0 || *p == '#')
+            continue;
+        p[strcspn(p, " \t")] = 0;
+        if (std::find(specs.begin(), specs.end(), p) == specs.end())
+            specs.push_back(p);
+    }
+    fclose(f);
+    return specs;
+}
+
+/*
+    * Bring upstreams in line with configuration, runs in receiver thread
+    * (which alone reads the ring). Return number of active upstreams
+*/
+int relay_configure() {
+    std::vector<std::string> specs = relay_specs();
+    for (int i = 0; i < relay.n; i++) {
+        upstream *u = &relay.list[i];
+        if (!u->active)
+            continue;
+        auto it = std::find(specs.begin(), specs.end(), u->spec);
+        pthread_mutex_lock(&u->lock);
+        if (!u->active) {
+            // sender just finished draining, spec (if kept) is added again
+        } else if (it != specs.end()) {
+            // kept, or added back while still draining
+            u->retired = 0;
+            specs.erase(it);
+        } else if (!u->retired) {
+            if (config.verbose)
+                printf("Upstream %s removed, draining\n", u->spec.c_str());
+            u->retired = 1;
+            pthread_cond_signal(&u->cond);
+        }
+        pthread_mutex_unlock(&u->lock);
+    }
+    for (size_t i = 0; i < specs.size(); i++)
+        upstream_add(specs[i]);
+    ring_build();
+    return relay.ring.size() / RING_VNODES;
+}
+
+void relay_reload_signal(int sig) {
+    (void)sig;
+    relay_reload_pending = 1;
+}
+
+void relay_start() {
+    if (config.forward_backlog == NULL)
+        config.forward_backlog = config.dbdir;
+    if (relay_configure() == 0) {
+        fprintf(stderr, "No valid upstreams\n");
+        exit(EXIT_FAILURE);
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = relay_reload_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &sa, NULL);
+}
+
+/*
+    * Copy message to upstream queues (one by ring in hash mode), called from receiver
+*/
+static void upstream_push(upstream *u, const std::string &msg) {
+    pthread_mutex_lock(&u->lock);
+    if (u->queue.size() < RELAY_QUEUE_MAX) {
+        u->queue.push_back(msg);
+        pthread_cond_signal(&u->cond);
+    } else {
+        u->dropped++;
+    }
+    pthread_mutex_unlock(&u->lock);
+}
+
+void relay_push(const logentry &entry) {
+    if (relay.ring.empty())
+        return;
+    if (config.forward_hash) {
+        uint64_t h = ring_hash(entry.host.a, sizeof(entry.host.a));
+        auto it = std::lower_bound(relay.ring.begin(), relay.ring.end(), std::make_pair(h, 0));
+        // next point clockwise whose upstream is still running
+        for (size_t n = 0; n < relay.ring.size(); n++, it++) {
+            if (it == relay.ring.end())
+                it = relay.ring.begin();
+            upstream *u = &relay.list[it->second];
+            if (u->active && !u->retired) {
+                upstream_push(u, entry.msg);
+                return;
+            }
+        }
+        return;
+    }
+    for (int i = 0; i < relay.n; i++) {
+        upstream *u = &relay.list[i];
+        if (u->active && !u->retired)
+            upstream_push(u, entry.msg);
+    }
+}
+
+/*
+    * Routing rules, one per line of --rules file ("#" starts comment):
+    *   drop PATTERN          discard message
+    *   tag NAME PATTERN      add NAME to tags column
+    *   route STORE PATTERN   write message to named store
+    * PATTERN is literal substring (rest of line). All patterns are compiled
+    * into one Aho-Corasick DFA over byte classes, so message is scanned once
+    * whatever the number of rules. Every matching rule applies, first
+    * matching route wins.
+*/
+enum {
+    RULE_DROP,
+    RULE_TAG,
+    RULE_ROUTE,
+};
+
+struct rule {
+    int action;
+    int line;
+    std::string arg;
+    int store;
+    std::string pattern;
+    uint64_t matches;
+};
+
+struct {
+    std::vector<rule> list;
+    // byte -> class, class 0 is for bytes not used by any pattern
+    uint8_t cls[256];
+    int nclasses;
+    // state * nclasses + class -> next state
+    std::vector<int32_t> delta;
+    // rules matched when entering state (fail chain merged in)
+    std::vector<std::vector<int> > out;
+    std::vector<unsigned> seen;
+    unsigned generation;
+    std::vector<int> matched;
+    uint64_t dropped_total;
+} rules;
+
+void rules_compile() {
+    memset(rules.cls, 0, sizeof(rules.cls));
+    rules.nclasses = 1;
+    for (size_t r = 0; r < rules.list.size(); r++) {
+        const std::string &p = rules.list[r].pattern;
+        for (size_t i = 0; i < p.size(); i++) {
+            uint8_t b = p[i];
+            if (rules.cls[b] == 0) {
+                if (rules.nclasses == 256) {
+                    fprintf(stderr, "Too many distinct bytes in rule patterns\n");
+                    exit(EXIT_FAILURE);
+                }
+                rules.cls[b] = rules.nclasses++;
+            }
+        }
+    }
+    int n = rules.nclasses;
+
+    // trie
+    rules.delta.assign(n, -1);
+    rules.out.assign(1, std::vector<int>());
+    for (size_t r = 0; r < rules.list.size(); r++) {
+        const std::string &p = rules.list[r].pattern;
+        int s = 0;
+        for (size_t i = 0; i < p.size(); i++) {
+            int c = rules.cls[(uint8_t)p[i]];
+            if (rules.delta[s * n + c] < 0) {
+                rules.delta[s * n + c] = rules.out.size();
+                rules.delta.resize(rules.delta.size() + n, -1);
+                rules.out.push_back(std::vector<int>());
+            }
+            s = rules.delta[s * n + c];
+        }
+        rules.out[s].push_back(r);
+    }
+
+    // failure links folded into transitions, breadth first
+    std::vector<int> fail(rules.out.size(), 0);
+    std::deque<int> bfs;
+    for (int c = 0; c < n; c++) {
+        int t = rules.delta[c];
+        if (t < 0) {
+            rules.delta[c] = 0;
+        } else {
+            fail[t] = 0;
+            bfs.push_back(t);
+        }
+    }
+    while (!bfs.empty()) {
+        int s = bfs.front();
+        bfs.pop_front();
+        for (int c = 0; c < n; c++) {
+            int t = rules.delta[s * n + c];
+            if (t < 0) {
+                rules.delta[s * n + c] = rules.delta[fail[s] * n + c];
+            } else {
+                fail[t] = rules.delta[fail[s] * n + c];
+                const std::vector<int> &fo = rules.out[fail[t]];
+                rules.out[t].insert(rules.out[t].end(), fo.begin(), fo.end());
+                bfs.push_back(t);
+            }
+        }
+    }
+    rules.seen.assign(rules.list.size(), 0);
+    rules.generation = 0;
+}
+
+/*
+    * Load and compile rules file, errors are fatal
+*/
+void rules_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror("fopen rules file");
+        exit(EXIT_FAILURE);
+    }
+    char line[4096];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        line[strcspn(line, "\r\n")] = 0;
+        char *p = line + strspn(line, " \t");
+        if (*p == 0 || *p == '#')
+            continue;
+        rule r;
+        r.line = lineno;
+        r.matches = 0;
+        char *word = p;
+        p += strcspn(p, " \t");
+        if (*p != 0)
+            *p++ = 0;
+        if (strcmp(word, "drop") == 0) {
+            r.action = RULE_DROP;
+        } else if (strcmp(word, "tag") == 0 || strcmp(word, "route") == 0) {
+            r.action = strcmp(word, "tag") == 0 ? RULE_TAG : RULE_ROUTE;
+            p += strspn(p, " \t");
+            char *arg = p;
+            p += strcspn(p, " \t");
+            if (*p != 0)
+                *p++ = 0;
+            r.arg = arg;
+        } else {
+            fprintf(stderr, "%s:%d: unknown action %s\n", path, lineno, word);
+            exit(EXIT_FAILURE);
+        }
+        p += strspn(p, " \t");
+        r.pattern = p;
+        if (r.pattern.empty() || (r.action != RULE_DROP && r.arg.empty())) {
+            fprintf(stderr, "%s:%d: missing %s\n", path, lineno, r.arg.empty() && r.action != RULE_DROP ? "name" : "pattern");
+            exit(EXIT_FAILURE);
+        }
+        r.store = 0;
+        if (r.action == RULE_ROUTE) {
+            r.store = store_find(r.arg.c_str());
+            if (r.store < 0) {
+                fprintf(stderr, "%s:%d: unknown store %s\n", path, lineno, r.arg.c_str());
+                exit(EXIT_FAILURE);
+            }
+        }
+        rules.list.push_back(r);
+    }
+    fclose(f);
+    rules_compile();
+    if (config.verbose)
+        printf("Loaded %zu rules, %zu automaton states\n", rules.list.size(), rules.out.size());
+}
+
+/*
+    * Apply rules to message, return 1 if it has to be dropped
+*/
+int rules_apply(logentry &entry) {
+    if (++rules.generation == 0) {
+        std::fill(rules.seen.begin(), rules.seen.end(), 0);
+        rules.generation = 1;
+    }
+    rules.matched.clear();
+    const int n = rules.nclasses;
+    const int32_t *delta = rules.delta.data();
+    int s = 0;
+    for (size_t i = 0; i < entry.msg.size(); i++) {
+        s = delta[s * n + rules.cls[(uint8_t)entry.msg[i]]];
+        const std::vector<int> &out = rules.out[s];
+        for (size_t j = 0; j < out.size(); j++) {
+            if (rules.seen[out[j]] != rules.generation) {
+                rules.seen[out[j]] = rules.generation;
+                rules.matched.push_back(out[j]);
+            }
+        }
+    }
+    if (rules.matched.empty())
+        return 0;
+    std::sort(rules.matched.begin(), rules.matched.end());
+    int drop = 0, routed = 0;
+    for (size_t i = 0; i < rules.matched.size(); i++) {
+        rule &r = rules.list[rules.matched[i]];
+        r.matches++;
+        if (r.action == RULE_DROP) {
+            drop = 1;
+        } else if (r.action == RULE_TAG) {
+            if (("," + entry.tags + ",").find("," + r.arg + ",") != std::string::npos)
+                continue;
+            if (!entry.tags.empty())
+                entry.tags += ',';
+            entry.tags += r.arg;
+        } else if (!routed) {
+            entry.store = r.store;
+            routed = 1;
+        }
+    }
+    if (drop)
+        rules.dropped_total++;
+    return drop;
+}
+
+/*
+    * Add received message to its severity lane
+    * When queue is full, newest message of lowest queued severity is shed to
+    * make room, or the incoming one if nothing less important is queued
+*/
+void enqueue(logentry &entry) {
+    // upgrade in progress, stored once previous process has drained
+    if (handoff.peer >= 0) {
+        if (handoff.pending.size() < QUEUE_MAX)
+            handoff.pending.push_back(std::move(entry));
+        else
+            handoff.dropped++;
+        return;
+    }
+    if (!rules.list.empty() && rules_apply(entry))
+        return;
+    // per-host order is kept by sending each host to one shard
+    if (stores.list[entry.store].nshards > 1)
+        entry.store += ring_hash(entry.host.a, sizeof(entry.host.a)) % stores.list[entry.store].nshards;
+    entry.pri = parse_pri(entry.msg);
+    int sev = entry.pri & 7;
+    tail_publish(entry);
+    if (relay.n > 0)
+        relay_push(entry);
+    logstore &ls = stores.list[entry.store];
+    msg_queue &queue = ls.queue;
+    // record is encoded outside of lock, appended in queue order
+    std::string rec;
+    if (config.journal)
+        journal_encode(entry, rec);
+    pthread_mutex_lock(&queue.lock);
+    if (ls.replaying && ls.held.size() >= QUEUE_MAX) {
+        queue.dropped[sev]++;
+        pthread_mutex_unlock(&queue.lock);
+        return;
+    }
+    if (queue.size >= QUEUE_MAX) {
+        int victim = NUM_SEVERITIES - 1;
+        while (victim > sev && queue.lanes[victim].empty())
+            victim--;
+        queue.dropped[victim]++;
+        if (victim == sev) {
+            pthread_mutex_unlock(&queue.lock);
+            if (config.verbose)
+                printf("Queue is too big, dropping message\n");
+            return;
+        }
+        queue.lanes[victim].pop_back();
+        queue.size--;
+    }
+    if (config.journal) {
+        entry.jofs = ls.jend;
+        ls.jpending += rec;
+        ls.jend += rec.size();
+    }
+    if (ls.replaying) {
+        ls.held.push_back(std::move(entry));
+    } else {
+        queue.lanes[sev].push_back(std::move(entry));
+        queue.size++;
+    }
+    pthread_mutex_unlock(&queue.lock);
+}
+
+/*
+    * Per-sender token bucket rate limiter
+    * Fixed size open addressing table (linear probing, bounded probe window),
+    * allocated once at startup, so lookup is O(1) and allocation-free per packet.
+    * When probe window is full, least recently seen sender in it is evicted.
+*/
+#define RL_PROBE 8
+#define RL_SUMMARY_INTERVAL 10
+
+struct rl_bucket {
+    hostaddr host;
+    uint8_t used;
+    double tokens;
+    double last;        // monotonic seconds of last refill
+    uint32_t dropped;   // over-limit messages not yet summarized
+};
+
+struct {
+    rl_bucket *table;
+    uint32_t mask;
+    uint64_t dropped_total;
+    time_t last_sweep;
+} ratelimit;
+
+static inline uint32_t host_hash(const hostaddr *host) {
+    uint64_t a, b;
+    memcpy(&a, host->a, 8);
+    memcpy(&b, host->a + 8, 8);
+    uint64_t h = (a ^ (b * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+    return (uint32_t)(h >> 32);
+}
+
+void ratelimit_init() {
+    uint32_t size = 1;
+    // round table size up to power of two
+    while (size < (uint32_t)config.ratelimit_table)
+        size <<= 1;
+    ratelimit.table = (rl_bucket *)calloc(size, sizeof(rl_bucket));
+    if (ratelimit.table == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    ratelimit.mask = size - 1;
+    ratelimit.last_sweep = time(NULL);
+    if (config.verbose)
+        printf("ratelimit: %.1f msg/s, burst %.0f, table %u\n", config.ratelimit_rate,
+               config.ratelimit_burst, size);
+}
+
+/*
+    * Store one summary row for suppressed messages of sender
+*/
+void ratelimit_summary(rl_bucket *b) {
+    char msg[128];
+    logentry entry;
+    snprintf(msg, sizeof(msg), "logcollectd: %u messages suppressed by rate limit", b->dropped);
+    entry.ts = time(NULL);
+    entry.host = b->host;
+    entry.pid = -1;
+    entry.uid = -1;
+    entry.msg = msg;
+    b->dropped = 0;
+    enqueue(entry);
+}
+
+/*
+    * Check if message from host is within its rate
+    * Return 1 if message is accepted, 0 if it should be dropped
+*/
+int ratelimit_check(const hostaddr *host) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double now = ts.tv_sec + ts.tv_nsec / 1e9;
+    uint32_t idx = host_hash(host) & ratelimit.mask;
+    rl_bucket *b = NULL, *oldest = NULL;
+
+    for (int i = 0; i < RL_PROBE; i++) {
+        rl_bucket *cur = &ratelimit.table[(idx + i) & ratelimit.mask];
+        if (!cur->used) {
+            b = cur;
+            break;
+        }
+        if (memcmp(&cur->host, host, sizeof(*host)) == 0) {
+            b = cur;
+            break;
+        }
+        if (oldest == NULL || cur->last < oldest->last)
+            oldest = cur;
+    }
+    if (b == NULL) {
+        // window full, evict least recently seen sender
+        b = oldest;
+        if (b->dropped)
+            ratelimit_summary(b);
+        b->used = 0;
+    }
+    if (!b->used) {
+        b->used = 1;
+        b->host = *host;
+        b->tokens = config.ratelimit_burst;
+        b->last = now;
+        b->dropped = 0;
+    }
+
+    b->tokens += (now - b->last) * config.ratelimit_rate;
+    if (b->tokens > config.ratelimit_burst)
+        b->tokens = config.ratelimit_burst;
+    b->last = now;
+    if (b->tokens < 1.0) {
+        b->dropped++;
+        ratelimit.dropped_total++;
+        return 0;
+    }
+    b->tokens -= 1.0;
+    // sender is back within limit, report what was suppressed before
+    if (b->dropped)
+        ratelimit_summary(b);
+    return 1;
+}
+
+/*
+    * Periodically summarize suppressed messages of senders that stay over limit
+*/
+void ratelimit_sweep() {
+    time_t now = time(NULL);
+    if (now - ratelimit.last_sweep < RL_SUMMARY_INTERVAL)
+        return;
+    ratelimit.last_sweep = now;
+    for (uint32_t i = 0; i <= ratelimit.mask; i++) {
+        if (ratelimit.table[i].used && ratelimit.table[i].dropped)
+            ratelimit_summary(&ratelimit.table[i]);
+    }
+}
+
+/*
+    * Duplicate collapse
+    * Per-host window of DEDUP_WINDOW pending runs, keyed by hash of
+    * (host, message without syslog timestamp). A run is held until it is not
+    * repeated for dedup_delay seconds (or DEDUP_MAX_AGE passed), evicted from
+    * the window by a new message, or its host slot is reused, then stored as
+    * one row with repeat count and first/last timestamps.
+*/
+#define DEDUP_HOSTS 4096
+#define DEDUP_MAX_WINDOW 16
+#define DEDUP_MAX_AGE 30
+
+struct dedup_run {
+    uint64_t hash;
+    logentry entry;
+};
+
+struct dedup_slot {
+    hostaddr host;
+    int used;
+    int nruns;
+    dedup_run runs[DEDUP_MAX_WINDOW];
+};
+
+struct {
+    dedup_slot *table;
+    int pending;
+    time_t last_sweep;
+    uint64_t folded_total;
+} dedup;
+
+void dedup_init() {
+    dedup.table = new dedup_slot[DEDUP_HOSTS]();
+    dedup.last_sweep = time(NULL);
+    if (config.verbose)
+        printf("dedup: window %d, delay %ds\n", config.dedup_window, config.dedup_delay);
+}
+
+/*
+    * Return offset of message part after syslog header timestamp
+    * RFC3164: "<PRI>Mmm dd hh:mm:ss ...", RFC5424: "<PRI>1 TIMESTAMP ..."
+    * pri_len is set to length of "<PRI>" (kept in hash, severity matters)
+*/
+size_t msg_skip_timestamp(const std::string &msg, size_t *pri_len) {
+    size_t pos = 0;
+    *pri_len = 0;
+    if (msg.size() > 2 && msg[0] == '<') {
+        size_t end = msg.find('>', 1);
+        if (end != std::string::npos && end <= 4)
+            pos = end + 1;
+    }
+    *pri_len = pos;
+    // RFC5424: version digit, space, timestamp token
+    if (pos + 2 < msg.size() && msg[pos] >= '1' && msg[pos] <= '9' && msg[pos + 1] == ' ') {
+        size_t end = msg.find(' ', pos + 2);
+        return end == std::string::npos ? msg.size() : end;
+    }
+    // RFC3164: fixed width "Mmm dd hh:mm:ss"
+    if (pos + 15 <= msg.size() && msg[pos + 3] == ' ' && msg[pos + 6] == ' ' &&
+        msg[pos + 9] == ':' && msg[pos + 12] == ':')
+        return pos + 15;
+    return pos;
+}
+
+uint64_t dedup_hash(const logentry *entry) {
+    // FNV-1a over host, pid and message sans timestamp
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t pri_len;
+    size_t body = msg_skip_timestamp(entry->msg, &pri_len);
+    for (int i = 0; i < 16; i++)
+        h = (h ^ entry->host.a[i]) * 0x100000001b3ULL;
+    h = (h ^ (uint32_t)entry->pid) * 0x100000001b3ULL;
+    for (size_t i = 0; i < pri_len; i++)
+        h = (h ^ (uint8_t)entry->msg[i]) * 0x100000001b3ULL;
+    for (size_t i = body; i < entry->msg.size(); i++)
+        h = (h ^ (uint8_t)entry->msg[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+void dedup_flush_run(dedup_slot *slot, int idx) {
+    logentry &e = slot->runs[idx].entry;
+    enqueue(e);
+    slot->runs[idx] = std::move(slot->runs[--slot->nruns]);
+    dedup.pending--;
+}
+
+/*
+    * Pass message through dedup window, it is stored later when run ends
+*/
+void dedup_add(logentry &entry) {
+    uint64_t hash = dedup_hash(&entry);
+    dedup_slot *slot = &dedup.table[host_hash(&entry.host) & (DEDUP_HOSTS - 1)];
+
+    if (slot->used && memcmp(&slot->host, &entry.host, sizeof(entry.host)) != 0) {
+        // slot taken by another host, flush its runs
+        while (slot->nruns > 0)
+            dedup_flush_run(slot, 0);
+    }
+    slot->used = 1;
+    slot->host = entry.host;
+
+    for (int i = 0; i < slot->nruns; i++) {
+        dedup_run *run = &slot->runs[i];
+        if (run->hash == hash && run->entry.pid == entry.pid) {
+            run->entry.repeat++;
+            run->entry.last_ts = entry.ts;
+            dedup.folded_total++;
+            return;
+        }
+    }
+    if (slot->nruns == config.dedup_window) {
+        // window full, oldest run ends
+        int oldest = 0;
+        for (int i = 1; i < slot->nruns; i++) {
+            if (slot->runs[i].entry.last_ts < slot->runs[oldest].entry.last_ts)
+                oldest = i;
+        }
+        dedup_flush_run(slot, oldest);
+    }
+    dedup_run *run = &slot->runs[slot->nruns++];
+    run->hash = hash;
+    run->entry = std::move(entry);
+    run->entry.last_ts = run->entry.ts;
+    dedup.pending++;
+}
+
+/*
+    * Store runs that are no longer repeated or are too old
+*/
+void dedup_sweep() {
+    time_t now = time(NULL);
+    if (now == dedup.last_sweep || dedup.pending == 0)
+        return;
+    dedup.last_sweep = now;
+    for (int i = 0; i < DEDUP_HOSTS; i++) {
+        dedup_slot *slot = &dedup.table[i];
+        for (int j = 0; j < slot->nruns; j++) {
+            logentry &e = slot->runs[j].entry;
+            if (now - e.last_ts >= config.dedup_delay || now - e.ts >= DEDUP_MAX_AGE) {
+                dedup_flush_run(slot, j);
+                j--;
+            }
+        }
+    }
+}
+
+/*
+    * Write counters to stats file (Prometheus text format), replaced atomically
+*/
+#define STATS_INTERVAL 10
+
+void write_stats() {
+    static time_t last;
+    static const char *sevnames[NUM_SEVERITIES] = {
+        "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+    };
+    time_t now = time(NULL);
+    if (now - last < STATS_INTERVAL)
+        return;
+    last = now;
+
+    std::string tmp = std::string(config.stats_file) + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (f == NULL) {
+        perror("fopen stats file");
+        return;
+    }
+    // queue counters are summed over stores
+    size_t size = 0, lanes[NUM_SEVERITIES] = {0};
+    uint64_t dropped[NUM_SEVERITIES] = {0};
+    for (int s = 0; s < stores.n; s++) {
+        // writer metrics are per shard
+        char label[128];
+        if (stores.list[s].nshards > 1)
+            snprintf(label, sizeof(label), "store=\"%s\",shard=\"%d\"", stores.list[s].name, stores.list[s].shard);
+        else
+            snprintf(label, sizeof(label), "store=\"%s\"", stores.list[s].name);
+        msg_queue &queue = stores.list[s].queue;
+        pthread_mutex_lock(&queue.lock);
+        size += queue.size;
+        for (int i = 0; i < NUM_SEVERITIES; i++) {
+            lanes[i] += queue.lanes[i].size();
+            dropped[i] += queue.dropped[i];
+        }
+        if (stores.n > 1)
+            fprintf(f, "logcollectd_store_queue_size{%s} %zu\n", label, queue.size);
+        pthread_mutex_unlock(&queue.lock);
+        if (stores.list[s].first_insert > 0)
+            fprintf(f, "logcollectd_startup_first_insert_seconds{%s} %.3f\n", label, stores.list[s].first_insert);
+        if (config.journal)
+            fprintf(f, "logcollectd_journal_lag_bytes{%s} %lld\n", label,
+                    (long long)(stores.list[s].jend - stores.list[s].japplied));
+        if (stores.list[s].quota > 0 && stores.list[s].shard == 0) {
+            fprintf(f, "logcollectd_store_usage_bytes{store=\"%s\"} %lld\n", stores.list[s].name,
+                    (long long)stores.list[s].usage);
+            fprintf(f, "logcollectd_store_evicted_total{store=\"%s\"} %llu\n", stores.list[s].name,
+                    (unsigned long long)stores.list[s].evicted);
+        }
+    }
+    fprintf(f, "logcollectd_queue_size %zu\n", size);
+    for (int i = 0; i < NUM_SEVERITIES; i++)
+        fprintf(f, "logcollectd_queue_lane_size{severity=\"%s\"} %zu\n", sevnames[i], lanes[i]);
+    for (int i = 0; i < NUM_SEVERITIES; i++)
+        fprintf(f, "logcollectd_dropped_total{severity=\"%s\"} %llu\n", sevnames[i],
+                (unsigned long long)dropped[i]);
+    fprintf(f, "logcollectd_ratelimited_total %llu\n", (unsigned long long)ratelimit.dropped_total);
+    fprintf(f, "logcollectd_dedup_folded_total %llu\n", (unsigned long long)dedup.folded_total);
+    if (config.upgrade_path != NULL)
+        fprintf(f, "logcollectd_handoff_dropped_total %llu\n", (unsigned long long)handoff.dropped);
+    if (config.journal)
+        fprintf(f, "logcollectd_journal_replayed_total %llu\n", (unsigned long long)journal_replayed);
+    for (int i = 0; i < relay.n; i++) {
+        upstream *u = &relay.list[i];
+        if (!u->active)
+            continue;
+        const char *spec = u->spec.c_str();
+        fprintf(f, "logcollectd_relay_sent_total{upstream=\"%s\"} %llu\n", spec, (unsigned long long)u->sent);
+        fprintf(f, "logcollectd_relay_dropped_total{upstream=\"%s\"} %llu\n", spec, (unsigned long long)u->dropped);
+        fprintf(f, "logcollectd_relay_backlog_bytes{upstream=\"%s\"} %lld\n", spec,
+                (long long)(u->backlog_write - u->backlog_read));
+    }
+    for (int i = 0; i < fd.nsocks; i++) {
+        const rxbuf *rb = &fd.rx[i];
+        fprintf(f, "logcollectd_socket_rcvbuf_bytes{listener=\"%s\"} %d\n", rb->label, rb->size);
+        fprintf(f, "logcollectd_socket_drops_total{listener=\"%s\"} %llu\n", rb->label, (unsigned long long)rb->drops);
+    }
+    if (config.xdp_ifname != NULL) {
+        // rx_dropped: no frame in fill ring, rx_ring_full: rx ring not read in time
+        uint64_t kdropped = 0;
+        for (int i = 0; i < xdp.nqueues; i++) {
+            struct xdp_statistics xs;
+            socklen_t xslen = sizeof(xs);
+            if (getsockopt(xdp.q[i].fd, SOL_XDP, XDP_STATISTICS, &xs, &xslen) == 0)
+                kdropped += xs.rx_dropped + xs.rx_ring_full;
+        }
+        fprintf(f, "logcollectd_xdp_received_total %llu\n", (unsigned long long)xdp.received);
+        fprintf(f, "logcollectd_xdp_malformed_total %llu\n", (unsigned long long)xdp.malformed);
+        fprintf(f, "logcollectd_xdp_dropped_total %llu\n", (unsigned long long)kdropped);
+    }
+    if (config.numa) {
+        fprintf(f, "logcollectd_receiver_numa_node %d\n", numa.receiver);
+        fprintf(f, "logcollectd_receiver_incoming_cpu %d\n", numa.incoming_cpu);
+    }
+    if (!rules.list.empty()) {
+        fprintf(f, "logcollectd_rules_dropped_total %llu\n", (unsigned long long)rules.dropped_total);
+        for (size_t i = 0; i < rules.list.size(); i++)
+            fprintf(f, "logcollectd_rule_matches_total{line=\"%d\"} %llu\n", rules.list[i].line,
+                    (unsigned long long)rules.list[i].matches);
+    }
+    fclose(f);
+    if (rename(tmp.c_str(), config.stats_file) < 0)
+        perror("rename stats file");
+}
+
+/*
+    * Queue message of network sender, read from socket or XDP ring
+*/
+void receive_datagram(const hostaddr *host, const char *buf, int len) {
+    logentry entry;
+    entry.host = *host;
+    if (ratelimit.table != NULL && !ratelimit_check(&entry.host))
+        return;
+    entry.ts = time(NULL);
+    entry.pid = -1;
+    entry.uid = -1;
+    entry.msg.assign(buf, len);
+    if (dedup.table != NULL)
+        dedup_add(entry);
+    else
+        enqueue(entry);
+}
+
+/*
+    * Read one datagram from UDP listener
+*/
+void receive_udp(int sock, rxbuf *rb) {
+    char buffer[65536];
+    struct sockaddr_storage clientname;
+    union {
+        char buf[CMSG_SPACE(sizeof(uint32_t))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov;
+    struct msghdr mh;
+
+    iov.iov_base = buffer;
+    iov.iov_len = sizeof(buffer) - 1;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = &clientname;
+    mh.msg_namelen = sizeof(clientname);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+    int recvlen = recvmsg(sock, &mh, 0);
+    if (recvlen > 0) {
+        rxbuf_account(sock, rb, &mh);
+        buffer[recvlen] = 0;
+        // address is kept binary, formatted only on read
+        hostaddr host;
+        sockaddr_to_host(&clientname, &host);
+        receive_datagram(&host, buffer, recvlen);
+    }
+}
+
+/*
+    * Read one datagram from local unix socket, sender pid/uid from SCM_CREDENTIALS
+*/
+void receive_unix(int sock) {
+    char buffer[65536];
+    union {
+        char buf[CMSG_SPACE(sizeof(struct ucred))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov;
+    struct msghdr mh;
+
+    iov.iov_base = buffer;
+    iov.iov_len = sizeof(buffer) - 1;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+    int recvlen = recvmsg(sock, &mh, 0);
+    if (recvlen <= 0)
+        return;
+    buffer[recvlen] = 0;
+    // local syslog() calls often terminate message with newline or NUL
+    while (recvlen > 0 && (buffer[recvlen - 1] == '\n' || buffer[recvlen - 1] == 0))
+        recvlen--;
+
+    logentry entry;
+    entry.ts = time(NULL);
+    memset(&entry.host, 0, sizeof(entry.host));
+    entry.pid = 0;
+    entry.uid = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS) {
+            struct ucred cred;
+            memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+            entry.pid = cred.pid;
+            entry.uid = cred.uid;
+        }
+    }
+    entry.msg.assign(buffer, recvlen);
+    if (dedup.table != NULL)
+        dedup_add(entry);
+    else
+        enqueue(entry);
+}
+
+/*
+    * Minimal eBPF assembler for XDP program, jumps are resolved by label
+*/
+struct bpf_prog_asm {
+    std::vector<struct bpf_insn> insns;
+    std::vector<std::pair<size_t, int> > fixups;
+    std::map<int, size_t> labels;
+
+    void emit(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+        struct bpf_insn i;
+        memset(&i, 0, sizeof(i));
+        i.code = code;
+        i.dst_reg = dst;
+        i.src_reg = src;
+        i.off = off;
+        i.imm = imm;
+        insns.push_back(i);
+    }
+    void jump(uint8_t code, uint8_t dst, uint8_t src, int32_t imm, int label) {
+        fixups.push_back(std::make_pair(insns.size(), label));
+        emit(code, dst, src, 0, imm);
+    }
+    void label(int l) {
+        labels[l] = insns.size();
+    }
+    void resolve() {
+        for (size_t i = 0; i < fixups.size(); i++)
+            insns[fixups[i].first].off = labels[fixups[i].second] - fixups[i].first - 1;
+    }
+};
+
+static long bpf_call(int cmd, union bpf_attr *attr) {
+    return syscall(SYS_bpf, cmd, attr, sizeof(*attr));
+}
+
+/*
+    * XDP program: UDP over untagged IPv4 (no options, not fragmented) or
+    * IPv6 (no extension headers) to one of listener addresses is redirected
+    * to socket of rx queue, anything else is passed to kernel stack
+*/
+int xdp_load_prog(int map, const std::vector<xdp_dest> &dests) {
+    enum { PASS, IPV6, REDIRECT, NEXT };
+    int next = NEXT;
+    bpf_prog_asm a;
+    // r6 = ctx, r2 = data, r3 = data_end
+    a.emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+    a.emit(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data), 0);
+    a.emit(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1, offsetof(struct xdp_md, data_end), 0);
+    a.emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+    a.emit(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 14 + 20 + 8);
+    a.jump(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, PASS);
+    // loads are in host order, constants are compared as they lie in packet
+    a.emit(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 12, 0);
+    a.jump(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, htons(0x0800), IPV6);
+    a.emit(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, 14, 0);
+    a.jump(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0x45, PASS);
+    a.emit(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, 14 + 9, 0);
+    a.jump(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, IPPROTO_UDP, PASS);
+    // fragments are reassembled by kernel
+    a.emit(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 14 + 6, 0);
+    a.emit(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, htons(0x3fff));
+    a.jump(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, PASS);
+    // total length holds UDP header and ends within frame
+    a.emit(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 14 + 2, 0);
+    a.emit(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_5, 0, 0, 16);
+    a.emit(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, 0xffff);
+    a.jump(BPF_JMP | BPF_JLT | BPF_K, BPF_REG_5, 0, 20 + 8, PASS);
+    a.emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+    a.emit(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_4, BPF_REG_5, 0, 0);
+    a.emit(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 14);
+    a.jump(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, PASS);
+    // 32-bit compares, address words are not sign extended
+    a.emit(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_2, 14 + 16, 0);
+    a.emit(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 14 + 20 + 2, 0);
+    for (size_t i = 0; i < dests.size(); i++) {
+        if (dests[i].family != AF_INET)
+            continue;
+        uint32_t w;
+        memcpy(&w, dests[i].addr, 4);
+        a.jump(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_7, 0, w, next);
+        a.jump(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_5, 0, htons(dests[i].port), REDIRECT);
+        a.label(next++);
+    }
+    a.jump(BPF_JMP | BPF_JA, 0, 0, 0, PASS);
+    a.label(IPV6);
+    a.jump(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, htons(0x86dd), PASS);
+    a.emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+    a.emit(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 14 + 40 + 8);
+    a.jump(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, PASS);
+    a.emit(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, 14 + 6, 0);
+    a.jump(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, IPPROTO_UDP, PASS);
+    // payload length holds UDP header and ends within frame
+    a.emit(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 14 + 4, 0);
+    a.emit(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_5, 0, 0, 16);
+    a.emit(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, 0xffff);
+    a.jump(BPF_JMP | BPF_JLT | BPF_K, BPF_REG_5, 0, 8, PASS);
+    a.emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+    a.emit(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_4, BPF_REG_5, 0, 0);
+    a.emit(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 14 + 40);
+    a.jump(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, PASS);
+    a.emit(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_2, 14 + 24, 0);
+    a.emit(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_8, BPF_REG_2, 14 + 28, 0);
+    a.emit(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_9, BPF_REG_2, 14 + 32, 0);
+    a.emit(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_2, 14 + 36, 0);
+    a.emit(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 14 + 40 + 2, 0);
+    static const uint8_t words[4] = {BPF_REG_7, BPF_REG_8, BPF_REG_9, BPF_REG_1};
+    for (size_t i = 0; i < dests.size(); i++) {
+        if (dests[i].family != AF_INET6)
+            continue;
+        for (int k = 0; k < 4; k++) {
+            uint32_t w;
+            memcpy(&w, dests[i].addr + k * 4, 4);
+            a.jump(BPF_JMP32 | BPF_JNE | BPF_K, words[k], 0, w, next);
+        }
+        a.jump(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_5, 0, htons(dests[i].port), REDIRECT);
+        a.label(next++);
+    }
+    a.jump(BPF_JMP | BPF_JA, 0, 0, 0, PASS);
+    // bpf_redirect_map(map, rx_queue_index, XDP_PASS if queue has no socket)
+    a.label(REDIRECT);
+    a.emit(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index), 0);
+    a.emit(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map);
+    a.emit(0, 0, 0, 0, 0);
+    a.emit(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS);
+    a.emit(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+    a.emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+    a.label(PASS);
+    a.emit(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+    a.emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+    a.resolve();
+
+    char log[4096] = "";
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns = (uintptr_t)a.insns.data();
+    attr.insn_cnt = a.insns.size();
+    attr.license = (uintptr_t)"GPL";
+    attr.log_buf = (uintptr_t)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    int prog = bpf_call(BPF_PROG_LOAD, &attr);
+    if (prog < 0) {
+        perror("loading XDP program");
+        if (config.verbose)
+            fprintf(stderr, "%s", log);
+    }
+    return prog;
+}
+
+// map ring of socket, offsets from XDP_MMAP_OFFSETS
+static int xdp_map_ring(int sock, xdp_ring *r, const struct xdp_ring_offset *off, uint32_t size,
+                        size_t entry, off_t pgoff) {
+    void *map = mmap(NULL, off->desc + size * entry, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, sock, pgoff);
+    if (map == MAP_FAILED)
+        return -1;
+    r->producer = (uint32_t *)((char *)map + off->producer);
+    r->consumer = (uint32_t *)((char *)map + off->consumer);
+    r->flags = (uint32_t *)((char *)map + off->flags);
+    r->ring = (char *)map + off->desc;
+    r->size = size;
+    r->map = map;
+    r->maplen = off->desc + size * entry;
+    return 0;
+}
+
+/*
+    * Create socket and UMEM for rx queue, all frames start in fill ring
+    * Return 0 on success, -1 on error
+*/
+int xdp_open_queue(int queue) {
+    int sock = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("opening XDP socket");
+        return -1;
+    }
+    xdp.q[queue].fd = sock;
+    char *umem = (char *)mmap(NULL, (size_t)XDP_FRAMES * XDP_FRAME_SIZE, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (umem == MAP_FAILED) {
+        perror("mmap UMEM");
+        return -1;
+    }
+    xdp.q[queue].umem = umem;
+    struct xdp_umem_reg mr;
+    memset(&mr, 0, sizeof(mr));
+    mr.addr = (uintptr_t)umem;
+    mr.len = (uint64_t)XDP_FRAMES * XDP_FRAME_SIZE;
+    mr.chunk_size = XDP_FRAME_SIZE;
+    // completion ring is required by kernel even without tx
+    int fill = XDP_FRAMES, comp = 64, rx = XDP_FRAMES;
+    if (setsockopt(sock, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) < 0 ||
+        setsockopt(sock, SOL_XDP, XDP_UMEM_FILL_RING, &fill, sizeof(fill)) < 0 ||
+        setsockopt(sock, SOL_XDP, XDP_UMEM_COMPLETION_RING, &comp, sizeof(comp)) < 0 ||
+        setsockopt(sock, SOL_XDP, XDP_RX_RING, &rx, sizeof(rx)) < 0) {
+        perror("setsockopt XDP rings");
+        return -1;
+    }
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    if (getsockopt(sock, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0 ||
+        xdp_map_ring(sock, &xdp.q[queue].fill, &off.fr, fill, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) < 0 ||
+        xdp_map_ring(sock, &xdp.q[queue].comp, &off.cr, comp, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) < 0 ||
+        xdp_map_ring(sock, &xdp.q[queue].rx, &off.rx, rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0) {
+        perror("mapping XDP rings");
+        return -1;
+    }
+    xdp_ring *fr = &xdp.q[queue].fill;
+    for (uint32_t i = 0; i < XDP_FRAMES; i++)
+        ((uint64_t *)fr->ring)[i] = (uint64_t)i * XDP_FRAME_SIZE;
+    __atomic_store_n(fr->producer, XDP_FRAMES, __ATOMIC_RELEASE);
+
+    // zero-copy if driver supports it, copy mode otherwise
+    struct sockaddr_xdp sxdp;
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP;
+    sxdp.sxdp_ifindex = xdp.ifindex;
+    sxdp.sxdp_queue_id = queue;
+    if (bind(sock, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+        perror("binding XDP socket");
+        return -1;
+    }
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    uint32_t key = queue, value = sock;
+    attr.map_fd = xdp.map;
+    attr.key = (uintptr_t)&key;
+    attr.value = (uintptr_t)&value;
+    if (bpf_call(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+        perror("adding XDP socket to map");
+        return -1;
+    }
+    return 0;
+}
+
+void xdp_close() {
+    // detach first, datagrams go to regular listeners from now on
+    if (xdp.link >= 0)
+        close(xdp.link);
+    xdp.link = -1;
+    for (int i = 0; i < xdp.nqueues; i++) {
+        xdp_ring *rings[3] = { &xdp.q[i].fill, &xdp.q[i].comp, &xdp.q[i].rx };
+        for (int r = 0; r < 3; r++)
+            if (rings[r]->map != NULL)
+                munmap(rings[r]->map, rings[r]->maplen);
+        if (xdp.q[i].fd >= 0)
+            close(xdp.q[i].fd);
+        if (xdp.q[i].umem != NULL)
+            munmap(xdp.q[i].umem, (size_t)XDP_FRAMES * XDP_FRAME_SIZE);
+        memset(&xdp.q[i], 0, sizeof(xdp.q[i]));
+        xdp.q[i].fd = -1;
+    }
+    xdp.nqueues = 0;
+    if (xdp.map >= 0)
+        close(xdp.map);
+    if (xdp.prog >= 0)
+        close(xdp.prog);
+    xdp.map = xdp.prog = -1;
+}
+
+/*
+    * Addresses of UDP listeners for XDP program. Wildcard listener stands
+    * for addresses of interface (IPv4 ones too if dual-stack); address
+    * added later is not matched, its datagrams take kernel stack
+*/
+static void xdp_dests(const char *ifname, std::vector<xdp_dest> &dests) {
+    struct ifaddrs *ifa = NULL;
+    if (getifaddrs(&ifa) < 0)
+        perror("getifaddrs");
+    for (int i = 0; i < fd.nsocks; i++) {
+        struct sockaddr_storage ss;
+        socklen_t sslen = sizeof(ss);
+        if (getsockname(fd.socks[i], (struct sockaddr *)&ss, &sslen) < 0)
+            continue;
+        xdp_dest d;
+        memset(&d, 0, sizeof(d));
+        int any4 = 0, any6 = 0;
+        if (ss.ss_family == AF_INET) {
+            struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+            d.family = AF_INET;
+            d.port = ntohs(sin->sin_port);
+            memcpy(d.addr, &sin->sin_addr, 4);
+            any4 = sin->sin_addr.s_addr == htonl(INADDR_ANY);
+        } else if (ss.ss_family == AF_INET6) {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+            d.port = ntohs(sin6->sin6_port);
+            if (IN6_IS_ADDR_UNSPECIFIED(&sin6->sin6_addr)) {
+                int v6only = 0;
+                socklen_t len = sizeof(v6only);
+                getsockopt(fd.socks[i], IPPROTO_IPV6, IPV6_V6ONLY, &v6only, &len);
+                any6 = 1;
+                any4 = !v6only;
+            } else if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+                d.family = AF_INET;
+                memcpy(d.addr, sin6->sin6_addr.s6_addr + 12, 4);
+            } else {
+                d.family = AF_INET6;
+                memcpy(d.addr, &sin6->sin6_addr, 16);
+            }
+        } else {
+            continue;
+        }
+        if (!any4 && !any6) {
+            dests.push_back(d);
+            continue;
+        }
+        for (struct ifaddrs *p = ifa; p != NULL; p = p->ifa_next) {
+            if (p->ifa_addr == NULL || strcmp(p->ifa_name, ifname) != 0)
+                continue;
+            if (p->ifa_addr->sa_family == AF_INET && any4) {
+                d.family = AF_INET;
+                memcpy(d.addr, &((struct sockaddr_in *)p->ifa_addr)->sin_addr, 4);
+                dests.push_back(d);
+            } else if (p->ifa_addr->sa_family == AF_INET6 && any6) {
+                d.family = AF_INET6;
+                memcpy(d.addr, &((struct sockaddr_in6 *)p->ifa_addr)->sin6_addr, 16);
+                dests.push_back(d);
+            }
+        }
+    }
+    if (ifa != NULL)
+        freeifaddrs(ifa);
+}
+
+/*
+    * Attach AF_XDP receiver to interface, on any failure regular listeners
+    * keep receiving everything
+*/
+void xdp_open(const char *ifname, int nqueues) {
+    xdp.prog = xdp.map = xdp.link = -1;
+    xdp.ifindex = if_nametoindex(ifname);
+    if (xdp.ifindex == 0) {
+        fprintf(stderr, "XDP: no interface %s, using sockets\n", ifname);
+        return;
+    }
+    // socket can only bind to queue that exists
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/queues", ifname);
+    DIR *dir = opendir(path);
+    if (dir != NULL) {
+        int rxq = 0;
+        struct dirent *ent;
+        while ((ent = readdir(dir)) != NULL)
+            rxq += strncmp(ent->d_name, "rx-", 3) == 0;
+        closedir(dir);
+        if (rxq > 0 && rxq < nqueues) {
+            printf("XDP: %s has %d rx queues\n", ifname, rxq);
+            nqueues = rxq;
+        }
+    }
+    std::vector<xdp_dest> dests;
+    xdp_dests(ifname, dests);
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = XDP_MAX_QUEUES;
+    xdp.map = bpf_call(BPF_MAP_CREATE, &attr);
+    if (xdp.map < 0) {
+        perror("creating XSKMAP");
+        xdp_close();
+        fprintf(stderr, "XDP: unavailable, using sockets\n");
+        return;
+    }
+    xdp.prog = xdp_load_prog(xdp.map, dests);
+    for (int i = 0; i < nqueues && xdp.prog >= 0; i++) {
+        memset(&xdp.q[i], 0, sizeof(xdp.q[i]));
+        xdp.q[i].fd = -1;
+        xdp.nqueues++;
+        if (xdp_open_queue(i) < 0) {
+            xdp_close();
+            break;
+        }
+    }
+    if (xdp.prog >= 0) {
+        memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd = xdp.prog;
+        attr.link_create.target_ifindex = xdp.ifindex;
+        attr.link_create.attach_type = BPF_XDP;
+        xdp.link = bpf_call(BPF_LINK_CREATE, &attr);
+        if (xdp.link < 0) {
+            perror("attaching XDP program");
+            xdp_close();
+        }
+    }
+    if (xdp.prog < 0) {
+        fprintf(stderr, "XDP: unavailable on %s, using sockets\n", ifname);
+        return;
+    }
+    printf("XDP: receiving on %s, %d queues, %zu listener addresses\n", ifname, xdp.nqueues, dests.size());
+}
+
+/*
+    * Socket filter for XDP frames, which bypass socket
+*/
+int sockfilter_match(const hostaddr *host, const char *msg, int len) {
+    if (!sockfilter.nets.empty()) {
+        size_t i;
+        for (i = 0; i < sockfilter.nets.size(); i++) {
+            const uint8_t *a = host->a, *b = sockfilter.nets[i].first.a;
+            int bits = sockfilter.nets[i].second, k = 0;
+            for (; bits >= 8; bits -= 8, k++)
+                if (a[k] != b[k])
+                    break;
+            if (bits < 8 && (bits == 0 || ((a[k] ^ b[k]) & (0xff00 >> bits)) == 0))
+                break;
+        }
+        if (i == sockfilter.nets.size())
+            return 0;
+    }
+    int pri = parse_pri(std::string(msg, len < 6 ? len : 6));
+    if (sockfilter.severity >= 0 && (pri & 7) > sockfilter.severity)
+        return 0;
+    if (!sockfilter.facilities.empty() &&
+        std::find(sockfilter.facilities.begin(), sockfilter.facilities.end(), pri >> 3) == sockfilter.facilities.end())
+        return 0;
+    return 1;
+}
+
+/*
+    * Parse Ethernet/IP/UDP frame redirected by program, payload is queued
+    * like a datagram read from socket
+*/
+void xdp_frame(const uint8_t *p, uint32_t len) {
+    hostaddr host;
+    memset(&host, 0, sizeof(host));
+    const uint8_t *udp;
+    uint32_t left;
+    if (len >= 14 + 20 && p[12] == 0x08 && p[13] == 0x00) {
+        uint32_t ihl = (p[14] & 0x0f) * 4;
+        uint32_t total = p[16] << 8 | p[17];
+        if (p[14] >> 4 != 4 || ihl < 20 || total < ihl + 8 || 14 + total > len) {
+            xdp.malformed++;
+            return;
+        }
+        host.a[10] = 0xff;
+        host.a[11] = 0xff;
+        memcpy(host.a + 12, p + 14 + 12, 4);
+        udp = p + 14 + ihl;
+        left = total - ihl;
+    } else if (len >= 14 + 40 && p[12] == 0x86 && p[13] == 0xdd) {
+        uint32_t plen = p[18] << 8 | p[19];
+        if (p[14] >> 4 != 6 || plen < 8 || 14 + 40 + plen > len) {
+            xdp.malformed++;
+            return;
+        }
+        memcpy(host.a, p + 14 + 8, 16);
+        udp = p + 14 + 40;
+        left = plen;
+    } else {
+        xdp.malformed++;
+        return;
+    }
+    uint32_t ulen = left >= 8 ? (uint32_t)(udp[4] << 8 | udp[5]) : 0;
+    if (ulen < 8 || ulen > left) {
+        xdp.malformed++;
+        return;
+    }
+    xdp.received++;
+    if (sockfilter.enabled && !sockfilter_match(&host, (const char *)udp + 8, ulen - 8))
+        return;
+    receive_datagram(&host, (const char *)udp + 8, ulen - 8);
+}
+
+/*
+    * Take frames from rx ring of queue, return them to fill ring
+*/
+void xdp_receive(int queue) {
+    xdp_ring *rx = &xdp.q[queue].rx, *fr = &xdp.q[queue].fill;
+    uint32_t prod = __atomic_load_n(rx->producer, __ATOMIC_ACQUIRE);
+    uint32_t cons = *rx->consumer;
+    uint32_t fprod = *fr->producer;
+    uint32_t room = fr->size - (fprod - __atomic_load_n(fr->consumer, __ATOMIC_ACQUIRE));
+    // frames kept by last pass go back first
+    uint32_t &nspare = xdp.q[queue].nspare;
+    for (; nspare > 0 && room > 0; room--)
+        ((uint64_t *)fr->ring)[fprod++ & (fr->size - 1)] = xdp.q[queue].spare[--nspare];
+    for (; cons != prod; cons++) {
+        const struct xdp_desc *d = &((const struct xdp_desc *)rx->ring)[cons & (rx->size - 1)];
+        xdp_frame((const uint8_t *)xdp.q[queue].umem + d->addr, d->len);
+        uint64_t addr = d->addr & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+        if (room > 0) {
+            ((uint64_t *)fr->ring)[fprod++ & (fr->size - 1)] = addr;
+            room--;
+        } else {
+            xdp.q[queue].spare[nspare++] = addr;
+        }
+    }
+    __atomic_store_n(rx->consumer, cons, __ATOMIC_RELEASE);
+    __atomic_store_n(fr->producer, fprod, __ATOMIC_RELEASE);
+    if (__atomic_load_n(fr->flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)
+        recvfrom(xdp.q[queue].fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+/*
+    * Read all rows of closed period file (any backend) in insert order
+    * Return 0 on success, -1 on error
+*/
+template <typename F>
+int for_each_row(const std::string &path, F cb) {
+    if (path.size() > 4 && path.compare(path.size() - 4, 4, ".seg") == 0) {
+        int sfd = open(path.c_str(), O_RDONLY);
+        if (sfd < 0)
+            return -1;
+        std::vector<logentry> rows;
+        segment_scan(sfd, [&](const seg_index &idx, const std::string &payload) {
+            if (segment_decode_block((const uint8_t *)payload.data(), payload.size(), idx.rows,
+                                     idx.min_ts, rows) < 0)
+                return;
+            for (size_t i = 0; i < rows.size(); i++)
+                cb(rows[i]);
+        });
+        close(sfd);
+        return 0;
+    }
+
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    if (sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        sqlite3_close(db);
+        return -1;
+    }
+    register_sql_functions(db);
+    std::string sql = std::string("SELECT timestamp, host, ") + msg_expr(db) + ", pid, uid, repeat, last_timestamp FROM log ORDER BY id;";
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+        sqlite3_close(db);
+        return -1;
+    }
+    logentry e;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        e.ts = sqlite3_column_int(stmt, 0);
+        memset(&e.host, 0, sizeof(e.host));
+        if (sqlite3_column_type(stmt, 1) == SQLITE_BLOB && sqlite3_column_bytes(stmt, 1) == 16)
+            memcpy(e.host.a, sqlite3_column_blob(stmt, 1), 16);
+        else if (sqlite3_column_type(stmt, 1) == SQLITE_TEXT)
+            host_pton((const char *)sqlite3_column_text(stmt, 1), &e.host);
+        const char *msg = (const char *)sqlite3_column_text(stmt, 2);
+        e.msg.assign(msg != NULL ? msg : "", sqlite3_column_bytes(stmt, 2));
+        e.pid = sqlite3_column_type(stmt, 3) == SQLITE_NULL ? -1 : sqlite3_column_int(stmt, 3);
+        e.uid = sqlite3_column_type(stmt, 4) == SQLITE_NULL ? -1 : sqlite3_column_int(stmt, 4);
+        e.repeat = sqlite3_column_type(stmt, 5) == SQLITE_NULL ? 1 : sqlite3_column_int(stmt, 5);
+        e.last_ts = sqlite3_column_int(stmt, 6);
+        e.pri = parse_pri(e.msg);
+        cb(e);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return 0;
+}
+
+/*
+    * Parquet export of closed hours
+    *
+    * Minimal native writer: Thrift compact metadata, data page v1, GZIP pages.
+    * Columns with few distinct values are dictionary encoded (PLAIN_DICTIONARY,
+    * indices in RLE/bit-packed hybrid), others PLAIN. Optional columns carry RLE
+    * definition levels. Row group is flushed every PQ_ROW_GROUP_BYTES of input,
+    * so memory use is bounded by one row group regardless of hour size.
+*/
+#define PQ_ROW_GROUP_BYTES (64 * 1024 * 1024)
+#define PQ_PAGE_ROWS 65536
+#define PQ_DICT_MAX_ENTRIES 65535
+#define PQ_DICT_MAX_BYTES (1024 * 1024)
+
+enum { PQ_INT32 = 1, PQ_INT64 = 2, PQ_BYTE_ARRAY = 6, PQ_FIXED_LEN_BYTE_ARRAY = 7 };
+enum { PQ_PLAIN = 0, PQ_PLAIN_DICTIONARY = 2, PQ_RLE = 3 };
+enum { PQ_GZIP = 2 };
+enum { PQ_DATA_PAGE = 0, PQ_DICTIONARY_PAGE = 2 };
+enum { PQ_CONVERTED_UTF8 = 0 };
+
+struct thrift_compact {
+    std::string buf;
+    std::vector<int> stack;
+    int last = 0;
+
+    void header(int id, int type) {
+        if (id > last && id - last <= 15) {
+            buf.push_back((char)(((id - last) << 4) | type));
+        } else {
+            buf.push_back((char)type);
+            put_varint(buf, zigzag(id));
+        }
+        last = id;
+    }
+    void begin() { stack.push_back(last); last = 0; }
+    void end() { buf.push_back(0); last = stack.back(); stack.pop_back(); }
+    void i32(int id, int32_t v) { header(id, 5); put_varint(buf, zigzag(v)); }
+    void i64(int id, int64_t v) { header(id, 6); put_varint(buf, zigzag(v)); }
+    void binary(int id, const std::string &v) { header(id, 8); put_varint(buf, v.size()); buf.append(v); }
+    void boolean(int id, bool v) { header(id, v ? 1 : 2); }
+    void structure(int id) { header(id, 12); begin(); }
+    void list(int id, int elemtype, size_t size) {
+        header(id, 9);
+        if (size < 15) {
+            buf.push_back((char)((size << 4) | elemtype));
+        } else {
+            buf.push_back((char)(0xf0 | elemtype));
+            put_varint(buf, size);
+        }
+    }
+    // list elements
+    void elem_i32(int32_t v) { put_varint(buf, zigzag(v)); }
+    void elem_binary(const std::string &v) { put_varint(buf, v.size()); buf.append(v); }
+};
+
+struct pq_column {
+    const char *name;
+    int type;
+    int type_length;
+    int optional;
+    int converted_type;
+    // buffered values of current row group
+    std::vector<uint8_t> defined;
+    std::vector<int64_t> ints;
+    std::vector<std::string> bins;
+    // chunk metadata of finished row group
+    int64_t offset, dict_offset, data_offset, size_uncompressed, size_compressed;
+    bool dict_used;
+    int64_t min, max;
+};
+
+/*
+    * RLE/bit-packed hybrid encoding of values with given bit width
+*/
+void rle_hybrid(const std::vector<uint32_t> &v, int width, std::string &out) {
+    std::vector<uint32_t> lits;
+    int bytes = (width + 7) / 8;
+    size_t i = 0;
+
+    auto flush_lits = [&]() {
+        if (lits.empty())
+            return;
+        size_t groups = (lits.size() + 7) / 8;
+        lits.resize(groups * 8, 0);  // padding is only ever needed for last run
+        put_varint(out, (groups << 1) | 1);
+        uint64_t acc = 0;
+        int nbits = 0;
+        for (size_t k = 0; k < lits.size(); k++) {
+            acc |= (uint64_t)lits[k] << nbits;
+            nbits += width;
+            while (nbits >= 8) {
+                out.push_back((char)acc);
+                acc >>= 8;
+                nbits -= 8;
+            }
+        }
+        lits.clear();
+    };
+
+    while (i < v.size()) {
+        size_t run = 1;
+        while (i + run < v.size() && v[i + run] == v[i])
+            run++;
+        if (run >= 8 && lits.size() % 8 == 0) {
+            flush_lits();
+            put_varint(out, run << 1);
+            for (int b = 0; b < bytes; b++)
+                out.push_back((char)(v[i] >> (8 * b)));
+            i += run;
+        } else if (run >= 8) {
+            // complete literal group with head of the run, rest becomes RLE run
+            size_t k = 8 - lits.size() % 8;
+            lits.insert(lits.end(), k, v[i]);
+            i += k;
+        } else {
+            lits.push_back(v[i]);
+            i++;
+        }
+    }
+    flush_lits();
+}
+
+static void pq_plain(const pq_column &c, size_t idx, std::string &out) {
+    if (c.type == PQ_INT32) {
+        put_u32(out, (uint32_t)c.ints[idx]);
+    } else if (c.type == PQ_INT64) {
+        put_u64(out, (uint64_t)c.ints[idx]);
+    } else if (c.type == PQ_BYTE_ARRAY) {
+        put_u32(out, c.bins[idx].size());
+        out.append(c.bins[idx]);
+    } else {
+        out.append(c.bins[idx]);
+    }
+}
+
+static std::string gzip_page(const std::string &in) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // windowBits 15 + 16: gzip wrapper, as required by parquet GZIP codec
+    deflateInit2(&zs, 1, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    std::string out(deflateBound(&zs, in.size()), 0);
+    zs.next_in = (Bytef *)in.data();
+    zs.avail_in = in.size();
+    zs.next_out = (Bytef *)&out[0];
+    zs.avail_out = out.size();
+    deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return out;
+}
+
+class parquet_writer {
+public:
+    parquet_writer() : f(NULL), offset(0), rg_rows(0), rg_bytes(0), total_rows(0) {
+        static const struct { const char *name; int type; int len; int optional; int conv; } schema[] = {
+            {"id", PQ_INT64, 0, 0, -1},
+            {"timestamp", PQ_INT64, 0, 0, -1},
+            {"host", PQ_FIXED_LEN_BYTE_ARRAY, 16, 1, -1},
+            {"message", PQ_BYTE_ARRAY, 0, 0, PQ_CONVERTED_UTF8},
+            {"pid", PQ_INT32, 0, 1, -1},
+            {"uid", PQ_INT32, 0, 1, -1},
+            {"repeat", PQ_INT32, 0, 1, -1},
+            {"last_timestamp", PQ_INT64, 0, 1, -1},
+        };
+        for (size_t i = 0; i < sizeof(schema) / sizeof(schema[0]); i++) {
+            pq_column c = pq_column();
+            c.name = schema[i].name;
+            c.type = schema[i].type;
+            c.type_length = schema[i].len;
+            c.optional = schema[i].optional;
+            c.converted_type = schema[i].conv;
+            cols.push_back(c);
+        }
+    }
+
+    int open(const char *path) {
+        f = fopen(path, "wb");
+        if (f == NULL)
+            return -1;
+        write_raw("PAR1", 4);
+        return 0;
+    }
+
+    void add(const logentry &e) {
+        bool local = e.pid >= 0;
+        add_int(cols[0], true, total_rows + rg_rows + 1);
+        add_int(cols[1], true, e.ts);
+        add_bin(cols[2], !local, std::string((const char *)e.host.a, 16));
+        add_bin(cols[3], true, e.msg);
+        add_int(cols[4], local, e.pid);
+        add_int(cols[5], local, e.uid);
+        add_int(cols[6], e.repeat > 1, e.repeat);
+        add_int(cols[7], e.repeat > 1, e.last_ts);
+        rg_rows++;
+        rg_bytes += e.msg.size() + 64;
+        if (rg_bytes >= PQ_ROW_GROUP_BYTES)
+            flush_row_group();
+    }
+
+    /*
+        * Finish file, return 0 on success
+    */
+    int close() {
+        flush_row_group();
+        thrift_compact t;
+        t.begin();
+        t.i32(1, 1);
+        t.list(2, 12, cols.size() + 1);
+        t.begin();
+        t.binary(4, "schema");
+        t.i32(5, cols.size());
+        t.end();
+        for (size_t i = 0; i < cols.size(); i++) {
+            t.begin();
+            t.i32(1, cols[i].type);
+            if (cols[i].type_length)
+                t.i32(2, cols[i].type_length);
+            t.i32(3, cols[i].optional ? 1 : 0);
+            t.binary(4, cols[i].name);
+            if (cols[i].converted_type >= 0)
+                t.i32(6, cols[i].converted_type);
+            t.end();
+        }
+        t.i64(3, total_rows);
+        t.list(4, 12, row_groups.size());
+        for (size_t i = 0; i < row_groups.size(); i++)
+            t.buf.append(row_groups[i]);
+        t.binary(6, "logcollectd " VERSION);
+        // TypeDefinedOrder for every column, readers ignore min/max statistics without it
+        t.list(7, 12, cols.size());
+        for (size_t i = 0; i < cols.size(); i++) {
+            t.begin();
+            t.structure(1);
+            t.end();
+            t.end();
+        }
+        t.end();
+        write_raw(t.buf.data(), t.buf.size());
+        std::string tail;
+        put_u32(tail, t.buf.size());
+        tail.append("PAR1");
+        write_raw(tail.data(), tail.size());
+        int err = ferror(f);
+        if (fclose(f) != 0)
+            err = 1;
+        f = NULL;
+        return err ? -1 : 0;
+    }
+
+private:
+    void add_int(pq_column &c, bool def, int64_t v) {
+        c.defined.push_back(def);
+        if (def)
+            c.ints.push_back(v);
+    }
+
+    void add_bin(pq_column &c, bool def, const std::string &v) {
+        c.defined.push_back(def);
+        if (def)
+            c.bins.push_back(v);
+    }
 
-#define VERSION "0.1a"
+    void write_raw(const void *p, size_t len) {
+        fwrite(p, 1, len, f);
+        offset += len;
+    }
 
-// queue will contain timestamp, host, message
-std::queue <std::tuple<int, std::string, std::string>> queue;
+    void write_page(int type, int nvalues, int encoding, const std::string &raw, pq_column &c) {
+        std::string comp = gzip_page(raw);
+        thrift_compact h;
+        h.begin();
+        h.i32(1, type);
+        h.i32(2, raw.size());
+        h.i32(3, comp.size());
+        if (type == PQ_DICTIONARY_PAGE) {
+            h.structure(7);
+            h.i32(1, nvalues);
+            h.i32(2, encoding);
+            h.end();
+        } else {
+            h.structure(5);
+            h.i32(1, nvalues);
+            h.i32(2, encoding);
+            h.i32(3, PQ_RLE);
+            h.i32(4, PQ_RLE);
+            h.end();
+        }
+        h.end();
+        c.size_uncompressed += h.buf.size() + raw.size();
+        c.size_compressed += h.buf.size() + comp.size();
+        write_raw(h.buf.data(), h.buf.size());
+        write_raw(comp.data(), comp.size());
+    }
 
-void init_new_db() {
-    const char *sql = "CREATE TABLE IF NOT EXISTS log (id INTEGER PRIMARY KEY AUTOINCREMENT, timestamp INTEGER, host TEXT, message TEXT);";
-    char *err_msg = 0;
-    int rc = sqlite3_exec(fd.db, sql, 0, 0, &err_msg);
-    if (rc != SQLITE_OK ) {
-        fprintf(stderr, "SQL error: %s\n", err_msg);
-        sqlite3_free(err_msg);
+    void write_column(pq_column &c) {
+        size_t nvals = c.type == PQ_INT32 || c.type == PQ_INT64 ? c.ints.size() : c.bins.size();
+        std::vector<uint32_t> idx(nvals);
+        std::string dict;
+        size_t ndict = 0;
+
+        c.offset = offset;
+        c.size_uncompressed = c.size_compressed = 0;
+        c.dict_offset = -1;
+        c.min = INT64_MAX;
+        c.max = INT64_MIN;
+        for (size_t i = 0; i < c.ints.size(); i++) {
+            if (c.ints[i] < c.min)
+                c.min = c.ints[i];
+            if (c.ints[i] > c.max)
+                c.max = c.ints[i];
+        }
+
+        // dictionary, abandoned when column is too diverse
+        c.dict_used = strcmp(c.name, "id") != 0;
+        if (c.dict_used) {
+            std::unordered_map<std::string, uint32_t> map;
+            std::string key;
+            for (size_t i = 0; i < nvals && c.dict_used; i++) {
+                key.clear();
+                pq_plain(c, i, key);
+                auto it = map.find(key);
+                if (it == map.end()) {
+                    it = map.emplace(key, ndict++).first;
+                    dict.append(key);
+                    if (ndict > PQ_DICT_MAX_ENTRIES || dict.size() > PQ_DICT_MAX_BYTES)
+                        c.dict_used = false;
+                }
+                idx[i] = it->second;
+            }
+        }
+        if (c.dict_used) {
+            c.dict_offset = offset;
+            write_page(PQ_DICTIONARY_PAGE, ndict, PQ_PLAIN_DICTIONARY, dict, c);
+        }
+        c.data_offset = offset;
+
+        int width = 0;
+        while (c.dict_used && ((size_t)1 << width) < ndict)
+            width++;
+        size_t row = 0, val = 0;
+        while (row < c.defined.size()) {
+            size_t nrows = std::min((size_t)PQ_PAGE_ROWS, c.defined.size() - row);
+            std::string page;
+            size_t first = val;
+            if (c.optional) {
+                std::vector<uint32_t> levels(c.defined.begin() + row, c.defined.begin() + row + nrows);
+                std::string rle;
+                rle_hybrid(levels, 1, rle);
+                put_u32(page, rle.size());
+                page.append(rle);
+            }
+            for (size_t r = row; r < row + nrows; r++)
+                val += c.defined[r];
+            if (c.dict_used) {
+                std::vector<uint32_t> pidx(idx.begin() + first, idx.begin() + val);
+                page.push_back((char)width);
+                rle_hybrid(pidx, width, page);
+            } else {
+                for (size_t i = first; i < val; i++)
+                    pq_plain(c, i, page);
+            }
+            write_page(PQ_DATA_PAGE, nrows, c.dict_used ? PQ_PLAIN_DICTIONARY : PQ_PLAIN, page, c);
+            row += nrows;
+        }
     }
-}
 
-int open_listener(int port) {
-    int sock;
-    struct sockaddr_in name;
+    void flush_row_group() {
+        if (rg_rows == 0)
+            return;
+        thrift_compact t;
+        int64_t total = 0;
+        t.begin();
+        t.list(1, 12, cols.size());
+        for (size_t i = 0; i < cols.size(); i++) {
+            pq_column &c = cols[i];
+            write_column(c);
+            total += c.size_uncompressed;
+            t.begin();
+            t.i64(2, c.offset);
+            t.structure(3);
+            t.i32(1, c.type);
+            t.list(2, 5, c.dict_used ? 3 : 2);
+            t.elem_i32(PQ_RLE);
+            t.elem_i32(PQ_PLAIN);
+            if (c.dict_used)
+                t.elem_i32(PQ_PLAIN_DICTIONARY);
+            t.list(3, 8, 1);
+            t.elem_binary(c.name);
+            t.i32(4, PQ_GZIP);
+            t.i64(5, c.defined.size());
+            t.i64(6, c.size_uncompressed);
+            t.i64(7, c.size_compressed);
+            t.i64(9, c.data_offset);
+            if (c.dict_used)
+                t.i64(11, c.dict_offset);
+            if (!c.ints.empty()) {
+                // min/max statistics let readers skip row groups by time
+                std::string mn, mx;
+                if (c.type == PQ_INT32) {
+                    put_u32(mn, (uint32_t)c.min);
+                    put_u32(mx, (uint32_t)c.max);
+                } else {
+                    put_u64(mn, (uint64_t)c.min);
+                    put_u64(mx, (uint64_t)c.max);
+                }
+                t.structure(12);
+                t.binary(5, mx);
+                t.binary(6, mn);
+                t.end();
+            }
+            t.end();
+            t.end();
+            c.defined.clear();
+            c.ints.clear();
+            c.bins.clear();
+        }
+        t.i64(2, total);
+        t.i64(3, rg_rows);
+        t.end();
+        // row group struct is emitted inside FileMetaData list at close()
+        row_groups.push_back(t.buf);
+        total_rows += rg_rows;
+        rg_rows = 0;
+        rg_bytes = 0;
+    }
 
-    sock = socket(PF_INET, SOCK_DGRAM, 0);
-    if (sock < 0) {
-        perror("opening datagram socket");
-        exit(EXIT_FAILURE);
+    FILE *f;
+    int64_t offset;
+    int64_t rg_rows;
+    size_t rg_bytes;
+    int64_t total_rows;
+    std::vector<pq_column> cols;
+    std::vector<std::string> row_groups;
+};
+
+/*
+    * Convert closed period file to parquet next to it
+    * Return 0 on success, -1 on error
+*/
+int export_parquet(const std::string &path) {
+    std::string out = path.substr(0, path.rfind('.')) + ".parquet";
+    std::string tmp = out + ".tmp";
+    parquet_writer pw;
+    if (pw.open(tmp.c_str()) < 0) {
+        fprintf(stderr, "Can't create %s: %s\n", tmp.c_str(), strerror(errno));
+        return -1;
+    }
+    int rc = for_each_row(path, [&](const logentry &e) {
+        pw.add(e);
+    });
+    if (pw.close() < 0 || rc < 0 || rename(tmp.c_str(), out.c_str()) < 0) {
+        fprintf(stderr, "Parquet export of %s failed\n", path.c_str());
+        unlink(tmp.c_str());
+        return -1;
     }
+    if (config.verbose)
+        printf("Exported %s\n", out.c_str());
+    return 0;
+}
 
-    name.sin_family = AF_INET;
-    name.sin_port = htons(port);
-    name.sin_addr.s_addr = htonl(INADDR_ANY);
-    if (bind(sock, (struct sockaddr *)&name, sizeof(name)) < 0) {
-        perror("binding datagram socket");
-        exit(EXIT_FAILURE);
+/*
+    * Per-file Bloom filter over hosts and message tokens
+    *
+    * Sidecar YYYYMMDDHH.filter is built when hour is closed:
+    *   "LCBF0001", u64 bits, u32 hash count, u64 keys, bit array
+    * Keys are 64-bit hashes of host address and of each message token, deduplicated
+    * before sizing filter at FILTER_BITS_PER_KEY (about 1% false positives).
+*/
+#define FILTER_MAGIC "LCBF0001"
+#define FILTER_BITS_PER_KEY 10
+#define FILTER_HASHES 7
+#define FILTER_COMPACT (8 * 1024 * 1024)
+
+static uint64_t filter_hash(char kind, const void *p, size_t len) {
+    // FNV-1a with murmur finalizer, kind separates host and token keys
+    uint64_t h = 0xcbf29ce484222325ULL;
+    h = (h ^ (uint8_t)kind) * 0x100000001b3ULL;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ ((const uint8_t *)p)[i]) * 0x100000001b3ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+std::string filter_path(const std::string &path) {
+    return path.substr(0, path.rfind('.')) + ".filter";
+}
+
+static void filter_compact(std::vector<uint64_t> &keys) {
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+}
+
+/*
+    * Build filter sidecar for closed period file
+    * Return 0 on success, -1 on error
+*/
+int build_filter(const std::string &path) {
+    std::vector<uint64_t> keys;
+    size_t compacted = 0;
+    int rc = for_each_row(path, [&](const logentry &e) {
+        if (e.pid < 0)
+            keys.push_back(filter_hash('h', e.host.a, 16));
+        for_each_token(e.msg.data(), e.msg.size(), [&](const char *t, size_t len) {
+            keys.push_back(filter_hash('t', t, len));
+        });
+        // bound memory to distinct keys, not token occurrences
+        if (keys.size() - compacted > FILTER_COMPACT) {
+            filter_compact(keys);
+            compacted = keys.size();
+        }
+    });
+    if (rc < 0) {
+        fprintf(stderr, "Filter build for %s failed\n", path.c_str());
+        return -1;
     }
+    filter_compact(keys);
 
-    // increase buffer size
-    int optval = 262144;
-    socklen_t optlen = sizeof(optval);
-    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &optval, optlen) < 0) {
-        perror("setsockopt"); // soft-failure
+    uint64_t nbits = std::max((uint64_t)keys.size() * FILTER_BITS_PER_KEY, (uint64_t)64);
+    nbits = (nbits + 63) & ~63ULL;
+    std::vector<uint64_t> bits(nbits / 64, 0);
+    for (size_t i = 0; i < keys.size(); i++) {
+        uint64_t h1 = keys[i], h2 = (keys[i] >> 32) | (keys[i] << 32);
+        for (int k = 0; k < FILTER_HASHES; k++) {
+            uint64_t bit = (h1 + k * h2) % nbits;
+            bits[bit / 64] |= 1ULL << (bit % 64);
+        }
     }
 
-    return sock;
+    std::string out = filter_path(path), tmp = out + ".tmp", hdr(FILTER_MAGIC);
+    put_u64(hdr, nbits);
+    put_u32(hdr, FILTER_HASHES);
+    put_u64(hdr, keys.size());
+    for (size_t i = 0; i < bits.size(); i++)
+        put_u64(hdr, bits[i]);
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (f == NULL || fwrite(hdr.data(), 1, hdr.size(), f) != hdr.size() || fclose(f) != 0 ||
+        rename(tmp.c_str(), out.c_str()) < 0) {
+        fprintf(stderr, "Can't write %s: %s\n", out.c_str(), strerror(errno));
+        unlink(tmp.c_str());
+        return -1;
+    }
+    if (config.verbose)
+        printf("Filter %s: %zu keys, %llu bytes\n", out.c_str(), keys.size(), (unsigned long long)nbits / 8);
+    return 0;
 }
 
 /*
-    * Check if dbfile needs to be updated
-    * If yes, close current db and open new one
+    * Check filter sidecar of file: host (optional) and all tokens must be present
+    * Return 0 if file certainly has no match, 1 if it may (or there is no filter)
 */
-void dbtimecheck(int *current_hour, char *dbfile) {
-    time_t now = time(NULL);
-    if (*current_hour != localtime(&now)->tm_hour) {
-        *current_hour = localtime(&now)->tm_hour;
-        sprintf(dbfile, "%s/%04d%02d%02d%02d.sqlite3", config.dbdir,
-                localtime(&now)->tm_year + 1900, localtime(&now)->tm_mon + 1,
-                localtime(&now)->tm_mday, localtime(&now)->tm_hour);
-        if (config.verbose) {
-            printf("dbfile: %s\n", dbfile);
+int filter_may_match(const std::string &path, const hostaddr *host, const std::vector<std::string> &tokens) {
+    if (host == NULL && tokens.empty())
+        return 1;
+    FILE *f = fopen(filter_path(path).c_str(), "rb");
+    if (f == NULL)
+        return 1;
+    uint8_t hdr[28];
+    if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr) || memcmp(hdr, FILTER_MAGIC, 8) != 0) {
+        fclose(f);
+        return 1;
+    }
+    uint64_t nbits = get_u64(hdr + 8);
+    uint32_t nhashes = get_u32(hdr + 16);
+    std::vector<uint64_t> keys;
+    if (host != NULL)
+        keys.push_back(filter_hash('h', host->a, 16));
+    for (size_t i = 0; i < tokens.size(); i++)
+        keys.push_back(filter_hash('t', tokens[i].data(), tokens[i].size()));
+
+    int match = 1;
+    for (size_t i = 0; i < keys.size() && match; i++) {
+        uint64_t h1 = keys[i], h2 = (keys[i] >> 32) | (keys[i] << 32);
+        for (uint32_t k = 0; k < nhashes && match; k++) {
+            uint64_t bit = (h1 + k * h2) % nbits;
+            uint8_t byte;
+            // probe single bytes, filter of a busy hour is not worth reading whole
+            if (fseek(f, sizeof(hdr) + bit / 8, SEEK_SET) != 0 || fread(&byte, 1, 1, f) != 1)
+                break;
+            if (!(byte & (1 << (bit % 8))))
+                match = 0;
         }
-        if (fd.db != 0) {
-            sqlite3_close(fd.db);
+    }
+    fclose(f);
+    return match;
+}
+
+/*
+    * Background worker for closed hours, writer only enqueues file names
+*/
+struct {
+    std::deque<std::string> files;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} hour_worker;
+
+void *hour_worker_thread(void *arg) {
+    (void)arg;
+    numa_bind(-1);
+    while (1) {
+        pthread_mutex_lock(&hour_worker.lock);
+        while (hour_worker.files.empty())
+            pthread_cond_wait(&hour_worker.cond, &hour_worker.lock);
+        std::string path = hour_worker.files.front();
+        hour_worker.files.pop_front();
+        pthread_mutex_unlock(&hour_worker.lock);
+        if (config.filter) {
+            build_filter(path);
+            usage_update(filter_path(path));
         }
-        if (sqlite3_open(dbfile, &fd.db) != SQLITE_OK) {
-            fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(fd.db));
-            sqlite3_close(fd.db);
-            exit(EXIT_FAILURE);
+        if (config.parquet) {
+            export_parquet(path);
+            usage_update(path.substr(0, path.rfind('.')) + ".parquet");
         }
-        init_new_db();
     }
+    return NULL;
+}
+
+void hour_worker_start() {
+    pthread_t tid;
+    pthread_mutex_init(&hour_worker.lock, NULL);
+    pthread_cond_init(&hour_worker.cond, NULL);
+    pthread_create(&tid, NULL, hour_worker_thread, NULL);
 }
 
 /*
-    * Insert message into db
+    * Hooks run after writer closed period file
+*/
+void hour_closed(const char *path) {
+    if (!config.parquet && !config.filter)
+        return;
+    pthread_mutex_lock(&hour_worker.lock);
+    hour_worker.files.push_back(path);
+    pthread_cond_signal(&hour_worker.cond);
+    pthread_mutex_unlock(&hour_worker.lock);
+}
+
+/*
+    * Query mode: print matching rows from hourly files
     * Return 0 on success, 1 on error
 */
-int insert_db(char *remote, char *msg, int ts) {
-    const char *sql = "INSERT INTO log (timestamp, host, message) VALUES (?, ?, ?);";
-    char *err_msg = 0;
-    sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v2(fd.db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", err_msg);
-        sqlite3_free(err_msg);
+int query_db() {
+    hostaddr host;
+    if (config.query_host != NULL && host_pton(config.query_host, &host) < 0) {
+        fprintf(stderr, "Invalid host %s\n", config.query_host);
         return 1;
     }
-    sqlite3_bind_int(stmt, 1, ts);
-    sqlite3_bind_text(stmt, 2, remote, strlen(remote), SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 3, msg, strlen(msg), SQLITE_STATIC);
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "SQL error: %s\n", err_msg);
-        sqlite3_free(err_msg);
-        return 1;
+    std::vector<std::string> needed;
+    // only indexed tokens can rule a file out, "ab" or "a:b" prune nothing
+    if (config.query_token != NULL)
+        for_each_token(config.query_token, strlen(config.query_token), [&](const char *t, size_t tlen) {
+            needed.push_back(std::string(t, tlen));
+        });
+    if (config.query_grep != NULL)
+        grep_tokens(config.query_grep, needed);
+
+    std::vector<std::string> files = list_dbfiles(config.query_from, config.query_to);
+    std::vector<std::vector<std::string> > groups = dbfile_groups(files);
+    if (config.query_volume) {
+        for (size_t i = 0; i < groups.size(); i++) {
+            // rollups are kept by sqlite backend only
+            if (ends_with(groups[i][0], ".sqlite3")) {
+                for (size_t j = 0; j < groups[i].size(); j++)
+                    groups[i][j] = std::string(config.dbdir) + "/" + groups[i][j];
+                query_volume(groups[i], &host);
+            }
+        }
+        return 0;
     }
-    sqlite3_finalize(stmt);
+    if (config.query_patterns) {
+        std::unordered_map<std::string, int64_t> counts;
+        for (size_t i = 0; i < files.size(); i++) {
+            if (ends_with(files[i], ".sqlite3"))
+                query_patterns(std::string(config.dbdir) + "/" + files[i], counts);
+        }
+        std::vector<std::pair<int64_t, std::string> > sorted;
+        for (auto it = counts.begin(); it != counts.end(); ++it)
+            sorted.push_back(std::make_pair(it->second, it->first));
+        std::sort(sorted.rbegin(), sorted.rend());
+        for (size_t i = 0; i < sorted.size(); i++)
+            printf("%lld %s\n", (long long)sorted[i].first, sorted[i].second.c_str());
+        return 0;
+    }
+    int skipped = 0;
+    for (size_t i = 0; i < groups.size(); i++) {
+        std::vector<std::string> paths;
+        for (size_t j = 0; j < groups[i].size(); j++) {
+            std::string path = std::string(config.dbdir) + "/" + groups[i][j];
+            if (!filter_may_match(path, config.query_host != NULL ? &host : NULL, needed)) {
+                skipped++;
+                continue;
+            }
+            paths.push_back(path);
+        }
+        if (paths.empty())
+            continue;
+        if (ends_with(paths[0], ".seg"))
+            query_segment(paths[0], &host);
+        else
+            query_sqlite(paths, &host);
+    }
+    if (config.verbose)
+        fprintf(stderr, "%zu files, %d skipped by filter\n", files.size(), skipped);
     return 0;
+}
+
+/*
+    * Binary upgrade over control socket
+    * New process connects to --upgrade-socket of running one and gets its
+    * listening sockets (SCM_RIGHTS). Old process stops receiving, stores its
+    * queues and dedup runs, spills relay queues to backlog, then sends one
+    * byte and exits; until then new process only holds what it receives.
+    * Kernel keeps sockets bound all the time, so no datagram is refused.
+*/
+#define HANDOFF_RELAY_WAIT 10
 
+// message carries number of UDP sockets and whether unix socket follows
+struct handoff_hdr {
+    int nsocks;
+    int unixsock;
+};
+
+/*
+    * Take over listeners of running process
+    * Return 0 when sockets were received, -1 if nobody listens (fresh start)
+*/
+int handoff_takeover(const char *path) {
+    struct sockaddr_un name;
+    if (strlen(path) >= sizeof(name.sun_path)) {
+        fprintf(stderr, "Unix socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("opening upgrade socket");
+        exit(EXIT_FAILURE);
+    }
+    memset(&name, 0, sizeof(name));
+    name.sun_family = AF_UNIX;
+    strcpy(name.sun_path, path);
+    if (connect(sock, (struct sockaddr *)&name, sizeof(name)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    handoff_hdr hdr;
+    char cbuf[CMSG_SPACE(sizeof(int) * (MAX_LISTENERS + 1))];
+    struct iovec iov = { &hdr, sizeof(hdr) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(hdr)) {
+        fprintf(stderr, "Upgrade handshake on %s failed\n", path);
+        exit(EXIT_FAILURE);
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    int nfds = hdr.nsocks + (hdr.unixsock ? 1 : 0);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || hdr.nsocks > MAX_LISTENERS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * nfds)) {
+        fprintf(stderr, "Upgrade handshake on %s: no sockets received\n", path);
+        exit(EXIT_FAILURE);
+    }
+    int *fds = (int *)CMSG_DATA(cmsg);
+    fd.nsocks = hdr.nsocks;
+    for (int i = 0; i < hdr.nsocks; i++)
+        fd.socks[i] = fds[i];
+    fd.unixsock = hdr.unixsock ? fds[hdr.nsocks] : -1;
+    handoff.peer = sock;
+    printf("Took over %d listeners from running process, waiting for it to drain\n", nfds);
+    return 0;
 }
 
 /*
-    * Compress old db files
+    * Accept upgrade of running process on control socket
 */
-void cleanup() {
-    // Iterate over files, convert filename to timestamp, xz compress older than 1 day
-    DIR *dir;
-    struct dirent *ent;
-    while ((ent = readdir(dir)) != NULL) {
-        // file pattern is YYYYMMDDHH.sqlite3
-        if (strlen(ent->d_name) != 14)
-            continue;
-        // convert to timestamp
-        struct tm tm;
-        memset(&tm, 0, sizeof(tm));
-        strptime(ent->d_name, "%Y%m%d%H.sqlite3", &tm);
-        time_t filetime = mktime(&tm);
-        // check if older than 1 day
-        time_t now = time(NULL);
-        if (now - filetime < config.compress_age) {
-            continue;
-        }
-        // compress
-        {
-            char cmd[1024];
-            printf("Compressing %s/%s\n", config.dbdir, ent->d_name);
-            sprintf(cmd, "xz -1 %s/%s", config.dbdir, ent->d_name);
-            system(cmd);
-        }
+void handoff_listen(const char *path) {
+    struct sockaddr_un name;
+    handoff.ctl = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (handoff.ctl < 0) {
+        perror("opening upgrade socket");
+        exit(EXIT_FAILURE);
     }
-    closedir(dir);
+    memset(&name, 0, sizeof(name));
+    name.sun_family = AF_UNIX;
+    strcpy(name.sun_path, path);
+    unlink(path);
+    if (bind(handoff.ctl, (struct sockaddr *)&name, sizeof(name)) < 0 || listen(handoff.ctl, 1) < 0) {
+        perror("binding upgrade socket");
+        exit(EXIT_FAILURE);
+    }
+    chmod(path, 0600);
+    if (config.verbose)
+        printf("Upgrade socket %s\n", path);
 }
 
-void *db_thread(void *arg) {
-    printf("db_thread() started\n");
-    char dbfile[1024] = {0};
-    int current_hour = -1;
-    // initial dbfile
-    dbtimecheck(&current_hour, dbfile);
-    while (1) {
-        // check if dbfile needs to be updated
-        dbtimecheck(&current_hour, dbfile);
-        // check if queue is empty
-        if (queue.empty()) {
+/*
+    * Hand listeners to new process, drain and exit
+    * Returns only if handoff failed before sockets were sent
+*/
+void handoff_serve() {
+    int peer = accept4(handoff.ctl, NULL, NULL, SOCK_CLOEXEC);
+    if (peer < 0) {
+        perror("accept upgrade");
+        return;
+    }
+    handoff_hdr hdr;
+    hdr.nsocks = fd.nsocks;
+    hdr.unixsock = fd.unixsock >= 0;
+    int nfds = fd.nsocks + hdr.unixsock;
+    char cbuf[CMSG_SPACE(sizeof(int) * (MAX_LISTENERS + 1))];
+    memset(cbuf, 0, sizeof(cbuf));
+    struct iovec iov = { &hdr, sizeof(hdr) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    int *fds = (int *)CMSG_DATA(cmsg);
+    for (int i = 0; i < fd.nsocks; i++)
+        fds[i] = fd.socks[i];
+    if (hdr.unixsock)
+        fds[fd.nsocks] = fd.unixsock;
+    if (sendmsg(peer, &msg, MSG_NOSIGNAL) != sizeof(hdr)) {
+        perror("sending listeners");
+        close(peer);
+        return;
+    }
+    printf("Listeners handed to new process, draining\n");
+
+    // new process reads sockets from now on, XDP frames already received are kept
+    if (config.xdp_ifname != NULL) {
+        for (int i = 0; i < xdp.nqueues; i++)
+            xdp_receive(i);
+        xdp_close();
+    }
+    for (int i = 0; i < fd.nsocks; i++)
+        close(fd.socks[i]);
+    if (fd.unixsock >= 0)
+        close(fd.unixsock);
+    close(handoff.ctl);
+    if (dedup.table != NULL) {
+        for (int i = 0; i < DEDUP_HOSTS; i++)
+            while (dedup.table[i].nruns > 0)
+                dedup_flush_run(&dedup.table[i], 0);
+    }
+
+    handoff.draining = 1;
+    for (int i = 0; i < stores.n; i++)
+        while (!stores.list[i].stopped)
             usleep(1000);
-            continue;
-        }
-        // get first element from queue
-        std::tuple<int, std::string, std::string> element = queue.front();
-        queue.pop();
-        // insert into db
-        {
-            int ts = std::get<0>(element);
-            char *remote = strdup(std::get<1>(element).c_str());
-            char *msg = strdup(std::get<2>(element).c_str());        
-            insert_db(remote, msg, ts);
+    if (config.journal) {
+        handoff.journal_stop = 1;
+        while (!handoff.journal_done)
+            usleep(1000);
+    }
+    for (int wait = 0; wait < HANDOFF_RELAY_WAIT * 1000; wait++) {
+        int active = 0;
+        for (int i = 0; i < relay.n; i++)
+            active |= relay.list[i].active;
+        if (!active)
+            break;
+        usleep(1000);
+    }
+    char done = 1;
+    if (write(peer, &done, 1) != 1)
+        perror("upgrade notify");
+    close(peer);
+    printf("Drained, exiting\n");
+    exit(EXIT_SUCCESS);
+}
+
+/*
+    * Start writers and everything else that owns store or relay files,
+    * or the XDP hook of the interface
+*/
+void start_services() {
+    // workers inherit blocked SIGHUP, only receiver thread takes it
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+    for (int i = 0; i < stores.n; i++)
+        if (config.journal)
+            journal_recover(&stores.list[i]);
+    if (config.parquet || config.filter)
+        hour_worker_start();
+    // template mining, writer fans batches out to miner pool
+    if (config.templates) {
+        if (config.template_workers <= 0)
+            config.template_workers = 2;
+        miner_start();
+    }
+    if (config.tail_path != NULL)
+        tail_start(config.tail_path);
+    if (config.nforward > 0 || config.forward_file != NULL)
+        relay_start();
+
+    // create db thread per store, and housekeeping of store directories
+    for (int i = 0; i < stores.n; i++) {
+        pthread_t db_thread_id;
+        pthread_create(&db_thread_id, NULL, db_thread, &stores.list[i]);
+    }
+    pthread_t cleanup_thread_id;
+    pthread_create(&cleanup_thread_id, NULL, cleanup_thread, NULL);
+    // records not in database are queued again, new ones wait behind them
+    if (config.journal) {
+        pthread_t journal_thread_id;
+        pthread_create(&journal_thread_id, NULL, journal_thread, NULL);
+        for (int i = 0; i < stores.n; i++) {
+            pthread_t replay_thread_id;
+            pthread_create(&replay_thread_id, NULL, journal_replay, &stores.list[i]);
         }
     }
+    if (config.xdp_ifname != NULL)
+        xdp_open(config.xdp_ifname, config.xdp_queues);
+    if (config.upgrade_path != NULL)
+        handoff_listen(config.upgrade_path);
+    pthread_sigmask(SIG_UNBLOCK, &hup, NULL);
+}
+
+/*
+    * Previous process is drained (or gone), messages held meanwhile are stored
+*/
+void handoff_ready() {
+    char done;
+    if (read(handoff.peer, &done, 1) != 1)
+        fprintf(stderr, "Previous process exited without finishing handoff\n");
+    close(handoff.peer);
+    handoff.peer = -1;
+    printf("Previous process drained, %zu messages received meanwhile, %llu dropped\n", handoff.pending.size(),
+           (unsigned long long)handoff.dropped);
+    start_services();
+    while (!handoff.pending.empty()) {
+        logentry e = std::move(handoff.pending.front());
+        handoff.pending.pop_front();
+        enqueue(e);
+    }
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d dbdir] [-p port] [-l addr[:port]]... [-u unixpath] [-v]\n", prog);
+    fprintf(stderr, "       [--ratelimit msgs/s] [--ratelimit-burst n] [--ratelimit-table n]\n");
+    fprintf(stderr, "       [--dedup] [--dedup-window n] [--dedup-delay sec] [--stats-file path]\n");
+    fprintf(stderr, "       [--storage sqlite|segment] [--parquet] [--compress-messages] [--filter]\n");
+    fprintf(stderr, "       [--tail-socket path] [--templates] [--template-workers n] [--rules file]\n");
+    fprintf(stderr, "       [--store name,dir=path[,interval=1h][,max-size=n][,retention=d][,compress-age=d][,quota=n][,archive=path][,shards=n]]...\n");
+    fprintf(stderr, "       [--forward udp|tcp://host:port]... [--forward-file file] [--forward-mode all|hash]\n");
+    fprintf(stderr, "       [--forward-backlog dir] [--journal] [--upgrade-socket path] [--shards n] [--numa]\n");
+    fprintf(stderr, "       [--xdp ifname[:queues]] [--socket-filter severity<=s,facility=f,net=cidr]\n");
+    fprintf(stderr, "       [--rcvbuf-max bytes]\n");
+    fprintf(stderr, "       %s --export-parquet dbfile | --build-filter dbfile\n", prog);
+    fprintf(stderr, "       %s -q [-d dbdir] [-H host] [-g substring] [--token word] [-F YYYYMMDDHH] [-T YYYYMMDDHH]\n", prog);
+    fprintf(stderr, "       %s -q --volume [-d dbdir] [-H host] [-F YYYYMMDDHH] [-T YYYYMMDDHH]\n", prog);
+    fprintf(stderr, "       %s -q --patterns [-d dbdir] [-F YYYYMMDDHH] [-T YYYYMMDDHH]\n", prog);
 }
 
 
+// tests include this file for its internals and bring their own main
+#ifndef LOGCOLLECTD_NO_MAIN
 int main(int argc, char *argv[]) {
     int c;
+    clock_gettime(CLOCK_MONOTONIC, &startup_time);
     memset(&config, 0, sizeof(config));
     memset(&fd, 0, sizeof(fd));
+    handoff.ctl = handoff.peer = -1;
+
+    static struct option long_options[] = {
+        {"dbdir", required_argument, 0, 'd'},
+        {"port", required_argument, 0, 'p'},
+        {"listen", required_argument, 0, 'l'},
+        {"unix", required_argument, 0, 'u'},
+        {"ratelimit", required_argument, 0, OPT_RATELIMIT},
+        {"ratelimit-burst", required_argument, 0, OPT_RATELIMIT_BURST},
+        {"ratelimit-table", required_argument, 0, OPT_RATELIMIT_TABLE},
+        {"dedup", no_argument, 0, OPT_DEDUP},
+        {"dedup-window", required_argument, 0, OPT_DEDUP_WINDOW},
+        {"dedup-delay", required_argument, 0, OPT_DEDUP_DELAY},
+        {"stats-file", required_argument, 0, OPT_STATS_FILE},
+        {"storage", required_argument, 0, OPT_STORAGE},
+        {"parquet", no_argument, 0, OPT_PARQUET},
+        {"export-parquet", required_argument, 0, OPT_EXPORT_PARQUET},
+        {"compress-messages", no_argument, 0, OPT_COMPRESS_MESSAGES},
+        {"filter", no_argument, 0, OPT_FILTER},
+        {"build-filter", required_argument, 0, OPT_BUILD_FILTER},
+        {"token", required_argument, 0, OPT_TOKEN},
+        {"tail-socket", required_argument, 0, OPT_TAIL_SOCKET},
+        {"volume", no_argument, 0, OPT_VOLUME},
+        {"templates", no_argument, 0, OPT_TEMPLATES},
+        {"template-workers", required_argument, 0, OPT_TEMPLATE_WORKERS},
+        {"patterns", no_argument, 0, OPT_PATTERNS},
+        {"rules", required_argument, 0, OPT_RULES},
+        {"store", required_argument, 0, OPT_STORE},
+        {"forward", required_argument, 0, OPT_FORWARD},
+        {"forward-backlog", required_argument, 0, OPT_FORWARD_BACKLOG},
+        {"forward-file", required_argument, 0, OPT_FORWARD_FILE},
+        {"forward-mode", required_argument, 0, OPT_FORWARD_MODE},
+        {"journal", no_argument, 0, OPT_JOURNAL},
+        {"upgrade-socket", required_argument, 0, OPT_UPGRADE_SOCKET},
+        {"shards", required_argument, 0, OPT_SHARDS},
+        {"numa", no_argument, 0, OPT_NUMA},
+        {"xdp", required_argument, 0, OPT_XDP},
+        {"socket-filter", required_argument, 0, OPT_SOCKET_FILTER},
+        {"rcvbuf-max", required_argument, 0, OPT_RCVBUF_MAX},
+        {"verbose", no_argument, 0, 'v'},
+        {"query", no_argument, 0, 'q'},
+        {"host", required_argument, 0, 'H'},
+        {"grep", required_argument, 0, 'g'},
+        {"from", required_argument, 0, 'F'},
+        {"to", required_argument, 0, 'T'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
 
-    while ((c = getopt(argc, argv, "d:p:vh")) != -1) {
+    while ((c = getopt_long(argc, argv, "d:p:l:u:vqH:g:F:T:h", long_options, NULL)) != -1) {
         switch (c) {
             case 'd':
                 config.dbdir = optarg;
@@ -206,23 +6941,194 @@ int main(int argc, char *argv[]) {
             case 'p':
                 config.port = atoi(optarg);
                 break;
+            case 'l':
+                if (config.nlisten == MAX_LISTENERS) {
+                    fprintf(stderr, "Too many listen addresses (max %d)\n", MAX_LISTENERS);
+                    exit(EXIT_FAILURE);
+                }
+                config.listen[config.nlisten++] = optarg;
+                break;
+            case 'u':
+                config.unix_path = optarg;
+                break;
             case 'v':
                 config.verbose = 1;
                 break;
+            case OPT_RATELIMIT:
+                config.ratelimit_rate = atof(optarg);
+                break;
+            case OPT_RATELIMIT_BURST:
+                config.ratelimit_burst = atof(optarg);
+                break;
+            case OPT_RATELIMIT_TABLE:
+                config.ratelimit_table = atoi(optarg);
+                break;
+            case OPT_STORAGE:
+                config.storage = optarg;
+                break;
+            case OPT_PARQUET:
+                config.parquet = 1;
+                break;
+            case OPT_COMPRESS_MESSAGES:
+#ifndef HAVE_ZSTD
+                fprintf(stderr, "--compress-messages: built without zstd support\n");
+                exit(EXIT_FAILURE);
+#endif
+                config.compress_messages = 1;
+                break;
+            case OPT_FILTER:
+                config.filter = 1;
+                break;
+            case OPT_BUILD_FILTER:
+                config.filter_file = optarg;
+                break;
+            case OPT_TAIL_SOCKET:
+                config.tail_path = optarg;
+                break;
+            case OPT_TOKEN:
+                config.query_token = optarg;
+                break;
+            case OPT_VOLUME:
+                config.query_volume = 1;
+                break;
+            case OPT_STORE:
+                if (config.nstores == MAX_STORES - 1) {
+                    fprintf(stderr, "Too many stores (max %d)\n", MAX_STORES);
+                    exit(EXIT_FAILURE);
+                }
+                config.stores[config.nstores++] = optarg;
+                break;
+            case OPT_FORWARD:
+                if (config.nforward == MAX_UPSTREAMS) {
+                    fprintf(stderr, "Too many upstreams (max %d)\n", MAX_UPSTREAMS);
+                    exit(EXIT_FAILURE);
+                }
+                config.forward[config.nforward++] = optarg;
+                break;
+            case OPT_FORWARD_BACKLOG:
+                config.forward_backlog = optarg;
+                break;
+            case OPT_FORWARD_FILE:
+                config.forward_file = optarg;
+                break;
+            case OPT_FORWARD_MODE:
+                if (strcmp(optarg, "hash") == 0) {
+                    config.forward_hash = 1;
+                } else if (strcmp(optarg, "all") != 0) {
+                    fprintf(stderr, "Unknown forward mode %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_JOURNAL:
+                config.journal = 1;
+                break;
+            case OPT_UPGRADE_SOCKET:
+                config.upgrade_path = optarg;
+                break;
+            case OPT_SHARDS:
+                config.shards = atoi(optarg);
+                if (config.shards < 1 || config.shards > MAX_SHARDS) {
+                    fprintf(stderr, "Shards must be 1..%d\n", MAX_SHARDS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_NUMA:
+                config.numa = 1;
+                break;
+            case OPT_SOCKET_FILTER:
+                config.socket_filter = optarg;
+                break;
+            case OPT_RCVBUF_MAX: {
+                long long size = parse_size(optarg);
+                if (size < RCVBUF_INITIAL || size > RCVBUF_LIMIT) {
+                    fprintf(stderr, "Receive buffer max must be %d..%d bytes\n", RCVBUF_INITIAL, RCVBUF_LIMIT);
+                    exit(EXIT_FAILURE);
+                }
+                config.rcvbuf_max = size;
+                break;
+            }
+            case OPT_XDP: {
+                config.xdp_ifname = optarg;
+                config.xdp_queues = 1;
+                char *colon = strchr(optarg, ':');
+                if (colon != NULL) {
+                    *colon = 0;
+                    config.xdp_queues = atoi(colon + 1);
+                }
+                if (config.xdp_queues < 1 || config.xdp_queues > XDP_MAX_QUEUES) {
+                    fprintf(stderr, "XDP queues must be 1..%d\n", XDP_MAX_QUEUES);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case OPT_RULES:
+                config.rules_file = optarg;
+                break;
+            case OPT_PATTERNS:
+                config.query_patterns = 1;
+                break;
+            case OPT_TEMPLATES:
+                config.templates = 1;
+                break;
+            case OPT_TEMPLATE_WORKERS:
+                config.template_workers = atoi(optarg);
+                break;
+            case OPT_EXPORT_PARQUET:
+                config.export_file = optarg;
+                break;
+            case OPT_STATS_FILE:
+                config.stats_file = optarg;
+                break;
+            case OPT_DEDUP:
+                config.dedup = 1;
+                break;
+            case OPT_DEDUP_WINDOW:
+                config.dedup_window = atoi(optarg);
+                break;
+            case OPT_DEDUP_DELAY:
+                config.dedup_delay = atoi(optarg);
+                break;
+            case 'q':
+                config.query = 1;
+                break;
+            case 'H':
+                config.query_host = optarg;
+                break;
+            case 'g':
+                config.query_grep = optarg;
+                break;
+            case 'F':
+                config.query_from = optarg;
+                break;
+            case 'T':
+                config.query_to = optarg;
+                break;
             case 'h':
-                fprintf(stderr, "Usage: %s [-d dbdir] [-p port] [-v]\n", argv[0]);
+                usage(argv[0]);
                 exit(EXIT_SUCCESS);
             default:
-                fprintf(stderr, "Usage: %s [-d dbdir] [-p port] [-v]\n", argv[0]);
+                usage(argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
 
+    // one-off conversion of existing hour file, e.g. backfill
+    if (config.export_file != NULL)
+        return export_parquet(config.export_file) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    if (config.filter_file != NULL)
+        return build_filter(config.filter_file) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    if (config.query) {
+        if (config.dbdir == NULL)
+            config.dbdir = (char *)"./db";
+        return query_db();
+    }
+
     printf("logcollectd started\n");
     printf("Version: %s\n", VERSION);
 
     if (config.dbdir == NULL) {
-        config.dbdir = "./db";
+        config.dbdir = (char *)"./db";
     }
     if (config.verbose) {
         printf("dbdir: %s\n", config.dbdir);
@@ -246,57 +7152,196 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (config.storage == NULL)
+        config.storage = (char *)"sqlite";
+    {
+        storage *st = storage_create(config.storage);
+        if (st == NULL) {
+            fprintf(stderr, "Unknown storage backend %s\n", config.storage);
+            exit(EXIT_FAILURE);
+        }
+        delete st;
+    }
+    // watermark is committed in the same transaction as rows
+    if (config.journal && strcmp(config.storage, "sqlite") != 0) {
+        fprintf(stderr, "--journal requires sqlite storage\n");
+        exit(EXIT_FAILURE);
+    }
+
     // default compress_age is 7 days in seconds
     if (config.compress_age == 0) {
         config.compress_age = 7 * 86400;
         if (config.verbose)
             printf("compress_age: %d\n", config.compress_age);
     }
-    // open listener
-    fd.sock = open_listener(config.port);
 
-    // create db thread
-    pthread_t db_thread_id;
-    pthread_create(&db_thread_id, NULL, db_thread, NULL);
+    // listen first, messages wait in socket buffers and queue until stores are ready
+    fd.unixsock = -1;
+    if (config.socket_filter != NULL)
+        sockfilter_parse(config.socket_filter);
+    if (config.upgrade_path == NULL || handoff_takeover(config.upgrade_path) < 0) {
+        open_listeners();
+        if (config.unix_path != NULL)
+            fd.unixsock = open_unix_listener(config.unix_path);
+    } else {
+        for (int i = 0; i < fd.nsocks; i++)
+            if (sockfilter.enabled)
+                sockfilter_attach(fd.socks[i]);
+            else
+                setsockopt(fd.socks[i], SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+    }
+    // taken over sockets keep buffer size grown by previous process
+    if (config.rcvbuf_max <= 0)
+        config.rcvbuf_max = RCVBUF_MAX;
+    for (int i = 0; i < fd.nsocks; i++)
+        rxbuf_init(fd.socks[i], &fd.rx[i], handoff.peer < 0);
+
+    // main store in dbdir, hourly as before; --store adds named stores
+    stores.list[0].name = "main";
+    stores.list[0].dir = config.dbdir;
+    stores.list[0].interval = 3600;
+    stores.list[0].compress_age = config.compress_age;
+    stores.n = 1;
+    for (int i = 0; i < config.nstores; i++)
+        store_add(config.stores[i]);
+    stores_shard();
+    if (config.numa)
+        numa_init();
+    for (int i = 0; i < stores.n; i++) {
+        logstore *ls = &stores.list[i];
+        // shards are merged by query, segment files are not
+        if (ls->nshards > 1 && strcmp(config.storage, "sqlite") != 0) {
+            fprintf(stderr, "Store %s: shards require sqlite storage\n", ls->name);
+            exit(EXIT_FAILURE);
+        }
+        if (access(ls->dir, F_OK) == -1) {
+            fprintf(stderr, "Store %s dir %s does not exist\n", ls->name, ls->dir);
+            exit(EXIT_FAILURE);
+        }
+        if (ls->archive != NULL && access(ls->archive, F_OK) == -1) {
+            fprintf(stderr, "Store %s archive dir %s does not exist\n", ls->name, ls->archive);
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_init(&ls->queue.lock, NULL);
+        pthread_mutex_init(&ls->usage_lock, NULL);
+        if (config.verbose && ls->shard == 0)
+            printf("Store %s: dir %s, interval %ds, max size %lld, retention %ds, compress age %ds, quota %lld, "
+                   "shards %d\n", ls->name, ls->dir, ls->interval, (long long)ls->max_size, ls->retention,
+                   ls->compress_age, (long long)ls->quota, ls->nshards);
+        ls->node = config.numa ? numa_dev_node(ls->dir) : -1;
+        if (config.numa && ls->shard == 0) {
+            if (ls->node >= 0)
+                printf("Store %s: storage on node %d, writers bound to it\n", ls->name, ls->node);
+            else
+                printf("Store %s: storage node unknown, writers not bound\n", ls->name);
+        }
+    }
+    // per-sender rate limit, disabled by default
+    if (config.ratelimit_rate > 0) {
+        if (config.ratelimit_burst < 1)
+            config.ratelimit_burst = config.ratelimit_rate * 2 < 1 ? 1 : config.ratelimit_rate * 2;
+        if (config.ratelimit_table <= 0)
+            config.ratelimit_table = 65536;
+        ratelimit_init();
+    }
+
+    // collapse repeated messages, disabled by default
+    if (config.dedup) {
+        if (config.dedup_window <= 0)
+            config.dedup_window = 4;
+        if (config.dedup_window > DEDUP_MAX_WINDOW)
+            config.dedup_window = DEDUP_MAX_WINDOW;
+        if (config.dedup_delay <= 0)
+            config.dedup_delay = 2;
+        dedup_init();
+    }
+
+    if (config.rules_file != NULL)
+        rules_load(config.rules_file);
+
+    // after takeover, writers start once previous process has drained
+    if (handoff.peer < 0)
+        start_services();
 
-    if (config.verbose)
-        printf("Listening on port %d\n", config.port);
     // dbfile is updated each hour, named YYYYMMDDHH.db
     while (1) {
         // check for new messages over select()
         {
-            char remote[INET_ADDRSTRLEN];
             fd_set readfds;
+            int maxfd = -1;
             FD_ZERO(&readfds);
-            FD_SET(fd.sock, &readfds);
+            // handoff backlog full: leave messages in socket buffers until
+            // previous process has drained
+            int held = handoff.peer >= 0 && handoff.pending.size() >= QUEUE_MAX;
+            for (int i = 0; i < fd.nsocks && !held; i++) {
+                FD_SET(fd.socks[i], &readfds);
+                if (fd.socks[i] > maxfd)
+                    maxfd = fd.socks[i];
+            }
+            if (fd.unixsock >= 0 && !held) {
+                FD_SET(fd.unixsock, &readfds);
+                if (fd.unixsock > maxfd)
+                    maxfd = fd.unixsock;
+            }
+            if (handoff.ctl >= 0) {
+                FD_SET(handoff.ctl, &readfds);
+                if (handoff.ctl > maxfd)
+                    maxfd = handoff.ctl;
+            }
+            if (handoff.peer >= 0) {
+                FD_SET(handoff.peer, &readfds);
+                if (handoff.peer > maxfd)
+                    maxfd = handoff.peer;
+            }
+            for (int i = 0; i < xdp.nqueues; i++) {
+                FD_SET(xdp.q[i].fd, &readfds);
+                if (xdp.q[i].fd > maxfd)
+                    maxfd = xdp.q[i].fd;
+            }
             struct timeval tv;
             tv.tv_sec = 1;
             tv.tv_usec = 0;
-            int retval = select(fd.sock + 1, &readfds, NULL, NULL, &tv);
+            int retval = select(maxfd + 1, &readfds, NULL, NULL, &tv);
             if (retval == -1) {
-                perror("select()");
+                // SIGHUP (upstream reload) interrupts select
+                if (errno != EINTR)
+                    perror("select()");
             } else if (retval) {
-                // read message
-                char buffer[65536];
-                struct sockaddr_in clientname;
-                socklen_t clientnamelen = sizeof(clientname);
-                int recvlen = recvfrom(fd.sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&clientname, &clientnamelen);
-                if (recvlen > 0) {
-                    buffer[recvlen] = 0;
-                    // fill remote
-                    inet_ntop(AF_INET, &(clientname.sin_addr), remote, INET_ADDRSTRLEN);
-                    // if queue size is too big, drop message to avoid OOM
-                    if (queue.size() > 100000) {
-                        printf("Queue is too big, dropping message\n");
-                        continue;
+                for (int i = 0; i < fd.nsocks; i++) {
+                    if (FD_ISSET(fd.socks[i], &readfds)) {
+                        receive_udp(fd.socks[i], &fd.rx[i]);
+                        if (config.numa)
+                            numa_receiver(fd.socks[i]);
                     }
-                    // add to queue
-                    queue.push(std::make_tuple(time(NULL), remote, buffer));
                 }
-            } else {
+                if (fd.unixsock >= 0 && FD_ISSET(fd.unixsock, &readfds))
+                    receive_unix(fd.unixsock);
+                for (int i = 0; i < xdp.nqueues; i++) {
+                    if (FD_ISSET(xdp.q[i].fd, &readfds))
+                        xdp_receive(i);
+                }
+                // control socket is created by handoff_ready(), check it first
+                if (handoff.ctl >= 0 && FD_ISSET(handoff.ctl, &readfds))
+                    handoff_serve();
+                if (handoff.peer >= 0 && FD_ISSET(handoff.peer, &readfds))
+                    handoff_ready();
+            }
+            rxbuf_sweep();
+            if (ratelimit.table != NULL)
+                ratelimit_sweep();
+            if (dedup.table != NULL)
+                dedup_sweep();
+            if (relay_reload_pending) {
+                relay_reload_pending = 0;
+                printf("Reloading upstreams, %d active\n", relay_configure());
+            }
+            if (config.stats_file != NULL)
+                write_stats();
+            if (retval == 0) {
                 // no new messages
                 usleep(1000);
             }
-        }        
+        }
     }
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,77 @@
+/*
+    * Relay backlog: frames written by backlog_append() are read back in
+    * order (empty and large ones too), reading resyncs past corrupted bytes
+    * to next valid frame, torn last frame is skipped
+*/
+#define LOGCOLLECTD_NO_MAIN
+#include "logcollectd.cpp"
+#include "tests/check.h"
+
+static upstream u;
+
+static void backlog_reset(const std::string &content) {
+    if (ftruncate(u.backlog_fd, 0) < 0 || pwrite(u.backlog_fd, content.data(), content.size(), 0) != (ssize_t)content.size())
+        perror("backlog test file");
+    u.backlog_read = 0;
+    u.backlog_write = content.size();
+}
+
+// read whole backlog the way sender does
+static std::vector<std::string> backlog_drain() {
+    std::vector<std::string> all, batch;
+    while (u.backlog_read < u.backlog_write) {
+        batch.clear();
+        off_t len = backlog_read(&u, batch);
+        if (len == 0)
+            break;
+        all.insert(all.end(), batch.begin(), batch.end());
+        u.backlog_read += len;
+    }
+    return all;
+}
+
+int main() {
+    char path[] = "/tmp/test_backlog.XXXXXX";
+    u.backlog_fd = mkstemp(path);
+    u.backlog_path = path;
+    unlink(path);
+    CHECK(u.backlog_fd >= 0);
+
+    // round trip, more frames than one batch
+    std::vector<std::string> msgs;
+    msgs.push_back("<13>first");
+    msgs.push_back("");
+    msgs.push_back(std::string(65536, 'x'));
+    msgs.push_back("with 12 digits and spaces");
+    for (int i = 0; i < 200; i++)
+        msgs.push_back("<14>msg " + std::to_string(i));
+    backlog_reset("");
+    backlog_append(&u, msgs);
+    CHECK(u.backlog_write > 0);
+    CHECK(backlog_drain() == msgs);
+    CHECK(u.backlog_read == u.backlog_write);
+
+    // garbage between frames is skipped, frames after it are kept, torn
+    // last frame is dropped
+    backlog_reset("9 <13>firstzz 12garbage 5 hello3 abc2 x");
+    std::vector<std::string> got = backlog_drain();
+    CHECK(got.size() == 3 && got[0] == "<13>first" && got[1] == "hello" && got[2] == "abc");
+
+    // while resyncing, frame is taken only if next one parses too, and
+    // garbage length reaching past end does not swallow the rest
+    backlog_reset("abc 5 hello99999999 zz 3 end");
+    got = backlog_drain();
+    CHECK(got.size() == 1 && got[0] == "end");
+    backlog_reset("x 5 hello3 abc");
+    got = backlog_drain();
+    CHECK(got.size() == 2 && got[0] == "hello" && got[1] == "abc");
+
+    // torn last frame (crash during append) is dropped, not waited for
+    backlog_reset("3 one3 two10 thr");
+    got = backlog_drain();
+    CHECK(got.size() == 2 && got[0] == "one" && got[1] == "two");
+    CHECK(u.backlog_read == u.backlog_write);
+
+    close(u.backlog_fd);
+    return failures != 0;
+}
@@ -0,0 +1,158 @@
+/*
+    * Journal replay after crash: every journaled message ends up either in
+    * database or queued again, exactly once, also when high severities were
+    * written ahead of watermark and last segment has torn tail
+*/
+#define LOGCOLLECTD_NO_MAIN
+#include "logcollectd.cpp"
+#include "tests/check.h"
+
+#define MESSAGES 300
+
+static std::string dir;
+
+// writer takes n batches as db_thread does, returns records written
+static size_t write_batches(logstore *ls, int n, size_t max) {
+    storage *st = storage_create("sqlite");
+    st->open((dir + "/2026010100.sqlite3").c_str());
+    std::set<int64_t> ahead = ls->jahead;
+    journal_mark mark;
+    mark.ahead = &ahead;
+    std::vector<logentry> batch;
+    size_t written = 0;
+    for (int i = 0; i < n; i++) {
+        if (writer_take(ls, batch, max, &mark, ahead) == 0)
+            break;
+        CHECK(st->write(batch, &mark) == 0);
+        writer_applied(ls, &mark);
+        written += batch.size();
+    }
+    st->close();
+    delete st;
+    return written;
+}
+
+// process dies: queue and journal state are gone, files stay
+static void crash(logstore *ls) {
+    for (int sev = 0; sev < NUM_SEVERITIES; sev++)
+        ls->queue.lanes[sev].clear();
+    ls->queue.size = 0;
+    ls->jpending.clear();
+    ls->jahead.clear();
+    ls->jsegs.clear();
+    ls->jreplay.clear();
+    ls->held.clear();
+    if (ls->jfd >= 0)
+        close(ls->jfd);
+    ls->jfd = -1;
+}
+
+static void restart(logstore *ls) {
+    journal_recover(ls);
+    journal_replay(ls);
+}
+
+// times each message is in database or queue
+static std::map<std::string, int> seen(logstore *ls) {
+    std::map<std::string, int> count;
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    if (sqlite3_open((dir + "/2026010100.sqlite3").c_str(), &db) == SQLITE_OK &&
+        sqlite3_prepare_v2(db, "SELECT message FROM log;", -1, &stmt, NULL) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+            count[(const char *)sqlite3_column_text(stmt, 0)]++;
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_close(db);
+    for (int sev = 0; sev < NUM_SEVERITIES; sev++)
+        for (size_t i = 0; i < ls->queue.lanes[sev].size(); i++)
+            count[ls->queue.lanes[sev][i].msg]++;
+    return count;
+}
+
+static int exactly_once(logstore *ls, int n) {
+    std::map<std::string, int> count = seen(ls);
+    int ok = (int)count.size() == n;
+    for (auto it = count.begin(); it != count.end(); it++)
+        if (it->second != 1) {
+            printf("%s seen %d times\n", it->first.c_str(), it->second);
+            ok = 0;
+        }
+    return ok;
+}
+
+int main() {
+    char tmpl[] = "/tmp/test_journal.XXXXXX";
+    CHECK(mkdtemp(tmpl) != NULL);
+    dir = tmpl;
+    config.journal = 1;
+    config.storage = (char *)"sqlite";
+    handoff.peer = -1;
+    stores.n = 1;
+    logstore *ls = &stores.list[0];
+    ls->name = "main";
+    ls->dir = dir.c_str();
+    ls->nshards = 1;
+    ls->shard = 0;
+    ls->node = -1;
+    pthread_mutex_init(&ls->queue.lock, NULL);
+
+    restart(ls);
+    CHECK(ls->queue.size == 0);
+    // severities mixed, so lanes are written out of journal order
+    for (int i = 0; i < MESSAGES; i++) {
+        logentry e;
+        memset(&e.host, 0, sizeof(e.host));
+        e.ts = 1767225600 + i;
+        e.pid = e.uid = -1;
+        char msg[64];
+        snprintf(msg, sizeof(msg), "<%d>message %d", 8 + (i * 7) % 8, i);
+        e.msg = msg;
+        enqueue(e);
+    }
+    journal_flush(ls);
+    CHECK(ls->queue.size == MESSAGES);
+
+    // some batches are committed, then process dies
+    CHECK(write_batches(ls, 3, 40) == 120);
+    CHECK(ls->japplied < ls->jend);
+    // next batch is taken but dies before its commit
+    int64_t applied = ls->japplied;
+    std::set<int64_t> ahead = ls->jahead;
+    journal_mark mark;
+    mark.ahead = &ahead;
+    std::vector<logentry> batch;
+    CHECK(writer_take(ls, batch, 40, &mark, ahead) == 40);
+    CHECK(ls->japplied == applied);
+    crash(ls);
+    // torn record of commit in progress
+    int fd = open(journal_path(ls, 0).c_str(), O_WRONLY | O_APPEND);
+    CHECK(fd >= 0 && write(fd, "\x20\x00\x00\x00torn", 8) == 8);
+    close(fd);
+    struct stat sb;
+    CHECK(stat(journal_path(ls, 0).c_str(), &sb) == 0);
+    off_t size = sb.st_size;
+
+    restart(ls);
+    CHECK(ls->queue.size == MESSAGES - 120);
+    CHECK(exactly_once(ls, MESSAGES));
+    CHECK(stat(journal_path(ls, 0).c_str(), &sb) == 0 && sb.st_size == size - 8);
+
+    // replayed records are written, crash again: nothing is replayed twice
+    CHECK(write_batches(ls, 2, 50) == 100);
+    crash(ls);
+    restart(ls);
+    CHECK(ls->queue.size == MESSAGES - 220);
+    CHECK(exactly_once(ls, MESSAGES));
+
+    // all written, nothing left to replay
+    CHECK(write_batches(ls, 100, 50) == MESSAGES - 220);
+    crash(ls);
+    restart(ls);
+    CHECK(ls->queue.size == 0);
+    CHECK(exactly_once(ls, MESSAGES));
+
+    std::string cmd = "rm -rf " + dir;
+    CHECK(system(cmd.c_str()) == 0);
+    return failures != 0;
+}
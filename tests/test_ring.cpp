@@ -0,0 +1,108 @@
+/*
+    * Consistent-hash relay: every host goes to one upstream, load is spread,
+    * removing or adding upstream moves only hosts of that upstream, slot
+    * no longer running is skipped until ring is rebuilt
+*/
+#define LOGCOLLECTD_NO_MAIN
+#include "logcollectd.cpp"
+#include "tests/check.h"
+
+#define HOSTS 20000
+
+static void slot_init(int i, const char *spec) {
+    upstream *u = &relay.list[i];
+    u->spec = spec;
+    u->active = 1;
+    u->retired = 0;
+    pthread_mutex_init(&u->lock, NULL);
+    pthread_cond_init(&u->cond, NULL);
+    if (i >= relay.n)
+        relay.n = i + 1;
+}
+
+// slot relay_push() sends host to, -1 if none or more than one
+static int owner(uint32_t host) {
+    logentry e;
+    memset(&e.host, 0, sizeof(e.host));
+    memcpy(e.host.a + 12, &host, 4);
+    for (int i = 0; i < relay.n; i++)
+        relay.list[i].queue.clear();
+    relay_push(e);
+    int slot = -1;
+    for (int i = 0; i < relay.n; i++) {
+        if (relay.list[i].queue.empty())
+            continue;
+        if (slot >= 0 || relay.list[i].queue.size() != 1)
+            return -1;
+        slot = i;
+    }
+    return slot;
+}
+
+int main() {
+    config.forward_hash = 1;
+    slot_init(0, "udp://10.0.0.1:514");
+    slot_init(1, "udp://10.0.0.2:514");
+    slot_init(2, "udp://10.0.0.3:514");
+    slot_init(3, "tcp://10.0.0.4:514");
+    ring_build();
+    CHECK(relay.ring.size() == 4 * RING_VNODES);
+
+    std::vector<int> before(HOSTS);
+    int count[4] = {0};
+    for (uint32_t h = 0; h < HOSTS; h++) {
+        before[h] = owner(h);
+        CHECK(before[h] >= 0);
+        if (before[h] >= 0)
+            count[before[h]]++;
+    }
+    // with 128 points each, no upstream is far off its quarter
+    for (int i = 0; i < 4; i++)
+        CHECK(count[i] > HOSTS / 4 / 2 && count[i] < HOSTS / 4 * 2);
+
+    // removed upstream: its hosts move, all others stay
+    relay.list[2].retired = 1;
+    ring_build();
+    int moved = 0;
+    for (uint32_t h = 0; h < HOSTS; h++) {
+        int now = owner(h);
+        CHECK(now >= 0 && now != 2);
+        if (before[h] != 2)
+            CHECK(now == before[h]);
+        moved += now != before[h];
+    }
+    CHECK(moved == count[2]);
+
+    // added back: same hosts return, nothing else moves
+    relay.list[2].retired = 0;
+    ring_build();
+    for (uint32_t h = 0; h < HOSTS; h++)
+        CHECK(owner(h) == before[h]);
+
+    // new upstream takes hosts only from others, never swaps between them
+    slot_init(4, "udp://10.0.0.5:514");
+    ring_build();
+    int taken = 0;
+    for (uint32_t h = 0; h < HOSTS; h++) {
+        int now = owner(h);
+        CHECK(now == before[h] || now == 4);
+        taken += now == 4;
+    }
+    CHECK(taken > 0);
+
+    // sender gone before ring is rebuilt: its hosts go to next point
+    relay.list[4].active = 0;
+    for (uint32_t h = 0; h < HOSTS; h++)
+        CHECK(owner(h) == before[h]);
+
+    // all mode copies to every running upstream
+    config.forward_hash = 0;
+    logentry e;
+    memset(&e.host, 0, sizeof(e.host));
+    for (int i = 0; i < relay.n; i++)
+        relay.list[i].queue.clear();
+    relay_push(e);
+    for (int i = 0; i < relay.n; i++)
+        CHECK(relay.list[i].queue.size() == (i == 4 ? 0u : 1u));
+    return failures != 0;
+}
@@ -0,0 +1,97 @@
+/*
+    * Routing rules: Aho-Corasick automaton must find exactly the rules
+    * whose pattern is a substring of message (overlapping, nested, suffix
+    * of each other), same as naive search
+*/
+#define LOGCOLLECTD_NO_MAIN
+#include "logcollectd.cpp"
+#include "tests/check.h"
+
+static void add_rule(int action, const char *arg, const char *pattern, int store = 0) {
+    rule r;
+    r.action = action;
+    r.line = rules.list.size() + 1;
+    r.arg = arg;
+    r.store = store;
+    r.pattern = pattern;
+    r.matches = 0;
+    rules.list.push_back(r);
+}
+
+// expected result of rules_apply() by plain substring search
+static int naive_apply(logentry &e) {
+    int drop = 0, routed = 0;
+    for (size_t i = 0; i < rules.list.size(); i++) {
+        const rule &r = rules.list[i];
+        if (e.msg.find(r.pattern) == std::string::npos)
+            continue;
+        if (r.action == RULE_DROP) {
+            drop = 1;
+        } else if (r.action == RULE_TAG && ("," + e.tags + ",").find("," + r.arg + ",") == std::string::npos) {
+            if (!e.tags.empty())
+                e.tags += ',';
+            e.tags += r.arg;
+        } else if (r.action == RULE_ROUTE && !routed) {
+            e.store = r.store;
+            routed = 1;
+        }
+    }
+    return drop;
+}
+
+int main() {
+    add_rule(RULE_TAG, "he", "he");
+    add_rule(RULE_TAG, "she", "she");
+    add_rule(RULE_TAG, "his", "his");
+    add_rule(RULE_TAG, "hers", "hers");
+    add_rule(RULE_TAG, "abab", "abab");
+    add_rule(RULE_TAG, "bab", "bab");
+    // two rules with one tag, tag is added once
+    add_rule(RULE_TAG, "b", "bb");
+    add_rule(RULE_TAG, "b", "ba");
+    add_rule(RULE_DROP, "", "sheb");
+    // first matching route wins, whatever matches first in message
+    add_rule(RULE_ROUTE, "s1", "rs", 1);
+    add_rule(RULE_ROUTE, "s2", "ir", 2);
+    rules_compile();
+
+    logentry e;
+    e.msg = "ushers";
+    CHECK(rules_apply(e) == 0);
+    CHECK(e.tags == "he,she,hers");
+    e.tags.clear();
+    e.msg = "xababab";
+    CHECK(rules_apply(e) == 0);
+    CHECK(e.tags == "abab,bab,b");
+    e.tags.clear();
+    e.msg = "shebang";
+    CHECK(rules_apply(e) == 1);
+    e.tags.clear();
+    e.msg = "";
+    CHECK(rules_apply(e) == 0 && e.tags.empty());
+    e.msg = "irs";
+    CHECK(rules_apply(e) == 0 && e.store == 1);
+
+    // random messages over small alphabet hit many overlaps
+    uint32_t seed = 1;
+    for (int n = 0; n < 20000; n++) {
+        std::string msg;
+        seed = seed * 1103515245 + 12345;
+        int len = (seed >> 16) % 24;
+        for (int i = 0; i < len; i++) {
+            seed = seed * 1103515245 + 12345;
+            msg += "abehirs"[(seed >> 16) % 7];
+        }
+        logentry got, want;
+        got.msg = want.msg = msg;
+        int gdrop = rules_apply(got);
+        int wdrop = naive_apply(want);
+        if (gdrop != wdrop || got.tags != want.tags || got.store != want.store) {
+            fprintf(stderr, "message \"%s\": drop %d tags \"%s\" store %d, expected %d \"%s\" %d\n", msg.c_str(),
+                    gdrop, got.tags.c_str(), got.store, wdrop, want.tags.c_str(), want.store);
+            failures++;
+            break;
+        }
+    }
+    return failures != 0;
+}
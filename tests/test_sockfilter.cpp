@@ -0,0 +1,186 @@
+/*
+    * Socket filter: compiled program keeps same datagrams as sockfilter_match()
+    * used for XDP frames, run by small cBPF interpreter over IPv4 and IPv6
+    * senders, and kernel accepts it and drops on loopback socket
+*/
+#define LOGCOLLECTD_NO_MAIN
+#include "logcollectd.cpp"
+#include "tests/check.h"
+
+static void compile(const char *expr) {
+    sockfilter.facilities.clear();
+    sockfilter.nets.clear();
+    sockfilter_parse(expr);
+}
+
+// load of size bytes at k from network header (SKF_NET_OFF) or UDP datagram
+static int load(const std::string &net, const std::string &dgram, uint32_t k, int size, uint32_t *v) {
+    const std::string *p = &dgram;
+    if ((int32_t)k < 0) {
+        p = &net;
+        k -= SKF_NET_OFF;
+    }
+    if (k + size > p->size())
+        return -1;
+    *v = 0;
+    for (int i = 0; i < size; i++)
+        *v = *v << 8 | (uint8_t)(*p)[k + i];
+    return 0;
+}
+
+// run sockfilter.prog, return 1 if datagram is kept
+static int run(const std::string &net, const std::string &dgram) {
+    const std::vector<struct sock_filter> &prog = sockfilter.prog;
+    uint32_t a = 0, x = 0, mem[BPF_MEMWORDS] = {0};
+    for (size_t pc = 0; pc < prog.size(); pc++) {
+        const struct sock_filter &f = prog[pc];
+        uint32_t v = BPF_SRC(f.code) == BPF_X ? x : f.k;
+        switch (BPF_CLASS(f.code)) {
+        case BPF_LD:
+            if (BPF_MODE(f.code) == BPF_ABS) {
+                if (load(net, dgram, f.k, BPF_SIZE(f.code) == BPF_B ? 1 : BPF_SIZE(f.code) == BPF_H ? 2 : 4, &a) < 0)
+                    return 0;
+            } else if (BPF_MODE(f.code) == BPF_LEN) {
+                a = dgram.size();
+            } else if (BPF_MODE(f.code) == BPF_IMM) {
+                a = f.k;
+            } else if (BPF_MODE(f.code) == BPF_MEM) {
+                a = mem[f.k];
+            }
+            break;
+        case BPF_ST:
+            mem[f.k] = a;
+            break;
+        case BPF_MISC:
+            x = a;
+            break;
+        case BPF_ALU:
+            switch (BPF_OP(f.code)) {
+            case BPF_ADD: a += v; break;
+            case BPF_SUB: a -= v; break;
+            case BPF_MUL: a *= v; break;
+            case BPF_AND: a &= v; break;
+            case BPF_RSH: a >>= v; break;
+            default: CHECK(!"unexpected alu");
+            }
+            break;
+        case BPF_JMP:
+            if (BPF_OP(f.code) == BPF_JA)
+                pc += f.k;
+            else if (BPF_OP(f.code) == BPF_JEQ)
+                pc += a == v ? f.jt : f.jf;
+            else if (BPF_OP(f.code) == BPF_JGT)
+                pc += a > v ? f.jt : f.jf;
+            else
+                CHECK(!"unexpected jump");
+            break;
+        case BPF_RET:
+            return f.k != 0;
+        default:
+            CHECK(!"unexpected instruction");
+            return 0;
+        }
+    }
+    CHECK(!"program fell through");
+    return 0;
+}
+
+// kept by compiled program, -1 when it disagrees with sockfilter_match()
+static int kept(const char *addr, const char *msg) {
+    hostaddr h;
+    CHECK(host_pton(addr, &h) == 0);
+    std::string net;
+    if (host_is_v4(&h)) {
+        net.assign(20, 0);
+        net[0] = 0x45;
+        net.replace(12, 4, (const char *)h.a + 12, 4);
+    } else {
+        net.assign(40, 0);
+        net[0] = 0x60;
+        net.replace(8, 16, (const char *)h.a, 16);
+    }
+    std::string dgram = std::string(8, 0) + msg;
+    int r = run(net, dgram);
+    if (r != sockfilter_match(&h, msg, strlen(msg))) {
+        printf("%s \"%s\": program %d, sockfilter_match %d\n", addr, msg, r, !r);
+        return -1;
+    }
+    return r;
+}
+
+// datagrams of msgs sent over loopback that pass filter attached by kernel
+static std::string loopback(const char **msgs, int n) {
+    int rx = socket(AF_INET, SOCK_DGRAM, 0), tx = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sa);
+    CHECK(bind(rx, (struct sockaddr *)&sa, sizeof(sa)) == 0);
+    CHECK(getsockname(rx, (struct sockaddr *)&sa, &len) == 0);
+    sockfilter_attach(rx);
+    for (int i = 0; i < n; i++)
+        CHECK(sendto(tx, msgs[i], strlen(msgs[i]), 0, (struct sockaddr *)&sa, sizeof(sa)) >= 0);
+    std::string got;
+    char buf[256];
+    struct pollfd pfd = { rx, POLLIN, 0 };
+    while (poll(&pfd, 1, 100) > 0) {
+        ssize_t r = recv(rx, buf, sizeof(buf), 0);
+        if (r < 0)
+            break;
+        got += std::string(buf, r) + " ";
+    }
+    close(rx);
+    close(tx);
+    return got;
+}
+
+int main() {
+    const char *filters[] = {
+        "severity<=warning", "severity<err", "facility=auth,facility=local7", "severity<=3,facility=user",
+        "net=10.1.0.0/16", "net=10.1.2.3", "net=0.0.0.0/0", "net=2001:db8::/32", "net=2001:db8::1",
+        "net=fe80::/10,net=192.168.0.0/24", "net=10.0.0.0/8,severity<=info,facility=kern,facility=user",
+        "net=10.1.0.0/16,net=2001:db8:0:1::/64,severity<notice",
+    };
+    const char *addrs[] = {
+        "10.1.2.3", "10.1.255.1", "10.200.0.1", "192.168.0.5", "11.0.0.1", "2001:db8::1", "2001:db8:0:1::5",
+        "2001:db9::1", "fe80::1", "febf::1", "::1",
+    };
+    const char *msgs[] = {
+        "<0>x", "<4>x", "<5>x", "<12>x", "<13>x", "<34>x", "<35>x", "<187>x", "<191>x", "<192>x", "<1000>x",
+        "<0013>x", "<9>", "<", "", "x", "<>x", "<ab>x", "<1", "<12", "<123", "<1234", "<12345>x", "13>x", "<1:>x", "<:3>x",
+    };
+    for (size_t f = 0; f < sizeof(filters) / sizeof(filters[0]); f++) {
+        compile(filters[f]);
+        CHECK(!sockfilter.prog.empty() && sockfilter.prog.size() <= BPF_MAXINSNS);
+        for (size_t a = 0; a < sizeof(addrs) / sizeof(addrs[0]); a++)
+            for (size_t m = 0; m < sizeof(msgs) / sizeof(msgs[0]); m++)
+                CHECK(kept(addrs[a], msgs[m]) >= 0);
+    }
+
+    // without valid PRI datagram is user.notice
+    compile("severity<=warning");
+    CHECK(kept("10.1.2.3", "<4>x") == 1);
+    CHECK(kept("10.1.2.3", "<13>x") == 0);
+    CHECK(kept("10.1.2.3", "no pri") == 0);
+    CHECK(kept("10.1.2.3", "<192>x") == 0);
+    compile("severity<=notice,facility=user");
+    CHECK(kept("10.1.2.3", "no pri") == 1);
+    CHECK(kept("10.1.2.3", "<34>x") == 0);
+    compile("net=10.1.0.0/16,net=2001:db8::/32");
+    CHECK(kept("10.1.255.1", "x") == 1);
+    CHECK(kept("10.2.0.1", "x") == 0);
+    CHECK(kept("2001:db8:ffff::1", "x") == 1);
+    CHECK(kept("2001:db9::1", "x") == 0);
+    CHECK(kept("::ffff:10.1.0.1", "x") == 1);
+
+    // kernel runs program attached to socket
+    const char *sent[] = { "<3>err", "<6>info", "<11>user.err", "bare" };
+    compile("severity<=err");
+    CHECK(loopback(sent, 4) == "<3>err <11>user.err ");
+    compile("net=127.0.0.0/8,facility=user");
+    CHECK(loopback(sent, 4) == "<11>user.err bare ");
+    compile("net=10.0.0.0/8");
+    CHECK(loopback(sent, 4) == "");
+    return failures != 0;
+}